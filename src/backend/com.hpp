@@ -7,24 +7,85 @@
 
 #include <common/coro.hpp>
 #include <iostream>
+#include <memory>
+#include <algorithm>
+#include <string_view>
+#include <cstring>
+#include <cassert>
+#include <sys/uio.h>
 
 ////////////////////////////////////////////////////////////////////////////////
 
 namespace com {
 
+// Receive buffer size for buffered channels. Large enough to hold a complete
+// http request header, so one read usually yields a whole request.
+constexpr std::size_t default_buffer_size = 16 * 1024;
+
 template<typename async_ctx, typename async_io_if>
 class channel final {
 public:
-  channel(async_ctx& ctx, async_io_if& io)
-    : m_ctx(ctx), m_io(io) {}
+  // Whether async_write_file can bypass user space
+  static constexpr bool sends_files =
+    requires(async_ctx& ctx, async_io_if& io) {
+      io.async_sendfile(ctx, 0, std::size_t(0), std::size_t(0));
+    };
+
+  // A buffer size of zero creates an unbuffered channel, which reads exactly
+  // the requested bytes. Buffered channels read as much as fits into their
+  // receive buffer and serve subsequent reads from it.
+  channel(async_ctx& ctx, async_io_if& io, std::size_t bufferSize = 0)
+    : m_ctx(ctx), m_io(io)
+    , m_buffer(bufferSize > 0 ? new char[bufferSize] : nullptr)
+    , m_capacity(bufferSize) {}
+
+  bool buffered() const { return m_capacity > 0; }
+
+  // Bytes received but not consumed yet. Valid until the next read operation.
+  std::string_view peek() const {
+    return std::string_view(m_buffer.get() + m_begin, m_end - m_begin);
+  }
+  void consume(std::size_t count) {
+    assert(count <= m_end - m_begin);
+    m_begin += count;
+    if (m_begin == m_end) {
+      m_begin = m_end = 0;
+    }
+  }
+  // Performs a single read into the free part of the receive buffer. Returns
+  // the number of new bytes, zero if the connection was closed.
+  coro::task<std::size_t>
+  async_fill() {
+    assert(buffered());
+    if (m_end == m_capacity) {
+      if (m_begin == 0) {
+        throw std::runtime_error("error: Receive buffer exhausted");
+      }
+      std::memmove(m_buffer.get(), m_buffer.get() + m_begin, m_end - m_begin);
+      m_end -= m_begin;
+      m_begin = 0;
+    }
+    auto bytes = co_await m_io.async_read(m_ctx, m_buffer.get() + m_end,
+                                          m_capacity - m_end);
+    m_end += bytes;
+    co_return bytes;
+  }
 
   coro::async_generator<char>
   async_char_stream() {
     while (true) {
       char c;
-      auto bytes = co_await m_io.async_read(m_ctx, &c, 1);
-      if (bytes != 1) {
-        co_return; // connection was closed
+      if (buffered()) {
+        if (m_begin == m_end && co_await async_fill() == 0) {
+          co_return; // connection was closed
+        }
+        c = m_buffer[m_begin];
+        consume(1);
+      } else {
+        auto bytes = co_await m_io.async_read(m_ctx, &c, 1);
+        if (bytes != 1) {
+          co_return; // connection was closed
+        }
       }
       co_yield c;
     }
@@ -32,6 +93,22 @@ public:
   coro::task<bool>
   async_read(char* buffer, std::size_t count) {
     std::size_t complete = 0;
+    if (buffered()) {
+      auto available = std::min(count, m_end - m_begin);
+      std::memcpy(buffer, m_buffer.get() + m_begin, available);
+      consume(available);
+      complete += available;
+      // Small reads go through the buffer, large ones directly to the caller
+      while (complete < count && count - complete < m_capacity / 2) {
+        if (co_await async_fill() == 0) {
+          co_return false; // connection was closed
+        }
+        auto bytes = std::min(count - complete, m_end - m_begin);
+        std::memcpy(buffer + complete, m_buffer.get() + m_begin, bytes);
+        consume(bytes);
+        complete += bytes;
+      }
+    }
     while (complete < count) {
       auto bytes = co_await m_io.async_read(m_ctx, buffer + complete,
                                             count - complete);
@@ -55,10 +132,74 @@ public:
     }
     co_return true;
   }
+  // Writes all buffers in order, with one gather write per send if the io
+  // interface supports it. Advances the buffers in place.
+  coro::task<bool>
+  async_writev(iovec* buffers, int count) {
+    if constexpr (requires { m_io.async_writev(m_ctx, buffers, count); }) {
+      skip(buffers, count, 0);
+      while (count > 0) {
+        auto bytes = co_await m_io.async_writev(m_ctx, buffers, count);
+        if (bytes == 0) {
+          co_return false; // connection was closed
+        }
+        skip(buffers, count, bytes);
+      }
+    } else {
+      for (int i = 0; i < count; ++i) {
+        if (!co_await async_write((char const*)buffers[i].iov_base,
+                                  buffers[i].iov_len)) {
+          co_return false; // connection was closed
+        }
+      }
+    }
+    co_return true;
+  }
+  // Writes count bytes of a file, starting at offset. data points to the same
+  // bytes in memory and is used if the file is -1 or the io interface cannot
+  // send files by itself.
+  coro::task<bool>
+  async_write_file(int file, char const* data,
+                   std::size_t offset, std::size_t count) {
+    if constexpr (sends_files) {
+      if (file >= 0) {
+        std::size_t complete = 0;
+        while (complete < count) {
+          auto bytes = co_await m_io.async_sendfile(m_ctx, file,
+                                                    offset + complete,
+                                                    count - complete);
+          if (bytes == 0) {
+            co_return false; // connection was closed
+          }
+          complete += bytes;
+        }
+        co_return true;
+      }
+    }
+    co_return co_await async_write(data + offset, count);
+  }
 
 private:
+  // Drops bytes from the front of the buffers, and all leading empty buffers
+  static void skip(iovec*& buffers, int& count, std::size_t bytes) {
+    while (count > 0 && bytes >= buffers->iov_len) {
+      bytes -= buffers->iov_len;
+      ++buffers;
+      --count;
+    }
+    if (bytes > 0) {
+      assert(count > 0);
+      buffers->iov_base = (char*)buffers->iov_base + bytes;
+      buffers->iov_len -= bytes;
+    }
+  }
+
   async_ctx& m_ctx;
   async_io_if& m_io;
+  std::unique_ptr<char[]> m_buffer;
+  std::size_t m_capacity;
+  std::size_t m_begin = 0;
+  std::size_t m_end = 0;
 };
 
 } // com
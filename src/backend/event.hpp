@@ -6,11 +6,20 @@
 ////////////////////////////////////////////////////////////////////////////////
 
 #include <common/coro.hpp>
+#include "metrics.hpp"
 #include <cassert>
 #include <ev.h>
 #include <vector>
+#include <map>
 #include <queue>
+#include <deque>
+#include <optional>
+#include <utility>
+#include <memory>
+#include <thread>
 #include <iostream>
+#include <stdexcept>
+#include <algorithm>
 
 ////////////////////////////////////////////////////////////////////////////////
 
@@ -28,21 +37,108 @@ static void event_cb(struct ev_loop* /* loop */,
 
 ////////////////////////////////////////////////////////////////////////////////
 
+// One long-lived ev_io per fd and direction. An awaitable parks on it while it
+// waits. The watcher stays armed after it fired, so back to back waits on a busy
+// connection do not touch the kernel interest list. It is only disarmed when it
+// fires with nobody parked, or when the fd goes away.
+class io_watcher final {
+public:
+  explicit io_watcher(int events) noexcept
+    : _events(events) {
+    _watcher.data = this;
+    ev_io_init(&_watcher, callback, -1, events);
+  }
+  ~io_watcher() {
+    disarm();
+  }
+  // Watchers are registered by address. A moved-to watcher starts unbound.
+  io_watcher(io_watcher&& other) noexcept
+    : io_watcher(other._events) {
+    other.disarm();
+  }
+  io_watcher& operator = (io_watcher&& other) noexcept {
+    disarm();
+    other.disarm();
+    return *this;
+  }
+  io_watcher(io_watcher const&) = delete;
+  io_watcher& operator = (io_watcher const&) = delete;
+
+  void bind(struct ev_loop* loop, int fd) noexcept {
+    if (loop != _loop || fd != _watcher.fd) {
+      disarm();
+      _loop = loop;
+      ev_io_set(&_watcher, fd, _events);
+    }
+  }
+  template<typename awaitable_type>
+  void park(awaitable_type* awaitable) {
+    assert(_loop != nullptr && "io_watcher is not bound");
+    assert(_waiter == nullptr && "only one waiter per direction");
+    _waiter = awaitable;
+    _notify = [](void* waiter) {
+      static_cast<awaitable_type*>(waiter)->resume();
+    };
+    if (!ev_is_active(&_watcher)) {
+      ::ev_io_start(_loop, &_watcher);
+      _arm_count++;
+    }
+  }
+  void unpark(void const* awaitable) noexcept {
+    if (_waiter == awaitable) {
+      _waiter = nullptr;
+    }
+  }
+  void disarm() noexcept {
+    _waiter = nullptr;
+    if (ev_is_active(&_watcher)) {
+      ::ev_io_stop(_loop, &_watcher);
+      _disarm_count++;
+    }
+  }
+
+  // Number of times the fd was added to / removed from the loop's interest
+  // list. Each of them costs an epoll_ctl/kevent call.
+  std::size_t arm_count() const noexcept { return _arm_count; }
+  std::size_t disarm_count() const noexcept { return _disarm_count; }
+  struct ev_loop* loop() const noexcept { return _loop; }
+
+private:
+  static void callback(struct ev_loop* /* loop */,
+                       ev_io* watcher,
+                       int /* revents */) {
+    auto self = static_cast<io_watcher*>(watcher->data);
+    if (self->_waiter == nullptr) {
+      self->disarm();
+      return;
+    }
+    // The waiter may park again or destroy this watcher.
+    auto waiter = std::exchange(self->_waiter, nullptr);
+    self->_notify(waiter);
+  }
+private:
+  ev_io _watcher;
+  int _events;
+  struct ev_loop* _loop = nullptr;
+  void* _waiter = nullptr;
+  void (*_notify)(void*) = nullptr;
+  std::size_t _arm_count = 0;
+  std::size_t _disarm_count = 0;
+};
+
+////////////////////////////////////////////////////////////////////////////////
+
 template<typename impl_type, typename signature_type>
 class io_operation;
 template<typename impl_type, typename return_type, typename ...arg_types>
 class io_operation<impl_type, return_type(arg_types...)> final {
 public:
-  friend void event_cb<io_operation, ev_io>(struct ev_loop*, struct ev_io*, int);
+  friend class io_watcher;
   using signature_type = return_type(arg_types...);
-  template<typename scheduler_type>
-  explicit io_operation(scheduler_type& s, int fd, arg_types... args)
-    : _loop(s.loop()), _args(std::forward<arg_types>(args)...) {
-    _watcher.data = this;
-    ev_io_init(&_watcher, (event_cb<io_operation, ev_io>), fd, impl_type::events);
-  }
+  explicit io_operation(io_watcher& watcher, arg_types... args)
+    : _watcher(watcher), _args(std::forward<arg_types>(args)...) {}
   ~io_operation() {
-    ev_io_stop(_loop, &_watcher);
+    _watcher.unpark(this);
   }
   io_operation(io_operation const&) = delete;
   io_operation& operator = (io_operation const&) = delete;
@@ -56,7 +152,9 @@ public:
   void await_suspend(std::experimental::coroutine_handle<> handle) {
     _handle = handle;
     assert(_handle && !_handle.done());
-    ev_io_start(_loop, &_watcher);
+    _allocator = coro::current_frame_allocator();
+    _suspended = ev_now(_watcher.loop());
+    _watcher.park(this);
   }
   auto await_resume() {
     _handle = nullptr;
@@ -66,16 +164,24 @@ private:
   void resume() {
     assert(_handle && !_handle.done());
     if (await_ready()) {
-      ev_io_stop(_loop, &_watcher);
+      // Loop time, the wait is only known to the iteration it ended in
+      auto waited = ev_now(_watcher.loop()) - _suspended;
+      metrics::record(metrics::histogram::IO_WAIT,
+                      static_cast<std::uint64_t>(std::max(waited, 0.) * 1e9));
+      // Continues with the frame allocator the coroutine suspended with
+      coro::frame_allocator_scope scope(_allocator);
       _handle.resume();
+    } else {
+      _watcher.park(this);
     }
   }
 private:
-  ev_io _watcher;
-  struct ev_loop* _loop;
+  io_watcher& _watcher;
   return_type _result;
   std::tuple<arg_types...> _args;
   std::experimental::coroutine_handle<> _handle;
+  coro::frame_allocator* _allocator = nullptr;
+  ev_tstamp _suspended = 0.;
 };
 
 ////////////////////////////////////////////////////////////////////////////////
@@ -103,6 +209,7 @@ public:
   void await_suspend(std::experimental::coroutine_handle<> handle) {
     _handle = handle;
     assert(_handle && !_handle.done());
+    _allocator = coro::current_frame_allocator();
     ev_signal_start(_loop, &_watcher);
   }
   void await_resume() {
@@ -112,24 +219,210 @@ private:
   void resume() {
     assert(_handle && !_handle.done());
     ev_signal_stop(_loop, &_watcher);
+    coro::frame_allocator_scope scope(_allocator);
     _handle.resume();
   }
 private:
   ev_signal _watcher;
   struct ev_loop* _loop;
   std::experimental::coroutine_handle<> _handle;
+  coro::frame_allocator* _allocator = nullptr;
 };
 
 ////////////////////////////////////////////////////////////////////////////////
 
-template<typename scheduler_type>
-coro::sync_task<void> garbage_collector(scheduler_type& s) {
-  while (true) {
-    co_await std::experimental::suspend_always{};
-    s.cleanup();
+// Resumes the awaiting coroutine after a number of seconds
+class timer final {
+public:
+  friend void event_cb<timer, ev_timer>(struct ev_loop*, struct ev_timer*, int);
+  template<typename scheduler_type>
+  explicit timer(scheduler_type& s, ev_tstamp seconds)
+    : _loop(s.loop()) {
+    _watcher.data = this;
+    ev_timer_init(&_watcher, (event_cb<timer, ev_timer>), seconds, 0.);
+  }
+  ~timer() {
+    ev_timer_stop(_loop, &_watcher);
+  }
+  timer(timer const&) = delete;
+  timer& operator = (timer const&) = delete;
+  timer(timer&&) = delete;
+  timer& operator = (timer&&) = delete;
+
+  bool await_ready() {
+    return false;
+  }
+  void await_suspend(std::experimental::coroutine_handle<> handle) {
+    _handle = handle;
+    assert(_handle && !_handle.done());
+    _allocator = coro::current_frame_allocator();
+    ev_timer_start(_loop, &_watcher);
+  }
+  void await_resume() {
+    _handle = nullptr;
+  }
+private:
+  void resume() {
+    assert(_handle && !_handle.done());
+    coro::frame_allocator_scope scope(_allocator);
+    _handle.resume();
+  }
+private:
+  ev_timer _watcher;
+  struct ev_loop* _loop;
+  std::experimental::coroutine_handle<> _handle;
+  coro::frame_allocator* _allocator = nullptr;
+};
+
+////////////////////////////////////////////////////////////////////////////////
+
+class timeout_queue;
+
+// Entry of a timeout_queue. Notifies its owner once the duration of the queue
+// has passed since it was armed, unless it is disarmed or armed again before.
+class deadline final {
+public:
+  deadline() noexcept = default;
+  ~deadline() {
+    disarm();
+  }
+  deadline(deadline const&) = delete;
+  deadline& operator = (deadline const&) = delete;
+  deadline(deadline&&) = delete;
+  deadline& operator = (deadline&&) = delete;
+
+  // Calls owner->expire() when the deadline passes. Arming an armed deadline
+  // starts it over.
+  template<typename owner_type>
+  void arm(timeout_queue& queue, owner_type* owner);
+  void disarm() noexcept;
+  bool armed() const noexcept {
+    return _queue != nullptr;
+  }
+private:
+  friend class timeout_queue;
+  timeout_queue* _queue = nullptr;
+  deadline* _prev = nullptr;
+  deadline* _next = nullptr;
+  ev_tstamp _expiry = 0.;
+  void* _owner = nullptr;
+  void (*_expire)(void*) = nullptr;
+};
+
+// All deadlines of one duration on a loop. Deadlines are appended when they
+// are armed, and as they all last equally long the list stays sorted by
+// expiry. A single ev_timer waits for the first one. Arming and disarming
+// unlinks and links a node, whereas an ev_timer per connection would cost an
+// O(log n) update of the loop's timer heap for every read.
+class timeout_queue final {
+public:
+  timeout_queue(struct ev_loop* loop, ev_tstamp duration) noexcept
+    : _loop(loop), _duration(duration) {
+    _timer.data = this;
+    ev_timer_init(&_timer, callback, duration, 0.);
+  }
+  ~timeout_queue() {
+    while (_head != nullptr) {
+      remove(*_head);
+    }
+  }
+  timeout_queue(timeout_queue const&) = delete;
+  timeout_queue& operator = (timeout_queue const&) = delete;
+  timeout_queue(timeout_queue&&) = delete;
+  timeout_queue& operator = (timeout_queue&&) = delete;
+
+  ev_tstamp duration() const noexcept {
+    return _duration;
+  }
+  // Number of armed deadlines
+  std::size_t size() const noexcept {
+    return _size;
+  }
+private:
+  friend class deadline;
+  void push(deadline& d) {
+    d._queue = this;
+    d._expiry = ev_now(_loop) + _duration;
+    d._prev = _tail;
+    d._next = nullptr;
+    (_tail != nullptr ? _tail->_next : _head) = &d;
+    _tail = &d;
+    _size++;
+    if (!ev_is_active(&_timer)) {
+      start();
+    }
+  }
+  void remove(deadline& d) noexcept {
+    assert(d._queue == this);
+    (d._prev != nullptr ? d._prev->_next : _head) = d._next;
+    (d._next != nullptr ? d._next->_prev : _tail) = d._prev;
+    d._queue = nullptr;
+    d._prev = d._next = nullptr;
+    _size--;
+    // Only an empty queue stops its timer. Otherwise it fires for a deadline
+    // that is gone and waits again for the current first one.
+    if (_head == nullptr) {
+      ::ev_timer_stop(_loop, &_timer);
+    }
+  }
+  // Waits for the first deadline
+  void start() {
+    assert(_head != nullptr);
+    ev_timer_set(&_timer, std::max(0., _head->_expiry - ev_now(_loop)), 0.);
+    ::ev_timer_start(_loop, &_timer);
+  }
+  static void callback(struct ev_loop* loop,
+                       ev_timer* watcher,
+                       int /* revents */) {
+    auto self = static_cast<timeout_queue*>(watcher->data);
+    auto now = ev_now(loop);
+    // Owners may arm or disarm deadlines of this queue while they are
+    // notified. Those armed now expire later than now.
+    while (self->_head != nullptr && self->_head->_expiry <= now) {
+      auto& expired = *self->_head;
+      self->remove(expired);
+      expired._expire(expired._owner);
+    }
+    if (self->_head != nullptr && !ev_is_active(&self->_timer)) {
+      self->start();
+    }
+  }
+private:
+  struct ev_loop* _loop;
+  ev_tstamp _duration;
+  ev_timer _timer;
+  deadline* _head = nullptr;
+  deadline* _tail = nullptr;
+  std::size_t _size = 0;
+};
+
+template<typename owner_type>
+void deadline::arm(timeout_queue& queue, owner_type* owner) {
+  disarm();
+  _owner = owner;
+  _expire = [](void* owner) {
+    static_cast<owner_type*>(owner)->expire();
+  };
+  queue.push(*this);
+}
+
+inline void deadline::disarm() noexcept {
+  if (_queue != nullptr) {
+    _queue->remove(*this);
   }
 }
 
+// Thrown by awaiting with_timeout when the deadline passed first
+class timeout final : public std::runtime_error {
+public:
+  timeout()
+    : std::runtime_error("error: Deadline exceeded") {}
+};
+
+////////////////////////////////////////////////////////////////////////////////
+
+class scheduler_pool;
+
 template<typename scheduler_type>
 coro::sync_task<void> signal_handler(scheduler_type& s, int signum) {
   co_await event::signal(s, signum);
@@ -138,65 +431,370 @@ coro::sync_task<void> signal_handler(scheduler_type& s, int signum) {
 
 class scheduler {
 public:
+  // Tag to create a scheduler on its own loop (ev_loop_new) instead of the
+  // default loop. Only the default loop handles signals.
+  struct secondary_t {};
+  static constexpr secondary_t secondary{};
+
   scheduler()
-    : _garbage_collector([this]() -> coro::sync_task<void> {
-        while (true) {
-          co_await std::experimental::suspend_always{};
-          cleanup();
-        }
-      }())
-    , _shutdown_handler([this]() -> coro::sync_task<void> {
-        shutdown();
-        co_return;
-      }())
-    , _loop(::ev_default_loop(0)) {
-    _garbage_collector.start();
-    _tasks.push_back(signal_handler(*this, SIGTERM));
-    _tasks.back().start().then(_shutdown_handler);
+    : scheduler(::ev_default_loop(0), false) {
+    _signal_handler.emplace(signal_handler(*this, SIGTERM));
+    _signal_handler->start().then(_shutdown_handler);
+  }
+  explicit scheduler(secondary_t)
+    : scheduler(::ev_loop_new(EVFLAG_AUTO), true) {}
+  ~scheduler() {
+    destroy_tasks();
+    _signal_handler.reset();
+    _timeouts.clear();
+    ::ev_async_stop(_loop, &_stop_watcher);
+    if (_owns_loop) {
+      ::ev_loop_destroy(_loop);
+    }
   }
+  scheduler(scheduler const&) = delete;
+  scheduler& operator = (scheduler const&) = delete;
+  scheduler(scheduler&&) = delete;
+  scheduler& operator = (scheduler&&) = delete;
+
   int run() {
     ::ev_run(_loop, 0);
     return 0;
   }
-  /*void run_once() {
+  void run_once() {
     ::ev_run(_loop, EVRUN_ONCE);
-  }*/
+  }
   struct ev_loop* loop() noexcept {
     return _loop;
   }
+  // The queue of all deadlines of that duration on this loop
+  timeout_queue& timeouts(ev_tstamp duration) {
+    auto& queue = _timeouts[duration];
+    if (!queue) {
+      queue = std::make_unique<timeout_queue>(_loop, duration);
+    }
+    return *queue;
+  }
 
   void execute(coro::sync_task<void>&& task) {
-    _tasks.push_back(std::move(task));
-    _tasks.back().start()
-      .then(_garbage_collector);
-  }
-  void cleanup() {
-    auto done = [](coro::sync_task<void> const& task) {
-      if (task.done()) {
-        try {
-          task.result();
-        } catch (std::runtime_error const& err) {
-          std::cout << "exception: " << err.what() << std::endl;
-        }
-      }
-      return task.done();
-    };
-    _tasks.erase(std::remove_if(_tasks.begin(), _tasks.end(), done),
-                 _tasks.end());
+    auto& slot = acquire();
+    slot.task.emplace(std::move(task));
+    _task_count++;
+    metrics::add(metrics::counter::TASKS);
+    slot.task->start();
+    if (slot.task->done()) {
+      release(slot);
+    } else {
+      slot.task->on_done(finished, &slot);
+    }
+  }
+  // Number of executed tasks that did not finish yet
+  std::size_t task_count() const noexcept {
+    return _task_count;
   }
   void trigger_shutdown_from_task() {
     ::ev_break(_loop, EVBREAK_ONE);
   }
+  // Thread-safe: breaks out of run() from any thread.
+  void request_stop() {
+    ::ev_async_send(_loop, &_stop_watcher);
+  }
 private:
+  friend class scheduler_pool;
+  scheduler(struct ev_loop* loop, bool owns_loop)
+    : _shutdown_handler(handle_shutdown())
+    , _loop(loop)
+    , _owns_loop(owns_loop) {
+    if (_loop == nullptr) {
+      throw std::runtime_error("error: Unable to create event loop");
+    }
+    _stop_watcher.data = this;
+    ev_async_init(&_stop_watcher, stop_cb);
+    ::ev_async_start(_loop, &_stop_watcher);
+    ::ev_unref(_loop); // the stop watcher alone must not keep run() alive
+  }
+  static void stop_cb(struct ev_loop* loop, ev_async* /* watcher */,
+                      int /* revents */) {
+    ::ev_break(loop, EVBREAK_ALL);
+  }
+  // Tasks live in slots, which are reused once their task finished. A task
+  // releases its own slot when it finishes, so neither is there a search for
+  // finished tasks, nor are the other slots moved around.
+  struct slot {
+    scheduler* owner;
+    std::optional<coro::sync_task<void>> task;
+    slot* next_free = nullptr;
+  };
+  slot& acquire() {
+    if (_free == nullptr) {
+      _slots.push_back(slot{ this, std::nullopt, nullptr });
+      return _slots.back();
+    }
+    return *std::exchange(_free, _free->next_free);
+  }
+  void release(slot& s) noexcept {
+    if (s.task->done()) {
+      try {
+        s.task->result();
+      } catch (std::runtime_error const& err) {
+        std::cout << "exception: " << err.what() << std::endl;
+      }
+    }
+    s.task.reset();
+    s.next_free = std::exchange(_free, &s);
+    _task_count--;
+    metrics::add(metrics::counter::TASKS, -1);
+  }
+  static void finished(void* context) {
+    auto s = static_cast<slot*>(context);
+    s->owner->release(*s);
+  }
+  void destroy_tasks() noexcept {
+    for (auto& s : _slots) {
+      if (s.task) {
+        release(s);
+      }
+    }
+  }
+  coro::sync_task<void> handle_shutdown() {
+    shutdown();
+    co_return;
+  }
   void shutdown() {
     std::cout << "shutdown" << std::endl;
-    _tasks.clear();
+    destroy_tasks();
   }
 private:
-  coro::sync_task<void> _garbage_collector;
   coro::sync_task<void> _shutdown_handler;
-  std::vector<coro::sync_task<void>> _tasks;
+  std::optional<coro::sync_task<void>> _signal_handler;
+  std::deque<slot> _slots;
+  slot* _free = nullptr;
+  std::size_t _task_count = 0;
+  std::map<ev_tstamp, std::unique_ptr<timeout_queue>> _timeouts;
   struct ev_loop* _loop;
+  bool _owns_loop;
+  ev_async _stop_watcher;
+};
+
+////////////////////////////////////////////////////////////////////////////////
+
+// Awaits a task unless it takes longer than the duration of the queue. Then
+// the task is destroyed where it is suspended, which cancels whatever it waits
+// for, and the awaiting coroutine gets an event::timeout instead of a result.
+template<typename return_type>
+class timeout_awaitable final {
+public:
+  friend class deadline;
+  timeout_awaitable(timeout_queue& queue, coro::task<return_type>&& task)
+    : _queue(queue), _task(std::move(task)) {}
+  timeout_awaitable(timeout_awaitable const&) = delete;
+  timeout_awaitable& operator = (timeout_awaitable const&) = delete;
+  timeout_awaitable(timeout_awaitable&&) = delete;
+  timeout_awaitable& operator = (timeout_awaitable&&) = delete;
+
+  bool await_ready() noexcept {
+    return false;
+  }
+  auto await_suspend(std::experimental::coroutine_handle<> handle) {
+    _handle = handle;
+    _allocator = coro::current_frame_allocator();
+    _deadline.arm(_queue, this);
+    return std::move(_task).operator co_await().await_suspend(handle);
+  }
+  decltype(auto) await_resume() {
+    _handle = nullptr;
+    _deadline.disarm();
+    if (_expired) {
+      auto cancelled = std::move(_task);
+      throw timeout();
+    }
+    return std::move(_task).operator co_await().await_resume();
+  }
+private:
+  void expire() {
+    assert(_handle && !_handle.done());
+    _expired = true;
+    coro::frame_allocator_scope scope(_allocator);
+    _handle.resume();
+  }
+private:
+  timeout_queue& _queue;
+  coro::task<return_type> _task;
+  deadline _deadline;
+  bool _expired = false;
+  std::experimental::coroutine_handle<> _handle;
+  coro::frame_allocator* _allocator = nullptr;
+};
+
+template<typename return_type>
+timeout_awaitable<return_type>
+with_timeout(timeout_queue& queue, coro::task<return_type>&& task) {
+  return timeout_awaitable<return_type>(queue, std::move(task));
+}
+
+template<typename scheduler_type, typename return_type>
+timeout_awaitable<return_type>
+with_timeout(scheduler_type& s, coro::task<return_type>&& task,
+             ev_tstamp seconds) {
+  return timeout_awaitable<return_type>(s.timeouts(seconds), std::move(task));
+}
+
+////////////////////////////////////////////////////////////////////////////////
+
+// Counts the holders of something there may only be so many of at a time.
+// One task may wait for room. It is resumed from the loop after the release
+// that made room, never from within release(), which may run while tasks are
+// being destroyed. Holders and waiter live on the same loop.
+class limiter final {
+public:
+  class awaitable;
+  explicit limiter(std::size_t limit) noexcept
+    : _limit(limit) {}
+  ~limiter() {
+    assert(_waiter == nullptr);
+  }
+  limiter(limiter const&) = delete;
+  limiter& operator = (limiter const&) = delete;
+  limiter(limiter&&) = delete;
+  limiter& operator = (limiter&&) = delete;
+
+  std::size_t limit() const noexcept {
+    return _limit;
+  }
+  std::size_t active() const noexcept {
+    return _active;
+  }
+  bool available() const noexcept {
+    return _active < _limit;
+  }
+  void acquire() noexcept {
+    _active++;
+  }
+  void release() noexcept;
+
+  // Resumes the awaiting coroutine once there is room
+  template<typename scheduler_type>
+  awaitable wait(scheduler_type& s) noexcept;
+
+private:
+  std::size_t _limit;
+  std::size_t _active = 0;
+  awaitable* _waiter = nullptr;
+};
+
+class limiter::awaitable final {
+public:
+  friend class limiter;
+  friend void event_cb<awaitable, ev_timer>(struct ev_loop*, struct ev_timer*, int);
+  awaitable(limiter& l, struct ev_loop* loop) noexcept
+    : _limiter(l), _loop(loop) {
+    _watcher.data = this;
+    ev_timer_init(&_watcher, (event_cb<awaitable, ev_timer>), 0., 0.);
+  }
+  ~awaitable() {
+    if (_limiter._waiter == this) {
+      _limiter._waiter = nullptr;
+    }
+    ev_timer_stop(_loop, &_watcher);
+  }
+  awaitable(awaitable const&) = delete;
+  awaitable& operator = (awaitable const&) = delete;
+  awaitable(awaitable&&) = delete;
+  awaitable& operator = (awaitable&&) = delete;
+
+  bool await_ready() noexcept {
+    return _limiter.available();
+  }
+  void await_suspend(std::experimental::coroutine_handle<> handle) noexcept {
+    assert(_limiter._waiter == nullptr && "only one waiter per limiter");
+    _handle = handle;
+    _allocator = coro::current_frame_allocator();
+    _limiter._waiter = this;
+  }
+  void await_resume() noexcept {
+    _handle = nullptr;
+  }
+private:
+  void wake() noexcept {
+    ev_timer_set(&_watcher, 0., 0.);
+    ev_timer_start(_loop, &_watcher);
+  }
+  void resume() {
+    assert(_handle && !_handle.done());
+    if (!_limiter.available()) {
+      // Taken again before the loop came around
+      _limiter._waiter = this;
+      return;
+    }
+    coro::frame_allocator_scope scope(_allocator);
+    _handle.resume();
+  }
+private:
+  limiter& _limiter;
+  struct ev_loop* _loop;
+  ev_timer _watcher;
+  std::experimental::coroutine_handle<> _handle;
+  coro::frame_allocator* _allocator = nullptr;
+};
+
+inline void limiter::release() noexcept {
+  assert(_active > 0);
+  _active--;
+  if (_waiter != nullptr && available()) {
+    std::exchange(_waiter, nullptr)->wake();
+  }
+}
+
+template<typename scheduler_type>
+limiter::awaitable limiter::wait(scheduler_type& s) noexcept {
+  return awaitable(*this, s.loop());
+}
+
+////////////////////////////////////////////////////////////////////////////////
+
+// N schedulers, each with its own loop and thread. The first one runs on the
+// calling thread on the default loop and decides when everything shuts down.
+class scheduler_pool {
+public:
+  explicit scheduler_pool(std::size_t count) {
+    _schedulers.push_back(std::make_unique<scheduler>());
+    while (_schedulers.size() < count) {
+      _schedulers.push_back(std::make_unique<scheduler>(scheduler::secondary));
+    }
+  }
+  scheduler_pool(scheduler_pool const&) = delete;
+  scheduler_pool& operator = (scheduler_pool const&) = delete;
+  scheduler_pool(scheduler_pool&&) = delete;
+  scheduler_pool& operator = (scheduler_pool&&) = delete;
+
+  std::size_t size() const noexcept {
+    return _schedulers.size();
+  }
+  scheduler& operator [] (std::size_t index) noexcept {
+    return *_schedulers[index];
+  }
+
+  int run() {
+    std::vector<std::thread> threads;
+    for (std::size_t i = 1; i < _schedulers.size(); ++i) {
+      threads.emplace_back([s = _schedulers[i].get()]() {
+        s->run();
+        // Frames created on the thread go back to its frame pool, which
+        // ends with the thread
+        s->destroy_tasks();
+      });
+    }
+    auto result = _schedulers[0]->run();
+    for (std::size_t i = 1; i < _schedulers.size(); ++i) {
+      _schedulers[i]->request_stop();
+    }
+    for (auto& thread : threads) {
+      thread.join();
+    }
+    return result;
+  }
+private:
+  std::vector<std::unique_ptr<scheduler>> _schedulers;
 };
 
 ////////////////////////////////////////////////////////////////////////////////
@@ -3,7 +3,19 @@
 #include "fs.hpp"
 #include <fstream>
 #include <vector>
+#include <algorithm>
 #include <iostream>
+#include <sstream>
+#include <iomanip>
+#include <ctime>
+#include <fcntl.h>
+#include <errno.h>
+#include <unistd.h>
+#include <sys/stat.h>
+#include <sys/mman.h>
+#if defined(__linux__)
+#include <sys/inotify.h>
+#endif
 
 ////////////////////////////////////////////////////////////////////////////////
 
@@ -22,19 +34,31 @@ readWhitelist(std::string const& fileName) {
   return names;
 }
 
-static std::vector<char>
-readFile(std::string const& fileName) {
-  std::vector<char> result;
-  std::ifstream file(fileName.c_str(),
-                     std::ios::binary | std::ios::ate);
-  if (file.is_open()) {
-    auto size = file.tellg();
-    file.seekg(0, std::ios::beg);
-    result.resize(size);
-    file.read(result.data(), size);
-  } else {
+static int
+openFile(std::string const& fileName) {
+  auto file = ::open(fileName.c_str(), O_RDONLY | O_CLOEXEC);
+  if (file < 0) {
     throw std::runtime_error("File not found");
   }
+  return file;
+}
+
+static std::vector<char>
+readFile(int file) {
+  struct stat info;
+  if (::fstat(file, &info) != 0) {
+    throw std::runtime_error("File not readable");
+  }
+  std::vector<char> result(info.st_size);
+  std::size_t complete = 0;
+  while (complete < result.size()) {
+    auto bytes = ::pread(file, result.data() + complete,
+                         result.size() - complete, complete);
+    if (bytes <= 0) {
+      throw std::runtime_error("File not readable");
+    }
+    complete += bytes;
+  }
   return result;
 }
 
@@ -56,41 +80,428 @@ mimeTypeFromFileName(std::string const& fileName) {
   return http::content::mime_type::TEXT;
 }
 
+static std::string
+headerFor(http::content const& content, http::response::status_code code) {
+  http::response response;
+  response.set_status_code(code);
+  response.set_content(&content);
+  return response.serialize_header();
+}
+
+// 64 bit FNV-1a of the content, as a quoted entity tag. The same bytes get
+// the same tag whether they are copied or mapped, and on every host.
+static std::string
+entityTagOf(char const* data, std::size_t size) {
+  std::uint64_t hash = 0xcbf29ce484222325ull;
+  for (std::size_t i = 0; i < size; ++i) {
+    hash ^= (std::uint8_t)data[i];
+    hash *= 0x100000001b3ull;
+  }
+  std::stringstream ss;
+  ss << '"' << std::hex << std::setw(16) << std::setfill('0') << hash << '"';
+  return ss.str();
+}
+
+static std::string
+lastModifiedOf(int file) {
+  struct stat info;
+  if (::fstat(file, &info) != 0) {
+    return {};
+  }
+  std::tm utc;
+  ::gmtime_r(&info.st_mtime, &utc);
+  char date[64];
+  auto length = std::strftime(date, sizeof(date),
+                              "%a, %d %b %Y %H:%M:%S GMT", &utc);
+  return std::string(date, length);
+}
+
+// Content codings with a precompressed sibling, and its file name extension
+static std::map<std::string, std::string> const encodingExtensions = {
+  { "gzip", ".gz" },
+  { "br", ".br" }
+};
+
+static std::string
+fileNameOf(std::string const& root, std::string const& location,
+           std::string const& encoding) {
+  if (encoding.empty()) {
+    return root + location;
+  }
+  return root + location + encodingExtensions.at(encoding);
+}
+
+// Strips the extension of a precompressed sibling from a location and
+// returns its encoding. Empty for everything else.
+static std::string
+encodingOf(std::string& location) {
+  for (auto& e : encodingExtensions) {
+    auto& extension = e.second;
+    if (location.size() > extension.size() &&
+        location.compare(location.size() - extension.size(),
+                         extension.size(), extension) == 0) {
+      location.resize(location.size() - extension.size());
+      return e.first;
+    }
+  }
+  return std::string();
+}
+
 auto timestampOf(std::string const& fileName) {
   std::filesystem::path p = std::filesystem::current_path() / fileName;
   return std::filesystem::last_write_time(p);
 }
 
-resource::resource(std::string const& root, std::string const& location)
+mapping::mapping(int file) {
+  struct stat info;
+  if (::fstat(file, &info) != 0) {
+    throw std::runtime_error("File not readable");
+  }
+  if (info.st_size == 0) {
+    return; // empty files cannot be mapped
+  }
+  auto address = ::mmap(nullptr, info.st_size, PROT_READ, MAP_SHARED, file, 0);
+  if (address == MAP_FAILED) {
+    throw std::runtime_error("File not mappable");
+  }
+  mAddress = address;
+  mSize = info.st_size;
+  // Bodies are read front to back. Small ones are written from memory, so
+  // their pages are requested right away, without waiting for them. Large
+  // ones usually go out with sendfile and never touch the mapping.
+  ::madvise(mAddress, mSize, MADV_SEQUENTIAL);
+  if (mSize < http::response::sendfile_threshold) {
+    ::madvise(mAddress, mSize, MADV_WILLNEED);
+  }
+}
+
+mapping::~mapping() {
+  if (mAddress != nullptr) {
+    ::munmap(mAddress, mSize);
+  }
+}
+
+struct resource::body {
+  body(std::string const& fileName, storage how, bool keepFile)
+    : file(openFile(fileName)) {
+    try {
+      // Everything that can fail happens before the file replaces another
+      if (how == storage::MAP) {
+        map = mapping(file);
+      } else {
+        copy = readFile(file);
+      }
+    } catch (...) {
+      ::close(file);
+      throw;
+    }
+    lastModified = lastModifiedOf(file);
+    if (!keepFile) {
+      ::close(file);
+      file = -1;
+    }
+    etag = entityTagOf(data(), size());
+  }
+  ~body() {
+    if (file >= 0) {
+      ::close(file);
+    }
+  }
+  body(body const&) = delete;
+  body& operator = (body const&) = delete;
+
+  char const* data() const {
+    return map.data() != nullptr ? map.data() : copy.data();
+  }
+  std::size_t size() const {
+    return map.data() != nullptr ? map.size() : copy.size();
+  }
+
+  // Holds the same bytes as the copy or the mapping, or -1
+  int file;
+  std::vector<char> copy;
+  mapping map;
+  std::string etag;
+  std::string lastModified;
+};
+
+class resource::version final : public http::content {
+public:
+  version(resource const& owner, std::shared_ptr<body const> b)
+    : mOwner(owner), mBody(std::move(b)) {
+    mOkHeader = headerFor(*this, http::response::status_code::OK);
+    mNotModifiedHeader = headerFor(*this, http::response::status_code::NOT_MODIFIED);
+  }
+  // Same body, described anew, e.g. once there are alternatives
+  std::shared_ptr<body const> const& contents() const {
+    return mBody;
+  }
+
+  virtual std::size_t size() const override {
+    return mBody->size();
+  }
+  virtual char const* data() const override {
+    return mBody->data();
+  }
+  virtual std::string const& location() const override {
+    return mOwner.location();
+  }
+  virtual mime_type type() const override {
+    return mOwner.type();
+  }
+  virtual int fd() const override {
+    return mBody->file;
+  }
+  virtual std::string_view ok_header() const override {
+    return mOkHeader;
+  }
+  virtual std::string_view etag() const override {
+    return mBody->etag;
+  }
+  virtual std::string_view last_modified() const override {
+    return mBody->lastModified;
+  }
+  virtual std::string_view not_modified_header() const override {
+    return mNotModifiedHeader;
+  }
+  virtual std::string_view encoding() const override {
+    return mOwner.encoding();
+  }
+  virtual bool has_alternatives() const override {
+    return mOwner.has_alternatives();
+  }
+private:
+  resource const& mOwner;
+  std::shared_ptr<body const> mBody;
+  std::string mOkHeader;
+  std::string mNotModifiedHeader;
+};
+
+resource::resource(std::string const& root, std::string const& location,
+                   std::string const& encoding, storage how, bool reloads)
   : mType(mimeTypeFromFileName(location))
   , mRoot(root)
   , mLocation(location)
-  , mData(readFile(mRoot + mLocation))
-  , mTime(timestampOf(mRoot + mLocation)) {}
-
-void resource::reload() {
-  auto time = timestampOf(mRoot + mLocation);
-  if (time != mTime) {
-    std::cout << "File '" << mRoot << mLocation << "' changed on disk. Refreshing..." << std::endl;
-    mData = readFile(mRoot + mLocation);
+  , mEncoding(encoding)
+  , mStorage(how)
+  , mReloads(reloads)
+  , mTime(timestampOf(fileNameOf(mRoot, mLocation, mEncoding))) {
+  mVersion = std::make_shared<version const>(*this, std::make_shared<body const>(
+    fileNameOf(mRoot, mLocation, mEncoding), mStorage, !mReloads));
+}
+
+resource::~resource() = default;
+
+void resource::reload(bool force) {
+  for (auto& encoded : mEncodings) {
+    encoded->reload(force);
+  }
+  auto fileName = fileNameOf(mRoot, mLocation, mEncoding);
+  auto time = timestampOf(fileName);
+  if (force || time != mTime) {
+    std::cout << "File '" << fileName << "' changed on disk. Refreshing..." << std::endl;
+    // Responses still being written keep the previous version
+    mVersion = std::make_shared<version const>(*this, std::make_shared<body const>(
+      fileName, mStorage, !mReloads));
     mTime = time;
   }
 }
 
-cache::cache(std::string const& root, bool reload)
-  : mReload(reload) {
-  auto names = readWhitelist(root + "/whitelist.ini");
+void resource::add_encoding(std::unique_ptr<resource> encoded) {
+  auto it = std::find_if(mEncodings.begin(), mEncodings.end(),
+                         [&](auto const& other) {
+                           return other->size() > encoded->size();
+                         });
+  mEncodings.insert(it, std::move(encoded));
+  // Now varies by Accept-Encoding
+  mVersion = std::make_shared<version const>(*this, mVersion->contents());
+}
+
+bool resource::has_encoding(std::string const& encoding) const {
+  return std::any_of(mEncodings.begin(), mEncodings.end(),
+                     [&](auto const& encoded) {
+                       return encoded->mEncoding == encoding;
+                     });
+}
+
+std::size_t resource::size() const {
+  return mVersion->size();
+}
+
+char const* resource::data() const {
+  return mVersion->data();
+}
+
+int resource::fd() const {
+  return mVersion->fd();
+}
+
+std::string_view resource::ok_header() const {
+  return mVersion->ok_header();
+}
+
+std::string_view resource::etag() const {
+  return mVersion->etag();
+}
+
+std::string_view resource::last_modified() const {
+  return mVersion->last_modified();
+}
+
+std::string_view resource::not_modified_header() const {
+  return mVersion->not_modified_header();
+}
+
+std::shared_ptr<http::content const> resource::snapshot() const {
+  // Resources that never change are not counted per response, which would
+  // make every thread serving them write to the same cache line.
+  if (!mReloads) {
+    return nullptr;
+  }
+  return mVersion;
+}
+
+cache::cache(std::string const& root, bool reload, storage how)
+  : mRoot(root)
+  , mReload(reload)
+  , mStorage(how) {
+  update();
+}
+
+void cache::update() {
+  auto names = readWhitelist(mRoot + "/whitelist.ini");
+  std::vector<std::pair<std::string, std::string>> encoded;
   for (auto name : names) {
     auto location = "/" + name;
-    auto fileName = root + location;
+    auto encoding = encodingOf(location);
+    if (!encoding.empty()) {
+      // Only served in place of the original
+      encoded.push_back(std::make_pair(location, encoding));
+      continue;
+    }
+    if (mEntries.count(location) > 0) {
+      continue;
+    }
     try {
-      mEntries.insert(
-        std::make_pair(location, std::make_unique<resource>(root, location)));
+      auto r = std::make_unique<resource>(mRoot, location, std::string(),
+                                          mStorage, mReload);
+      mEntries.insert(std::make_pair(location, std::move(r)));
     } catch (std::runtime_error& err) {
       std::cerr << "Unable to cache file: " << name << std::endl;
     }
   }
+  for (auto& e : encoded) {
+    auto it = mEntries.find(e.first);
+    if (it == mEntries.end()) {
+      std::cerr << "Ignoring " << e.second << " encoding of uncached file: "
+                << e.first << std::endl;
+      continue;
+    }
+    if (it->second->has_encoding(e.second)) {
+      continue;
+    }
+    try {
+      auto r = std::make_unique<resource>(mRoot, e.first, e.second, mStorage,
+                                          mReload);
+      if (r->size() < it->second->size()) {
+        it->second->add_encoding(std::move(r));
+      }
+    } catch (std::runtime_error& err) {
+      std::cerr << "Unable to cache " << e.second << " encoding of file: "
+                << e.first << std::endl;
+    }
+  }
+}
+
+void cache::refresh(std::set<std::string> const& names) {
+  bool whitelisted = false;
+  for (auto& name : names) {
+    auto location = "/" + name;
+    auto encoding = encodingOf(location);
+    auto it = mEntries.find(location);
+    if (it == mEntries.end() ||
+        (!encoding.empty() && !it->second->has_encoding(encoding))) {
+      // The whitelist itself, or maybe a file it names that was missing
+      whitelisted = true;
+      continue;
+    }
+    try {
+      it->second->reload(true);
+    } catch (std::runtime_error& err) {
+      // Keeps serving what it has
+      std::cerr << "Unable to reload file: " << name << std::endl;
+    }
+  }
+  if (whitelisted) {
+    update();
+  }
+}
+
+#if defined(__linux__)
+struct notify_read_impl {
+  static constexpr decltype(::read)* func = ::read;
+  static inline bool is_ready(ssize_t result) {
+    return result >= 0 || (errno != EAGAIN && errno != EWOULDBLOCK);
+  }
+};
+using notify_read = event::io_operation<notify_read_impl, decltype(::read)>;
+
+namespace {
+struct notify_descriptor {
+  int fd;
+  ~notify_descriptor() {
+    ::close(fd);
+  }
+};
+}
+
+coro::sync_task<void>
+cache::watch(event::scheduler& s) {
+  if (!mReload) {
+    co_return;
+  }
+  notify_descriptor notify{ ::inotify_init1(IN_NONBLOCK | IN_CLOEXEC) };
+  if (notify.fd < 0) {
+    throw std::runtime_error("error: inotify_init1 failed");
+  }
+  // Editors and builds often replace files instead of writing them, so the
+  // directory is watched rather than the files.
+  if (::inotify_add_watch(notify.fd, mRoot.c_str(),
+                          IN_CLOSE_WRITE | IN_MOVED_TO | IN_ATTRIB) < 0) {
+    throw std::runtime_error("error: inotify_add_watch failed for " + mRoot);
+  }
+  event::io_watcher reader(EV_READ);
+  reader.bind(s.loop(), notify.fd);
+  mWatching = true;
+  // Falls back to reloading on lookup whenever this stops
+  struct watching_guard {
+    bool& watching;
+    ~watching_guard() { watching = false; }
+  } guard{ mWatching };
+  alignas(inotify_event) char buffer[4096];
+  while (true) {
+    auto bytes = co_await notify_read(reader, notify.fd, buffer, sizeof(buffer));
+    if (bytes <= 0) {
+      throw std::runtime_error("error: reading inotify events failed");
+    }
+    // One refresh per batch, editors tend to touch a file several times
+    std::set<std::string> names;
+    for (char* p = buffer; p < buffer + bytes; ) {
+      auto e = reinterpret_cast<inotify_event*>(p);
+      if (e->len > 0) {
+        names.insert(e->name);
+      }
+      p += sizeof(inotify_event) + e->len;
+    }
+    refresh(names);
+  }
+}
+#else
+coro::sync_task<void>
+cache::watch(event::scheduler&) {
+  co_return;
 }
+#endif
 
 } // fs
 
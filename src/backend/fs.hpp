@@ -6,60 +6,141 @@
 ////////////////////////////////////////////////////////////////////////////////
 
 #include <map>
+#include <vector>
+#include <memory>
 #include <filesystem>
+#include <set>
 #include "http.hpp"
+#include "event.hpp"
 
 namespace fs {
 
+// How resources hold the contents of their files
+enum class storage {
+  COPY, // read into private memory up front
+  MAP   // shared read-only mapping, paged in on first access
+};
+
+// Read-only mapping of a whole file. Its pages belong to the page cache and
+// are shared with every other process mapping the same file. Reading past the
+// end of a file that was truncated in place raises SIGBUS, so mapped files
+// have to be replaced instead of rewritten.
+class mapping final {
+public:
+  mapping() = default;
+  explicit mapping(int file);
+  mapping(mapping const&) = delete;
+  mapping(mapping&& other) {
+    std::swap(mAddress, other.mAddress);
+    std::swap(mSize, other.mSize);
+  }
+  mapping& operator = (mapping const&) = delete;
+  mapping& operator = (mapping&& other) {
+    if (&other != this) {
+      std::swap(mAddress, other.mAddress);
+      std::swap(mSize, other.mSize);
+    }
+    return *this;
+  }
+  ~mapping();
+
+  char const* data() const {
+    return static_cast<char const*>(mAddress);
+  }
+  std::size_t size() const {
+    return mSize;
+  }
+private:
+  void* mAddress = nullptr;
+  std::size_t mSize = 0;
+};
+
 class resource final : public http::content {
 public:
-  resource(std::string const& root, std::string const& location);
+  // An encoding other than identity loads the precompressed sibling of the
+  // file, e.g. "/main.js.gz" for location "/main.js" and encoding "gzip".
+  // Resources that get reloaded while responses are written hand each
+  // response a snapshot, and send bodies from memory rather than from a file
+  // that may be rewritten in place.
+  resource(std::string const& root, std::string const& location,
+           std::string const& encoding = std::string(),
+           storage how = storage::COPY, bool reloads = false);
   resource(resource const&) = delete;
   resource(resource&&) = delete;
   resource& operator = (resource const&) = delete;
   resource& operator = (resource&&) = delete;
+  ~resource();
 
-  void reload();
-  
-  // http::content
-  virtual std::size_t size() const override {
-    return mData.size();
-  }
-  virtual char const* data() const override {
-    return mData.data();
+  // Reloads the file and its encodings if their timestamps changed. Forced
+  // reloads skip that check, timestamps are too coarse for quick edits.
+  void reload(bool force = false);
+
+  void add_encoding(std::unique_ptr<resource> encoded);
+  bool has_encoding(std::string const& encoding) const;
+  // Precompressed alternatives, smallest first
+  std::vector<std::unique_ptr<resource>> const& encodings() const {
+    return mEncodings;
   }
+
+  // http::content
+  virtual std::size_t size() const override;
+  virtual char const* data() const override;
   virtual std::string const& location() const override {
     return mLocation;
   }
   virtual mime_type type() const override {
     return mType;
   }
+  virtual int fd() const override;
+  virtual std::string_view ok_header() const override;
+  virtual std::string_view etag() const override;
+  virtual std::string_view last_modified() const override;
+  virtual std::string_view not_modified_header() const override;
+  virtual std::string_view encoding() const override {
+    return mEncoding;
+  }
+  virtual bool has_alternatives() const override {
+    return !mEncoding.empty() || !mEncodings.empty();
+  }
+  virtual std::shared_ptr<http::content const> snapshot() const override;
 private:
+  // What the file held when it was loaded, and the headers describing it.
+  // Never changes, reloads replace it.
+  struct body;
+  class version;
+
   http::content::mime_type mType = http::content::mime_type::TEXT;
   std::string mRoot;
   std::string mLocation;
-  std::vector<char> mData;
+  std::string mEncoding;
+  storage mStorage;
+  bool mReloads;
+  std::shared_ptr<version const> mVersion;
+  std::vector<std::unique_ptr<resource>> mEncodings;
   std::filesystem::file_time_type mTime;
 };
 
 class cache final {
 public:
-  using cache_entries = std::map<std::string, std::unique_ptr<resource>>;
+  // Looked up by string_view, without a temporary string
+  using cache_entries = std::map<std::string, std::unique_ptr<resource>,
+                                 std::less<>>;
 
-  cache(std::string const& root, bool reload);
+  cache(std::string const& root, bool reload,
+        storage how = storage::COPY);
   cache(cache const&) = delete;
   cache(cache&&) = delete;
   cache& operator = (cache const&) = delete;
   cache& operator = (cache&&) = delete;
 
   resource const*
-  find(std::string const& name) const {
+  find(std::string_view name) const {
     auto it = mEntries.find(name);
     if (it == mEntries.end()) {
       return nullptr;
     }
     auto r = it->second.get();
-    if (mReload) {
+    if (mReload && !mWatching) {
       r->reload();
     }
     return r;
@@ -68,9 +149,22 @@ public:
     return mEntries;
   }
 
+  // Reloads changed files and picks up whitelist additions as soon as the
+  // file system reports them, so lookups no longer check the disk. Needs
+  // inotify, elsewhere files are still checked on every lookup.
+  coro::sync_task<void> watch(event::scheduler& s);
+
 private:
+  // Loads all whitelisted files that are not cached yet
+  void update();
+  // Handles changes to files in the root directory
+  void refresh(std::set<std::string> const& names);
+
+  std::string mRoot;
   cache_entries mEntries;
   bool mReload;
+  storage mStorage;
+  bool mWatching = false;
 };
 
 } // fs
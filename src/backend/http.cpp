@@ -1,8 +1,14 @@
 ////////////////////////////////////////////////////////////////////////////////
 
 #include "http.hpp"
+#include "scan.hpp"
 #include <sstream>
 #include <iomanip>
+#include <ctime>
+#include <cctype>
+#include <algorithm>
+#include <iterator>
+#include <cstring>
 
 ////////////////////////////////////////////////////////////////////////////////
 
@@ -15,6 +21,7 @@ static constexpr char const*
 methodToString(request::method m) {
   switch (m) {
   case request::method::GET: return "GET";
+  case request::method::HEAD: return "HEAD";
   }
 }
 
@@ -23,9 +30,12 @@ reasonPhrase(response::status_code sc) {
   switch (sc) {
   case response::status_code::SWITCHING_PROTOCOLS: return "Switching Protocols";
   case response::status_code::OK: return "OK";
+  case response::status_code::PARTIAL_CONTENT: return "Partial Content";
   case response::status_code::MOVED_PERMANENTLY: return "Moved Permanently";
+  case response::status_code::NOT_MODIFIED: return "Not Modified";
   case response::status_code::BAD_REQUEST: return "Bad Request";
   case response::status_code::NOT_FOUND: return "Not Found";
+  case response::status_code::RANGE_NOT_SATISFIABLE: return "Range Not Satisfiable";
   case response::status_code::NOT_IMPLEMENTED: return "Not Implemented";
   }
 }
@@ -38,6 +48,7 @@ mimeTypeToString(content::mime_type t) {
   case content::mime_type::CSS: return "text/css";
   case content::mime_type::WASM: return "application/wasm";
   case content::mime_type::TEXT: return "text/plain";
+  case content::mime_type::JSON: return "application/json";
   }
 }
 
@@ -46,29 +57,6 @@ isWhitespace(char c) {
   return c == ' ' || c == '\t';
 }
 
-static inline constexpr bool
-isVCHAR(char c) {
-  return (c >= 0x20 && c < 0x7f) || c == 0x09;
-}
-
-static inline constexpr bool
-isDIGIT(char c) {
-  return c >= '0' && c <= '9';
-}
-
-static inline constexpr bool
-isALPHA(char c) {
-  return (c >= 'A' && c <= 'Z') || (c >= 'a' && c <= 'z');
-}
-
-static inline constexpr bool
-isTCHAR(char c) {
-  return isALPHA(c) || isDIGIT(c)
-    || c == '!' || c == '#' || c == '$' || c == '%' || c == '&'
-    || c == '\'' || c == '*' || c == '+' || c == '-' || c == '.'
-    || c == '^' || c == '_' || c == '`' || c == '|' || c == '~';
-}
-
 template< typename T >
 std::string toHex( T i )
 {
@@ -79,266 +67,375 @@ std::string toHex( T i )
   return stream.str();
 }
 
-static coro::async_generator<std::string>
-messageLines(coro::async_generator<char>& chars) {
-  std::string line;
-  char prev = 0;
-  for co_await (auto c : chars) {
-      if (line.size() > maxAllowedCharsPerLine) {
-        std::stringstream ss;
-        ss << "error: maxAllowedCharsPerLine="
-           << maxAllowedCharsPerLine << " exceeded ";
-        throw std::runtime_error(ss.str());
-      }
-      if (c != '\r' && c != '\n') {
-        if (!isVCHAR(c)) {
-          std::stringstream ss;
-          ss << "error: Illegal character '" << toHex(c) << "' in message line.";
-          throw std::runtime_error(ss.str());
-        }
-        line += c;
-      } else if (c == '\n') {
-        if (prev != '\r') {
-          throw std::runtime_error("error: Unexpected NL character");
-        }
-        std::string tmp;
-        std::swap(tmp, line);
-        co_yield std::move(tmp);
-      }
-      prev = c;
-    }
-}
-
-class string_pointer {
-public:
-  using const_iterator = char const*;
-  explicit string_pointer(char const* pointer, std::size_t length)
-    : mPointer(pointer)
-    , mLength(length) {}
-  explicit string_pointer(const_iterator a, const_iterator b)
-    : mPointer(a)
-    , mLength(b - a) {}
-  const_iterator begin() const { return mPointer; }
-  const_iterator end() const { return mPointer + mLength; }
-
-  std::string str() const {
-    return std::string(mPointer, mLength);
-  }
-
-  bool operator == (char const* str) const {
-    std::size_t l = 0;
-    while (l < mLength) {
-      auto co = str[l];
-      auto c = mPointer[l++];
-      if (co == '\0' || co != c) {
-        return false;
-      }
-    }
-    return str[l] == '\0';
+// The character scans of the parser
+struct vectorScans {
+  static std::size_t vcharPrefix(std::string_view str) {
+    return scan::vcharPrefix(str);
   }
-  bool operator != (char const* str) const {
-    return !(*this == str);
+  static std::size_t tcharPrefix(std::string_view str) {
+    return scan::tcharPrefix(str);
   }
+};
 
-private:
-  char const* mPointer;
-  std::size_t mLength;
+struct scalarScans {
+  static std::size_t vcharPrefix(std::string_view str) {
+    return scan::scalar::vcharPrefix(str);
+  }
+  static std::size_t tcharPrefix(std::string_view str) {
+    return scan::scalar::tcharPrefix(str);
+  }
 };
 
-static std::ostream&
-operator << (std::ostream& stream, string_pointer const& str) {
-  stream << std::string(str.begin(), str.end());
-  return stream;
+// Validates a complete message line and strips its CR LF.
+template<typename scans_type>
+static std::string_view
+messageLine(std::string_view line) {
+  if (line.empty() || line.back() != '\r') {
+    throw std::runtime_error("error: Unexpected NL character");
+  }
+  line.remove_suffix(1);
+  if (line.size() > maxAllowedCharsPerLine) {
+    std::stringstream ss;
+    ss << "error: maxAllowedCharsPerLine="
+       << maxAllowedCharsPerLine << " exceeded ";
+    throw std::runtime_error(ss.str());
+  }
+  auto valid = scans_type::vcharPrefix(line);
+  if (valid < line.size()) {
+    std::stringstream ss;
+    ss << "error: Illegal character '" << toHex(line[valid]) << "' in message line.";
+    throw std::runtime_error(ss.str());
+  }
+  return line;
 }
 
-class token : public string_pointer {
-public:
-  token(string_pointer const& str, char separator = 0)
-    : string_pointer(str)
-    , mSeparator(separator) {}
-  char separator() const { return mSeparator; }
-private:
-  char mSeparator;
+static bool
+equalsIgnoringCase(std::string_view a, std::string_view b) {
+  return a.size() == b.size() &&
+    std::equal(a.begin(), a.end(), b.begin(),
+               [](char x, char y) {
+                 return std::tolower(x) == std::tolower(y);
+               });
+}
+
+// In the order of request::header
+static constexpr std::string_view knownHeaders[] = {
+  "host",
+  "connection",
+  "upgrade",
+  "sec-websocket-key",
+  "sec-websocket-version",
+  "accept-encoding",
+  "if-none-match",
+  "if-modified-since",
+  "range",
+  "if-range"
 };
+static_assert(std::size(knownHeaders) == (std::size_t)request::header::COUNT);
 
-static coro::generator<token>
-tokenize(string_pointer const& str, std::vector<char> const& separators) {
-  auto it0 = str.begin();
-  auto it1 = it0;
-  auto end = str.end();
-  while (it1 != end) {
-    auto c = *it1;
-    for (auto s : separators) {
-      if (c == s) {
-        co_yield token(string_pointer(it0, it1), s);
-        it0 = it1+1;
-        break;
+void
+request::add_header(std::string_view name, std::string_view value) {
+  if (mFieldCount == max_fields) {
+    throw std::runtime_error("error: Too many header fields");
+  }
+  mFields[mFieldCount++] = field(name, value);
+  for (std::size_t i = 0; i < std::size(knownHeaders); ++i) {
+    if (equalsIgnoringCase(name, knownHeaders[i])) {
+      if (mKnown[i] == 0) {
+        mKnown[i] = mFieldCount;
       }
+      break;
     }
-    it1++;
   }
-  if (it0 != end) {
-    co_yield token(string_pointer(it0, it1));
+}
+
+std::optional<std::string_view>
+request::get_header(std::string_view name) const {
+  for (auto& f : get_headers()) {
+    if (equalsIgnoringCase(f.first, name)) {
+      return f.second;
+    }
   }
+  return std::nullopt;
+}
+
+void
+request::fold(std::string_view continuation, std::size_t capacity) {
+  auto& value = mFields[mFieldCount - 1].second;
+  if (value.empty()) {
+    // Like the whitespace after the colon
+    while (!continuation.empty() && isWhitespace(continuation.front())) {
+      continuation.remove_prefix(1);
+    }
+  }
+  if (!mArena) {
+    // Nothing joined can be longer than the header block
+    mArena.reset(new char[capacity]);
+  }
+  auto arenaEnd = mArena.get() + mArenaSize;
+  if (value.data() + value.size() != arenaEnd) {
+    // First continuation of the value, which has to move
+    std::memcpy(arenaEnd, value.data(), value.size());
+    value = std::string_view(arenaEnd, value.size());
+    mArenaSize += value.size();
+    arenaEnd += value.size();
+  }
+  std::memcpy(arenaEnd, continuation.data(), continuation.size());
+  mArenaSize += continuation.size();
+  value = std::string_view(value.data(), value.size() + continuation.size());
 }
 
 static bool
-parseRequestLine(std::string const& line, request& req) {
-  std::vector<char> separators{' '};
-  string_pointer str(line.c_str(), line.size());
-  auto tokens = tokenize(str, separators);
-  auto it = tokens.begin();
-  auto end = tokens.end();
-  if (it == end) {
+parseRequestLine(std::string_view line, request& req) {
+  // method SP uri SP version
+  std::string_view tokens[3];
+  std::size_t count = 0;
+  std::size_t start = 0;
+  for (std::size_t i = 0; i <= line.size(); ++i) {
+    if (i < line.size() && line[i] != ' ') {
+      continue;
+    }
+    if (i == line.size() && i == start) {
+      break;
+    }
+    if (count == 3) {
+      throw std::runtime_error("error: Unexpected additional tokens");
+      return false;
+    }
+    tokens[count++] = line.substr(start, i - start);
+    start = i + 1;
+  }
+  if (count == 0) {
     throw std::runtime_error("error: Missing request method token");
     return false;
   }
-  auto methodToken = *it;
-  if (++it == end) {
+  if (count == 1) {
     throw std::runtime_error("error: Missing uri token");
     return false;
   }
-  auto uriToken = *it;
-  if (++it == end) {
+  if (count == 2) {
     throw std::runtime_error("error: Missing version token");
     return false;
   }
-  auto versionToken = *it;
-  if (++it != end) {
-    throw std::runtime_error("error: Unexpected additional tokens");
-    return false;
-  }
+  auto methodToken = tokens[0];
+  auto versionToken = tokens[2];
   if (versionToken != "HTTP/1.1") {
     std::stringstream ss;
     ss << "error: Unsupported HTTP version " << versionToken;
     throw std::runtime_error(ss.str());
     return false;
   }
-  if (methodToken != "GET") {
+  if (methodToken == "GET") {
+    req.set_method(request::method::GET);
+  } else if (methodToken == "HEAD") {
+    req.set_method(request::method::HEAD);
+  } else {
     std::stringstream ss;
     ss << "error: Unsupported request method " << methodToken;
     throw std::runtime_error(ss.str());
     return false;
   }
-  req.set_method(request::method::GET);
-  req.set_uri(uriToken.str());
+  req.set_uri(tokens[1]);
   return true;
 }
 
+template<typename scans_type>
 static bool
-parseMessageHeader(std::string const& line, request& req) {
-  auto p0 = line.find(':');
-  if (p0 == std::string::npos) {
-    throw std::runtime_error("error: No ':' separator found");
-    return false;
+parseMessageHeader(std::string_view line, request& req) {
+  // The name ends at the first character that is not a tchar, which has to
+  // be the separator
+  auto p0 = scans_type::tcharPrefix(line);
+  if (p0 == line.size() || line[p0] != ':') {
+    if (line.find(':') == std::string_view::npos) {
+      throw std::runtime_error("error: No ':' separator found");
+      return false;
+    }
+    std::stringstream ss;
+    ss << "error: Illegal character '" << line[p0] << "' in field name.";
+    throw std::runtime_error(ss.str());
   }
   auto p1 = p0+1;
   while (p1 < line.size() && isWhitespace(line[p1])) {
     p1++;
   }
-  auto name = line.substr(0, p0);
-  std::transform(name.begin(), name.end(), name.begin(), 
-                 [](unsigned char c){ return std::tolower(c); });
-  for (auto c : name) {
-    if (!isTCHAR(c)) {
-      std::stringstream ss;
-      ss << "error: Illegal character '" << c << "' in field name.";
-      throw std::runtime_error(ss.str());
-    }
-  }
-  req.get_headers().insert(std::make_pair(name, line.substr(p1)));
+  req.add_header(line.substr(0, p0), line.substr(p1));
   return true;
 }
 
-coro::async_generator<request>
-request::stream(coro::async_generator<char>& chars) {
-  auto lines = messageLines(chars);
-  auto it = co_await lines.begin();
-  auto end = lines.end();
-  while(it != end) {
-    auto request_line = *it;
-    //co_await ++it;
-    //std::cout << "request_line: " << request_line << std::endl;
-    request req;
-    try {
-      if (!parseRequestLine(request_line, req)) {
-        co_return;
+std::size_t
+request::parse(std::string_view data, request& out) {
+  return parse_with<vectorScans>(data, out);
+}
+
+std::size_t
+request::parse_scalar(std::string_view data, request& out) {
+  return parse_with<scalarScans>(data, out);
+}
+
+template<typename scans_type>
+std::size_t
+request::parse_with(std::string_view data, request& out) {
+  out = request();
+  std::size_t pos = 0;
+  std::size_t lineCount = 0;
+  bool first = true;
+  std::string_view request_line;
+  while (true) {
+    std::string_view line;
+    // Usually a run of valid characters up to CR LF. Anything else takes the
+    // slow path, which tells the errors apart.
+    auto valid = scans_type::vcharPrefix(data.substr(pos));
+    auto end = pos + valid;
+    if (end + 1 < data.size() && data[end] == '\r' && data[end + 1] == '\n' &&
+        valid <= maxAllowedCharsPerLine) {
+      line = data.substr(pos, valid);
+      pos = end + 2;
+    } else {
+      auto nl = data.find('\n', pos);
+      if (nl == std::string_view::npos) {
+        if (data.size() - pos > maxAllowedCharsPerLine + 1) {
+          std::stringstream ss;
+          ss << "error: maxAllowedCharsPerLine="
+             << maxAllowedCharsPerLine << " exceeded ";
+          throw std::runtime_error(ss.str());
+        }
+        return 0; // incomplete
       }
+      line = messageLine<scans_type>(data.substr(pos, nl - pos));
+      pos = nl + 1;
+    }
+    if (first) {
+      first = false;
+      request_line = line;
+      try {
+        parseRequestLine(request_line, out);
+      } catch (std::runtime_error& err) {
+        std::stringstream ss;
+        ss << err.what() << std::endl;
+        ss << "note: While parsing request \"" << request_line << "\"";
+        throw std::runtime_error(ss.str());
+      }
+      continue;
+    }
+    lineCount++;
+    if (lineCount > maxAllowedLinesInHeader) {
+      std::stringstream ss;
+      ss << "error: maxAllowedLinesInHeader="
+         << maxAllowedLinesInHeader << " exceeded" << std::endl;
+      ss << "note: While parsing line \"" << line << "\"" << std::endl;
+      ss << "note: While parsing request \"" << request_line << "\"";
+      throw std::runtime_error(ss.str());
+    }
+    if (line.size() == 0) {
+      out.mSize = pos;
+      return pos;
+    }
+    if (isWhitespace(line[0]) && out.mFieldCount > 0) {
+      out.fold(line, data.size());
+      continue;
+    }
+    try {
+      parseMessageHeader<scans_type>(line, out);
     } catch (std::runtime_error& err) {
       std::stringstream ss;
       ss << err.what() << std::endl;
+      ss << "note: While parsing message header \"" << line << "\"" << std::endl;
       ss << "note: While parsing request \"" << request_line << "\"";
       throw std::runtime_error(ss.str());
-      co_return;
     }
+  }
+}
 
-    std::size_t lineCount = 0;
-    std::string multiLine;
-    while ((co_await ++it) != end) {
-      auto line = *it;
-      lineCount++;
-      if (lineCount > maxAllowedLinesInHeader) {
-        std::stringstream ss;
-        ss << "error: maxAllowedLinesInHeader="
-           << maxAllowedLinesInHeader << " exceeded" << std::endl;
-        ss << "note: While parsing line \"" << line << "\"" << std::endl;
-        ss << "note: While parsing request \"" << request_line << "\"";
-        throw std::runtime_error(ss.str());
-        co_return;
-      }
-      //std::cout << "line: " << line << std::endl;
-      if ((line.size() == 0 || !isWhitespace(line[0])) && multiLine.size()) {
-        try {
-          if (!parseMessageHeader(multiLine, req)) {
-            co_return;
-          }
-        } catch (std::runtime_error& err) {
-          std::stringstream ss;
-          ss << err.what() << std::endl;
-          ss << "note: While parsing message header \"" << multiLine << "\"" << std::endl;
-          ss << "note: While parsing request \"" << request_line << "\"";
-          throw std::runtime_error(ss.str());
-          co_return;
-        }
-        multiLine.clear();
+coro::async_generator<request>
+request::stream(coro::async_generator<char>& chars) {
+  std::string data;
+  std::size_t lineLength = 0;
+  for co_await (auto c : chars) {
+      data += c;
+      lineLength = c == '\n' ? 0 : lineLength + 1;
+      if (c != '\n' && lineLength <= maxAllowedCharsPerLine + 1) {
+        continue; // nothing new to parse
       }
-      multiLine += line;
-      if (line.size() == 0) {
+      request req;
+      auto size = parse(data, req);
+      if (size > 0) {
+        // Refers to data until the consumer is done with it
         co_yield std::move(req);
-        co_await ++it;
-        break;
+        data.erase(0, size);
       }
     }
-  }
 }
 
 std::ostream&
 operator << (std::ostream& stream, request const& r) {
   stream << methodToString(r.get_method()) << " " << r.get_uri() << " HTTP/1.1\n";
-  for (auto h : r.get_headers()) {
+  for (auto& h : r.get_headers()) {
     stream << h.first << ": " << h.second << std::endl;
   }
   return stream;
 }
 
-std::vector<char>
-response::serialize() const {
-  std::vector<char> result;
+std::string
+response::serialize_header() const {
   std::string header = "HTTP/1.1 " + std::to_string((int)mStatusCode) + " " + reasonPhrase(mStatusCode) + "\r\n";
   if (mContent) {
-    header += "Content-Length: " + std::to_string(mContent->size()) + "\r\n";
+    // A 304 describes the content, but does not carry it
+    if (mStatusCode == status_code::PARTIAL_CONTENT && mRange) {
+      header += "Content-Length: " + std::to_string(mRange->size()) + "\r\n";
+      header += "Content-Range: bytes " + std::to_string(mRange->first) + "-" + std::to_string(mRange->last) + "/" + std::to_string(mContent->size()) + "\r\n";
+    } else if (mStatusCode != status_code::NOT_MODIFIED) {
+      header += "Content-Length: " + std::to_string(mContent->size()) + "\r\n";
+    }
+    if (mStatusCode == status_code::OK) {
+      header += "Accept-Ranges: bytes\r\n";
+    }
     header += "Content-Location: " + mContent->location() + "\r\n";
-    header += "Content-Type: " + std::string(mimeTypeToString(mContent->type())) + "\r\n";
+    if (mStatusCode != status_code::NOT_MODIFIED) {
+      header += "Content-Type: " + std::string(mimeTypeToString(mContent->type())) + "\r\n";
+      if (!mContent->encoding().empty()) {
+        header += "Content-Encoding: " + std::string(mContent->encoding()) + "\r\n";
+      }
+    }
+    if (mContent->has_alternatives()) {
+      header += "Vary: Accept-Encoding\r\n";
+    }
+    if (!mContent->etag().empty()) {
+      header += "ETag: " + std::string(mContent->etag()) + "\r\n";
+    }
+    if (!mContent->last_modified().empty()) {
+      header += "Last-Modified: " + std::string(mContent->last_modified()) + "\r\n";
+    }
   }
   for (auto h : mHeaders) {
     header += h.first + ": " + h.second + "\r\n";
   }
   header += "\r\n";
-  result.insert(result.end(), header.begin(), header.end());
-  if (mContent) {
-    result.insert(result.end(), mContent->data(), mContent->data() + mContent->size());
+  return header;
+}
+
+std::string_view
+response::header(std::string& storage) const {
+  std::string_view ready;
+  if (mContent != nullptr && mStatusCode == status_code::OK) {
+    ready = mContent->ok_header();
+  } else if (mContent != nullptr && mStatusCode == status_code::NOT_MODIFIED) {
+    ready = mContent->not_modified_header();
+  }
+  if (ready.empty()) {
+    storage = serialize_header();
+    return storage;
   }
-  return result;
+  if (mHeaders.empty()) {
+    return ready;
+  }
+  // Insert the additional headers before the empty line
+  storage.reserve(ready.size() + 64);
+  storage.append(ready.data(), ready.size() - 2);
+  for (auto& h : mHeaders) {
+    storage += h.first + ": " + h.second + "\r\n";
+  }
+  storage += "\r\n";
+  return storage;
 }
 
 std::ostream&
@@ -347,9 +444,33 @@ operator << (std::ostream& stream, response const& r) {
   stream << "HTTP/1.1 " << (int)sc << " " << reasonPhrase(sc) << "\n";
   auto content = r.get_content();
   if (content) {
-    stream << "Content-Length: " << content->size() << std::endl;
+    auto range = r.get_range();
+    if (sc == response::status_code::PARTIAL_CONTENT && range) {
+      stream << "Content-Length: " << range->size() << std::endl;
+      stream << "Content-Range: bytes " << range->first << "-" << range->last
+             << "/" << content->size() << std::endl;
+    } else if (sc != response::status_code::NOT_MODIFIED) {
+      stream << "Content-Length: " << content->size() << std::endl;
+    }
+    if (sc == response::status_code::OK) {
+      stream << "Accept-Ranges: bytes" << std::endl;
+    }
     stream << "Content-Location: " << content->location() << std::endl;
-    stream << "Content-Type: " << mimeTypeToString(content->type()) << std::endl;
+    if (sc != response::status_code::NOT_MODIFIED) {
+      stream << "Content-Type: " << mimeTypeToString(content->type()) << std::endl;
+      if (!content->encoding().empty()) {
+        stream << "Content-Encoding: " << content->encoding() << std::endl;
+      }
+    }
+    if (content->has_alternatives()) {
+      stream << "Vary: Accept-Encoding" << std::endl;
+    }
+    if (!content->etag().empty()) {
+      stream << "ETag: " << content->etag() << std::endl;
+    }
+    if (!content->last_modified().empty()) {
+      stream << "Last-Modified: " << content->last_modified() << std::endl;
+    }
   }
   for (auto h : r.get_headers()) {
     stream << h.first << ": " << h.second << std::endl;;
@@ -357,6 +478,179 @@ operator << (std::ostream& stream, response const& r) {
   return stream;
 }
 
+static std::string_view
+trimmed(std::string_view str) {
+  auto begin = str.find_first_not_of(" \t");
+  if (begin == std::string_view::npos) {
+    return {};
+  }
+  auto end = str.find_last_not_of(" \t");
+  return str.substr(begin, end - begin + 1);
+}
+
+static std::string_view
+withoutWeakPrefix(std::string_view etag) {
+  if (etag.substr(0, 2) == "W/") {
+    etag.remove_prefix(2);
+  }
+  return etag;
+}
+
+static bool
+parseHttpDate(std::string_view str, std::time_t& out) {
+  // strptime wants a terminated string
+  char date[64];
+  if (str.size() >= sizeof(date)) {
+    return false;
+  }
+  std::memcpy(date, str.data(), str.size());
+  date[str.size()] = '\0';
+  std::tm tm = {};
+  auto end = ::strptime(date, "%a, %d %b %Y %H:%M:%S GMT", &tm);
+  if (end == nullptr || *end != '\0') {
+    return false;
+  }
+  out = ::timegm(&tm);
+  return true;
+}
+
+bool
+not_modified(request const& r, content const& c) {
+  auto inm = r.get_header(request::header::IF_NONE_MATCH);
+  if (inm) {
+    // Takes precedence over If-Modified-Since. Uses the weak comparison.
+    if (c.etag().empty()) {
+      return false;
+    }
+    std::string_view list = *inm;
+    while (!list.empty()) {
+      auto comma = list.find(',');
+      auto tag = trimmed(list.substr(0, comma));
+      if (tag == "*" || withoutWeakPrefix(tag) == withoutWeakPrefix(c.etag())) {
+        return true;
+      }
+      list = comma == std::string_view::npos
+        ? std::string_view() : list.substr(comma + 1);
+    }
+    return false;
+  }
+  auto ims = r.get_header(request::header::IF_MODIFIED_SINCE);
+  if (ims && !c.last_modified().empty()) {
+    std::time_t since, modified;
+    if (parseHttpDate(*ims, since) &&
+        parseHttpDate(c.last_modified(), modified)) {
+      return modified <= since;
+    }
+  }
+  return false;
+}
+
+bool
+accepts_encoding(request const& r, std::string_view coding) {
+  auto ae = r.get_header(request::header::ACCEPT_ENCODING);
+  if (!ae) {
+    return false;
+  }
+  bool wildcard = false;
+  std::string_view list = *ae;
+  while (!list.empty()) {
+    auto comma = list.find(',');
+    auto element = list.substr(0, comma);
+    list = comma == std::string_view::npos
+      ? std::string_view() : list.substr(comma + 1);
+    auto semicolon = element.find(';');
+    auto name = trimmed(element.substr(0, semicolon));
+    bool acceptable = true;
+    if (semicolon != std::string_view::npos) {
+      // Only q=0 matters, it forbids the coding
+      auto parameter = trimmed(element.substr(semicolon + 1));
+      if (parameter.substr(0, 2) == "q=" || parameter.substr(0, 2) == "Q=") {
+        auto q = parameter.substr(2);
+        acceptable = q.find_first_not_of("0.") != std::string_view::npos;
+      }
+    }
+    if (equalsIgnoringCase(name, coding)) {
+      return acceptable;
+    }
+    if (name == "*") {
+      wildcard = acceptable;
+    }
+  }
+  return wildcard;
+}
+
+static bool
+parsePosition(std::string_view str, std::size_t& out) {
+  if (str.empty() || str.size() > 18 ||
+      str.find_first_not_of("0123456789") != std::string_view::npos) {
+    return false;
+  }
+  out = 0;
+  for (auto c : str) {
+    out = out * 10 + (c - '0');
+  }
+  return true;
+}
+
+range_status
+requested_range(request const& r, content const& c, byte_range& out) {
+  auto range = r.get_header(request::header::RANGE);
+  if (!range) {
+    return range_status::WHOLE;
+  }
+  auto ifRange = r.get_header(request::header::IF_RANGE);
+  if (ifRange) {
+    // Only a strong match counts. Otherwise the parts do not fit together.
+    std::string_view validator = *ifRange;
+    if (validator != c.etag() && validator != c.last_modified()) {
+      return range_status::WHOLE;
+    }
+  }
+  std::string_view spec = trimmed(*range);
+  auto equals = spec.find('=');
+  if (equals == std::string_view::npos ||
+      trimmed(spec.substr(0, equals)) != "bytes") {
+    return range_status::WHOLE; // unknown unit
+  }
+  spec = trimmed(spec.substr(equals + 1));
+  if (spec.find(',') != std::string_view::npos) {
+    return range_status::WHOLE; // multiple ranges
+  }
+  auto dash = spec.find('-');
+  if (dash == std::string_view::npos) {
+    return range_status::WHOLE;
+  }
+  auto first = trimmed(spec.substr(0, dash));
+  auto last = trimmed(spec.substr(dash + 1));
+  auto size = c.size();
+  if (first.empty()) {
+    // The final bytes
+    std::size_t suffix;
+    if (!parsePosition(last, suffix)) {
+      return range_status::WHOLE;
+    }
+    if (suffix == 0 || size == 0) {
+      return range_status::UNSATISFIABLE;
+    }
+    out.first = size - std::min(suffix, size);
+    out.last = size - 1;
+    return range_status::PARTIAL;
+  }
+  if (!parsePosition(first, out.first)) {
+    return range_status::WHOLE;
+  }
+  if (last.empty()) {
+    out.last = size - 1;
+  } else if (!parsePosition(last, out.last) || out.last < out.first) {
+    return range_status::WHOLE;
+  }
+  if (out.first >= size) {
+    return range_status::UNSATISFIABLE;
+  }
+  out.last = std::min(out.last, size - 1);
+  return range_status::PARTIAL;
+}
+
 } // namespance http
 
 ////////////////////////////////////////////////////////////////////////////////
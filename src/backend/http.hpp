@@ -7,9 +7,17 @@
 
 #include <common/coro.hpp>
 #include <string>
+#include <string_view>
 #include <vector>
+#include <array>
 #include <map>
+#include <memory>
+#include <span>
+#include <algorithm>
+#include <optional>
 #include <iostream>
+#include <cassert>
+#include <sys/uio.h>
 
 ////////////////////////////////////////////////////////////////////////////////
 
@@ -18,33 +26,82 @@ namespace http {
 class content {
 public:
   enum class mime_type {
-    HTML, JS, CSS, WASM, TEXT
+    HTML, JS, CSS, WASM, TEXT, JSON
   };
   virtual std::size_t size() const = 0;
   virtual char const* data() const = 0;
   virtual std::string const& location() const = 0;
   virtual mime_type type() const = 0;
+  // An open file holding the same bytes as data(), or -1. Lets sockets send
+  // the body without copying it through user space.
+  virtual int fd() const { return -1; }
+  // Status line and headers of a 200 response carrying this content, up to
+  // and including the empty line. Content that does not change between
+  // requests serializes this once. Empty if not available.
+  virtual std::string_view ok_header() const { return {}; }
+  // Validators for conditional requests. A quoted strong entity tag and an
+  // HTTP-date. Empty if not available.
+  virtual std::string_view etag() const { return {}; }
+  virtual std::string_view last_modified() const { return {}; }
+  // Same as ok_header(), for a 304 response.
+  virtual std::string_view not_modified_header() const { return {}; }
+  // Content-Coding of data(), empty for identity.
+  virtual std::string_view encoding() const { return {}; }
+  // Whether the same location is served in other encodings as well.
+  virtual bool has_alternatives() const { return false; }
+  // The same content, unchanged for as long as the pointer lives. Null for
+  // content that does not change while responses are written.
+  virtual std::shared_ptr<content const> snapshot() const { return nullptr; }
 };
 
+// Inclusive, like the positions in Range and Content-Range headers
+struct byte_range {
+  std::size_t first;
+  std::size_t last;
+  std::size_t size() const { return last - first + 1; }
+};
+
+// Requests refer to the bytes they were parsed from instead of copying them.
+// Those have to stay in place as long as the request is used.
 class request final {
 public:
   enum class method {
-    GET
+    GET, HEAD
   };
-  using headers = std::map<std::string, std::string>;
-  
+  // Header fields the server acts on. Found without a search.
+  enum class header {
+    HOST,
+    CONNECTION,
+    UPGRADE,
+    SEC_WEBSOCKET_KEY,
+    SEC_WEBSOCKET_VERSION,
+    ACCEPT_ENCODING,
+    IF_NONE_MATCH,
+    IF_MODIFIED_SINCE,
+    RANGE,
+    IF_RANGE,
+    COUNT
+  };
+  using field = std::pair<std::string_view, std::string_view>;
+  // Same limit as for the lines of a request header
+  static constexpr std::size_t max_fields = 32;
+
   request() = default;
   ~request() = default;
-  request(request&& other)
-    : mMethod(std::move(other.mMethod))
-    , mUri(std::move(other.mUri))
-    , mHeaders(std::move(other.mHeaders)) {}
+  request(request&& other) {
+    *this = std::move(other);
+  }
   request(request const&) = delete;
   request& operator = (request&& other) {
     if (&other != this) {
-      std::swap(mMethod, other.mMethod);
-      std::swap(mUri, other.mUri);
-      std::swap(mHeaders, other.mHeaders);
+      mMethod = other.mMethod;
+      mUri = other.mUri;
+      std::copy_n(other.mFields.begin(), other.mFieldCount, mFields.begin());
+      mFieldCount = other.mFieldCount;
+      mKnown = other.mKnown;
+      mSize = other.mSize;
+      std::swap(mArena, other.mArena);
+      std::swap(mArenaSize, other.mArenaSize);
     }
     return *this;
   }
@@ -53,28 +110,95 @@ public:
   void set_method(method m) { mMethod = m; }
   method get_method() const { return mMethod; }
 
-  void set_uri(std::string const& uri) { mUri = uri; }
-  std::string const& get_uri() const { return mUri; }
+  void set_uri(std::string_view uri) { mUri = uri; }
+  std::string_view get_uri() const { return mUri; }
 
-  headers& get_headers() {
-    return mHeaders;
+  // All header fields in order of appearance, names as sent by the client
+  std::span<field const> get_headers() const {
+    return std::span<field const>(mFields.data(), mFieldCount);
   }
-  headers const& get_headers() const {
-    return mHeaders;
+  // Appends a header field. Throws if there are more than max_fields.
+  void add_header(std::string_view name, std::string_view value);
+
+  // Value of the first field with that name, if any
+  std::optional<std::string_view> get_header(header h) const {
+    auto index = mKnown[(std::size_t)h];
+    if (index == 0) {
+      return std::nullopt;
+    }
+    return mFields[index - 1].second;
   }
+  // Same for any field name, compared case-insensitively
+  std::optional<std::string_view> get_header(std::string_view name) const;
+
+  // Number of bytes of the header block the request was parsed from
+  std::size_t size() const { return mSize; }
+
+  // Parses the request header block at the beginning of data. Returns the
+  // number of bytes it occupies, or zero if it is not complete yet. Throws on
+  // malformed input. The request refers to data, except for folded field
+  // values, which are joined in memory the request owns.
+  static std::size_t
+  parse(std::string_view data, request& out);
+  // The same with the character scans of scan::scalar, which parse has to
+  // agree with
+  static std::size_t
+  parse_scalar(std::string_view data, request& out);
 
   // TODO: I dont like this API anymore
-  // * Should use com::channel
   // * Reading a single request is hacky
   static coro::async_generator<http::request>
   stream(coro::async_generator<char>& chars);
-  
+  // Parses requests directly from the receive buffer of a buffered
+  // com::channel, one read per header block instead of one per byte. Each
+  // request refers to the receive buffer and is valid until the next one is
+  // requested, or the stream is destroyed.
+  template<typename channel_type>
+  static coro::async_generator<http::request>
+  stream(channel_type& channel);
+
 private:
+  template<typename scans_type>
+  static std::size_t
+  parse_with(std::string_view data, request& out);
+  // Continues the value of the last field on another line
+  void fold(std::string_view continuation, std::size_t capacity);
+
   method mMethod = method::GET;
-  std::string mUri;
-  headers mHeaders;
+  std::string_view mUri;
+  std::array<field, max_fields> mFields;
+  std::size_t mFieldCount = 0;
+  // One-based positions in mFields, zero if absent
+  std::array<std::uint8_t, (std::size_t)header::COUNT> mKnown = {};
+  std::size_t mSize = 0;
+  std::unique_ptr<char[]> mArena;
+  std::size_t mArenaSize = 0;
 };
 
+template<typename channel_type>
+coro::async_generator<request>
+request::stream(channel_type& channel) {
+  assert(channel.buffered());
+  while (true) {
+    request req;
+    std::size_t size;
+    while ((size = parse(channel.peek(), req)) == 0) {
+      if (co_await channel.async_fill() == 0) {
+        co_return; // connection was closed
+      }
+    }
+    // The header block stays in the buffer while the request refers to it.
+    // Consumed when the next request is requested, or when the consumer stops
+    // early, e.g. to read websocket frames.
+    struct consumer {
+      channel_type& channel;
+      std::size_t size;
+      ~consumer() { channel.consume(size); }
+    } consume{ channel, size };
+    co_yield std::move(req);
+  }
+}
+
 // NOTE: Only for printing!
 std::ostream&
 operator << (std::ostream& stream, request const& r);
@@ -84,9 +208,12 @@ public:
   enum class status_code : int {
     SWITCHING_PROTOCOLS=101,
     OK=200,
+    PARTIAL_CONTENT=206,
     MOVED_PERMANENTLY=301,
+    NOT_MODIFIED=304,
     BAD_REQUEST=400,
     NOT_FOUND=404,
+    RANGE_NOT_SATISFIABLE=416,
     NOT_IMPLEMENTED=501
   };
   using headers = std::map<std::string, std::string>;
@@ -96,12 +223,18 @@ public:
   response(response&& other)
     : mStatusCode(std::move(other.mStatusCode))
     , mContent(std::move(other.mContent))
+    , mSnapshot(std::move(other.mSnapshot))
+    , mBodyOmitted(other.mBodyOmitted)
+    , mRange(other.mRange)
     , mHeaders(std::move(other.mHeaders)) {}
   response(response const&) = delete;
   response& operator = (response&& other) {
     if (&other != this) {
       std::swap(mStatusCode, other.mStatusCode);
       std::swap(mContent, other.mContent);
+      std::swap(mSnapshot, other.mSnapshot);
+      std::swap(mBodyOmitted, other.mBodyOmitted);
+      std::swap(mRange, other.mRange);
       std::swap(mHeaders, other.mHeaders);
     }
     return *this;
@@ -121,28 +254,108 @@ public:
     return mHeaders;
   }
 
+  // Content that may change is held in the state it had when it was set,
+  // until the response is gone.
   void set_content(content const* c) {
-    mContent = c;
+    mSnapshot = c != nullptr ? c->snapshot() : nullptr;
+    mContent = mSnapshot ? mSnapshot.get() : c;
   }
   content const* get_content() const {
     return mContent;
   }
+  // Answers HEAD requests: The header describes the content, but the content
+  // itself is not sent.
+  void set_body_omitted(bool omitted) {
+    mBodyOmitted = omitted;
+  }
+  bool get_body_omitted() const {
+    return mBodyOmitted;
+  }
+  // Part of the content sent with PARTIAL_CONTENT
+  void set_range(byte_range const& range) {
+    mRange = range;
+  }
+  std::optional<byte_range> const& get_range() const {
+    return mRange;
+  }
 
-  std::vector<char> serialize() const;
+  // Status line and headers, including the terminating empty line.
+  std::string serialize_header() const;
+  // Same bytes as serialize_header(). Refers to the content's ready-made
+  // header where possible and only uses storage if it has to build one.
+  std::string_view header(std::string& storage) const;
 
+  // Bodies of at least this size are sent from their file, if the channel
+  // can do that. Below, one gather write of header and body is cheaper.
+  static constexpr std::size_t sendfile_threshold = 64 * 1024;
+
+  // Writes header and body without copying the body. Small bodies go out with
+  // the header in a single send.
   template<typename channel>
   static coro::task<bool>
   async_write(channel& c, response const& r) {
-    auto buffer = r.serialize();
-    co_return co_await c.async_write(buffer.data(), buffer.size());
+    std::string storage;
+    auto header = r.header(storage);
+    auto content = r.get_content();
+    if (r.get_body_omitted() ||
+        r.get_status_code() == status_code::NOT_MODIFIED) {
+      content = nullptr;
+    }
+    std::size_t offset = 0;
+    std::size_t count = content != nullptr ? content->size() : 0;
+    if (content != nullptr && r.get_status_code() == status_code::PARTIAL_CONTENT) {
+      assert(r.get_range() && r.get_range()->last < content->size());
+      offset = r.get_range()->first;
+      count = r.get_range()->size();
+    }
+    if constexpr (channel::sends_files) {
+      if (content != nullptr && content->fd() >= 0 &&
+          count >= sendfile_threshold) {
+        if (!co_await c.async_write(header.data(), header.size())) {
+          co_return false;
+        }
+        co_return co_await c.async_write_file(content->fd(), content->data(),
+                                              offset, count);
+      }
+    }
+    iovec parts[2] = {
+      { const_cast<char*>(header.data()), header.size() },
+      { nullptr, 0 }
+    };
+    if (content != nullptr) {
+      parts[1].iov_base = const_cast<char*>(content->data() + offset);
+      parts[1].iov_len = count;
+    }
+    co_return co_await c.async_writev(parts, 2);
   }
 
 private:
   status_code mStatusCode = status_code::OK;
   content const* mContent = nullptr;
+  std::shared_ptr<content const> mSnapshot;
+  bool mBodyOmitted = false;
+  std::optional<byte_range> mRange;
   headers mHeaders;
 };
 
+// Whether the client's cached copy of c is still valid, according to the
+// If-None-Match or If-Modified-Since header of r.
+bool not_modified(request const& r, content const& c);
+
+// Whether the Accept-Encoding header of r allows the content coding.
+bool accepts_encoding(request const& r, std::string_view coding);
+
+enum class range_status {
+  WHOLE,        // no usable Range header, send everything
+  PARTIAL,      // send the range only
+  UNSATISFIABLE // the range lies beyond the end of the content
+};
+// Evaluates the Range and If-Range headers of r for c. Requests for more
+// than one range get the whole content, rather than a multipart response
+// or overlapping ranges the client could use to amplify the transfer.
+range_status requested_range(request const& r, content const& c,
+                             byte_range& out);
+
 // NOTE: Only for printing!
 std::ostream& operator << (std::ostream& stream, response const& r);
 
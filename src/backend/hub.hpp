@@ -0,0 +1,573 @@
+////////////////////////////////////////////////////////////////////////////////
+
+#ifndef BACKEND_HUB_HPP
+#define BACKEND_HUB_HPP
+
+////////////////////////////////////////////////////////////////////////////////
+
+#include "websocket.hpp"
+#include "event.hpp"
+#include <atomic>
+#include <mutex>
+#include <optional>
+#include <vector>
+#include <string_view>
+#include <cassert>
+#include <sys/uio.h>
+#include <sys/socket.h>
+
+////////////////////////////////////////////////////////////////////////////////
+
+namespace websocket {
+
+class hub;
+
+// Frames a sender queues before it drops or grows, see sender
+constexpr std::size_t default_queue_capacity = 64;
+// Bytes a sender queues before async_send() waits for the connection
+constexpr std::size_t default_high_water = 256 * 1024;
+// Frames taken from the queue per gather write
+constexpr std::size_t max_frames_per_write = 64;
+
+// The queue of frames going out on one websocket connection. Its writer task
+// takes whatever is queued when the connection becomes writable and sends it
+// with a single gather write, so frames queued in a row cost one system call.
+// A producer never waits for the write of its own frame:
+// * push() queues without ever waiting. Once the queue holds capacity frames
+//   it drops its oldest data frame, newer messages supersede older ones.
+//   Control frames are never dropped for data frames.
+// * async_send() queues every frame, and waits while more than high water
+//   bytes are queued, until half of them are written.
+// * flush() waits until everything queued so far is written, e.g. at the end
+//   of a tick.
+// Writer and waiting producer are resumed from the loop through the hub.
+// Only one producer may wait per sender. While one does, another one is
+// refused: async_send() does not queue its frame, and its awaitable as well as
+// those of flush() and close() resume at once with false.
+class sender {
+public:
+  class awaitable;
+  explicit sender(hub& h, std::size_t capacity = default_queue_capacity,
+                  std::size_t highWater = default_high_water);
+  ~sender();
+  sender(sender const&) = delete;
+  sender& operator = (sender const&) = delete;
+  sender(sender&&) = delete;
+  sender& operator = (sender&&) = delete;
+
+  // Starts writing queued frames to channel, which must outlive the sender
+  template<typename channel_type>
+  void start(channel_type& channel);
+
+  // Queues a frame. False if that dropped a frame.
+  bool push(shared_frame f);
+  // Queues a frame. The awaitable is false once the connection is gone, or
+  // if the frame was not queued.
+  awaitable async_send(shared_frame f);
+  awaitable async_send(opcode code, std::string_view payload);
+  // Resumes once the frames queued so far are written. False once the
+  // connection is gone.
+  awaitable flush();
+  // Takes no more frames. Resumes once the queued ones are written, or the
+  // connection failed.
+  awaitable close();
+
+  // Frames not taken by the writer yet
+  std::size_t queued() const noexcept {
+    return _size;
+  }
+  // Bytes of frames that are not written yet
+  std::size_t queued_bytes() const noexcept {
+    return _bytes;
+  }
+  // Frames dropped so far
+  std::size_t dropped() const noexcept {
+    return _dropped;
+  }
+
+protected:
+  hub& _hub;
+
+private:
+  friend class hub;
+  struct next_frames;
+  enum class condition { ROOM, FLUSHED, FINISHED };
+
+  template<typename channel_type>
+  coro::sync_task<bool> write(channel_type& channel);
+  void enqueue(shared_frame&& f);
+  // Whether the writer ended, frames queued before start() wait for it
+  bool finished() const noexcept {
+    return _writer && _writer->done();
+  }
+  bool satisfied(condition c) const noexcept;
+  void wake() noexcept;
+  void resume();
+  static void writer_done(void* context);
+
+  std::vector<shared_frame> _queue;
+  std::size_t _head = 0;
+  std::size_t _size = 0;
+  std::size_t _bytes = 0;
+  std::size_t _high_water;
+  std::size_t _dropped = 0;
+  bool _closed = false;
+  std::optional<coro::sync_task<bool>> _writer;
+  // The writer while it waits for frames
+  std::experimental::coroutine_handle<> _writer_waiting;
+  coro::frame_allocator* _writer_allocator = nullptr;
+  // The producer while it waits for the writer
+  std::experimental::coroutine_handle<> _waiting;
+  coro::frame_allocator* _waiting_allocator = nullptr;
+  condition _waiting_for = condition::ROOM;
+  // Links of the hub's list of senders to resume
+  sender* _ready_prev = nullptr;
+  sender* _ready_next = nullptr;
+  bool _ready = false;
+};
+
+class sender::awaitable final {
+public:
+  awaitable(sender& s, condition c, bool accepted = true) noexcept
+    : _sender(s), _condition(c), _accepted(accepted) {}
+  ~awaitable() {
+    if (_suspended) {
+      _sender._waiting = nullptr;
+    }
+  }
+  awaitable(awaitable const&) = delete;
+  awaitable& operator = (awaitable const&) = delete;
+  awaitable(awaitable&&) = delete;
+  awaitable& operator = (awaitable&&) = delete;
+
+  bool await_ready() noexcept {
+    return !_accepted || _sender.satisfied(_condition);
+  }
+  bool await_suspend(std::experimental::coroutine_handle<> handle) noexcept {
+    if (_sender._waiting) {
+      // Another producer waits already
+      _accepted = false;
+      return false;
+    }
+    _sender._waiting = handle;
+    _sender._waiting_allocator = coro::current_frame_allocator();
+    _sender._waiting_for = _condition;
+    _suspended = true;
+    return true;
+  }
+  // False once the connection is gone, or if the sender refused
+  bool await_resume() noexcept {
+    _suspended = false;
+    return _accepted &&
+      (!_sender.finished() || _condition == condition::FINISHED);
+  }
+private:
+  sender& _sender;
+  condition _condition;
+  bool _accepted;
+  bool _suspended = false;
+};
+
+// A sender that also gets every frame published to the hub
+class subscriber final : public sender {
+public:
+  explicit subscriber(hub& h, std::size_t capacity = default_queue_capacity);
+  ~subscriber();
+private:
+  friend class hub;
+  // Links of the hub's list of subscribers
+  subscriber* _prev = nullptr;
+  subscriber* _next = nullptr;
+};
+
+////////////////////////////////////////////////////////////////////////////////
+
+// The senders on one loop, and those of them subscribed to what is published.
+// A frame is encoded once, and each subscriber's queue holds a reference to
+// it rather than a copy. Waiting writers and producers are resumed from the
+// loop, by a single timer for all of them, never from within publish() or a
+// write.
+class hub final {
+public:
+  explicit hub(struct ev_loop* loop) noexcept
+    : _loop(loop) {
+    _timer.data = this;
+    ev_timer_init(&_timer, callback, 0., 0.);
+    _async.data = this;
+    ev_async_init(&_async, posted);
+  }
+  template<typename scheduler_type>
+  explicit hub(scheduler_type& s) noexcept
+    : hub(s.loop()) {}
+  // The timer only runs while senders are ready, and posts are only taken
+  // while there are subscribers, so a hub without senders may outlive its
+  // loop.
+  ~hub() {
+    assert(_head == nullptr && "subscribers must leave first");
+    assert(!ev_is_active(&_timer));
+    assert(!ev_is_active(&_async));
+  }
+  hub(hub const&) = delete;
+  hub& operator = (hub const&) = delete;
+  hub(hub&&) = delete;
+  hub& operator = (hub&&) = delete;
+
+  // Number of subscribers
+  std::size_t size() const noexcept {
+    return _size;
+  }
+
+  // Queues f for every subscriber but the one it came from
+  void publish(shared_frame const& f, subscriber const* from = nullptr) {
+    for (auto s = _head; s != nullptr; s = s->_next) {
+      if (s != from) {
+        s->push(f);
+      }
+    }
+  }
+  // Publishes f from any thread, e.g. for a producer on another loop. It is
+  // queued once the loop of the hub gets to it, for those subscribed by then.
+  void post(shared_frame f) {
+    if (!_listening.load(std::memory_order_acquire)) {
+      return;
+    }
+    {
+      std::lock_guard<std::mutex> lock(_posted_mutex);
+      _posted.push_back(std::move(f));
+    }
+    ::ev_async_send(_loop, &_async);
+  }
+
+private:
+  friend class sender;
+  friend class subscriber;
+  void join(subscriber& s) noexcept {
+    s._prev = _tail;
+    s._next = nullptr;
+    (_tail != nullptr ? _tail->_next : _head) = &s;
+    _tail = &s;
+    if (_size++ == 0) {
+      ::ev_async_start(_loop, &_async);
+      _listening.store(true, std::memory_order_release);
+    }
+  }
+  void leave(subscriber& s) noexcept {
+    (s._prev != nullptr ? s._prev->_next : _head) = s._next;
+    (s._next != nullptr ? s._next->_prev : _tail) = s._prev;
+    s._prev = s._next = nullptr;
+    if (--_size == 0) {
+      _listening.store(false, std::memory_order_release);
+      ::ev_async_stop(_loop, &_async);
+      std::lock_guard<std::mutex> lock(_posted_mutex);
+      _posted.clear();
+    }
+  }
+  void ready(sender& s) {
+    if (s._ready) {
+      return;
+    }
+    s._ready = true;
+    s._ready_prev = _ready_tail;
+    s._ready_next = nullptr;
+    (_ready_tail != nullptr ? _ready_tail->_ready_next : _ready_head) = &s;
+    _ready_tail = &s;
+    if (!ev_is_active(&_timer)) {
+      ev_timer_set(&_timer, 0., 0.);
+      ::ev_timer_start(_loop, &_timer);
+    }
+  }
+  void unready(sender& s) noexcept {
+    if (!s._ready) {
+      return;
+    }
+    (s._ready_prev != nullptr ? s._ready_prev->_ready_next : _ready_head) = s._ready_next;
+    (s._ready_next != nullptr ? s._ready_next->_ready_prev : _ready_tail) = s._ready_prev;
+    s._ready_prev = s._ready_next = nullptr;
+    s._ready = false;
+    if (_ready_head == nullptr) {
+      ::ev_timer_stop(_loop, &_timer);
+    }
+  }
+  static void callback(struct ev_loop* /* loop */,
+                       struct ev_timer* timer, int /* revents */) {
+    auto self = static_cast<hub*>(timer->data);
+    // A resumed coroutine may end its connection and with it other senders,
+    // which then leave the list on their own.
+    while (self->_ready_head != nullptr) {
+      auto& s = *self->_ready_head;
+      self->unready(s);
+      s.resume();
+    }
+  }
+
+  static void posted(struct ev_loop* /* loop */,
+                     struct ev_async* async, int /* revents */) {
+    auto self = static_cast<hub*>(async->data);
+    std::vector<shared_frame> frames;
+    {
+      std::lock_guard<std::mutex> lock(self->_posted_mutex);
+      frames.swap(self->_posted);
+    }
+    for (auto& f : frames) {
+      self->publish(f);
+    }
+  }
+
+  struct ev_loop* _loop;
+  ev_timer _timer;
+  // Frames posted from other threads
+  ev_async _async;
+  std::atomic<bool> _listening{false};
+  std::mutex _posted_mutex;
+  std::vector<shared_frame> _posted;
+  subscriber* _head = nullptr;
+  subscriber* _tail = nullptr;
+  std::size_t _size = 0;
+  sender* _ready_head = nullptr;
+  sender* _ready_tail = nullptr;
+};
+
+////////////////////////////////////////////////////////////////////////////////
+
+// Resumes the writer once there are frames, or the sender is closed
+struct sender::next_frames final {
+  sender& _sender;
+  ~next_frames() {
+    _sender._writer_waiting = nullptr;
+  }
+  bool await_ready() noexcept {
+    return _sender._size > 0 || _sender._closed;
+  }
+  void await_suspend(std::experimental::coroutine_handle<> handle) noexcept {
+    _sender._writer_waiting = handle;
+    _sender._writer_allocator = coro::current_frame_allocator();
+  }
+  void await_resume() noexcept {}
+};
+
+inline sender::sender(hub& h, std::size_t capacity, std::size_t highWater)
+  : _hub(h), _queue(std::max(capacity, std::size_t(1)))
+  , _high_water(highWater) {}
+
+inline sender::~sender() {
+  // The writer first, it may still want to be resumed
+  _writer.reset();
+  _hub.unready(*this);
+}
+
+template<typename channel_type>
+void sender::start(channel_type& channel) {
+  assert(!_writer);
+  _writer.emplace(write(channel));
+  _writer->on_done(writer_done, this);
+  _writer->start();
+}
+
+inline void sender::enqueue(shared_frame&& f) {
+  _bytes += f->size();
+  _queue[(_head + _size) % _queue.size()] = std::move(f);
+  _size++;
+  wake();
+}
+
+inline bool sender::push(shared_frame f) {
+  if (_closed) {
+    return false;
+  }
+  if (_size < _queue.size()) {
+    enqueue(std::move(f));
+    return true;
+  }
+  // Drop the oldest data frame, or the new frame if it is data and there
+  // are only control frames
+  auto capacity = _queue.size();
+  std::size_t i = 0;
+  while (i < _size && is_control(_queue[(_head + i) % capacity])) {
+    ++i;
+  }
+  _dropped++;
+  if (i == _size && !is_control(f)) {
+    return false;
+  }
+  if (i == _size) {
+    // Control frames only, the oldest goes
+    i = 0;
+  }
+  _bytes -= _queue[(_head + i) % capacity]->size();
+  for (; i > 0; --i) {
+    _queue[(_head + i) % capacity] = std::move(_queue[(_head + i - 1) % capacity]);
+  }
+  _queue[_head] = nullptr;
+  _head = (_head + 1) % capacity;
+  _size--;
+  enqueue(std::move(f));
+  return false;
+}
+
+inline sender::awaitable sender::async_send(shared_frame f) {
+  if (_closed || _waiting) {
+    return awaitable(*this, condition::ROOM, false);
+  }
+  if (_size == _queue.size()) {
+    // Grows rather than drops, the high water mark bounds the queue
+    std::vector<shared_frame> grown(_queue.size() * 2);
+    for (std::size_t i = 0; i < _size; ++i) {
+      grown[i] = std::move(_queue[(_head + i) % _queue.size()]);
+    }
+    _queue = std::move(grown);
+    _head = 0;
+  }
+  enqueue(std::move(f));
+  return awaitable(*this, condition::ROOM);
+}
+
+inline sender::awaitable sender::async_send(opcode code,
+                                            std::string_view payload) {
+  return async_send(encode(code, payload.data(), payload.size()));
+}
+
+inline sender::awaitable sender::flush() {
+  return awaitable(*this, condition::FLUSHED);
+}
+
+inline sender::awaitable sender::close() {
+  _closed = true;
+  wake();
+  return awaitable(*this, condition::FINISHED);
+}
+
+inline bool sender::satisfied(condition c) const noexcept {
+  if (finished() || (c == condition::FINISHED && !_writer)) {
+    return true;
+  }
+  switch (c) {
+  case condition::ROOM:
+    return _waiting ? _bytes <= _high_water / 2 : _bytes <= _high_water;
+  case condition::FLUSHED:
+    return _bytes == 0;
+  default:
+    return false;
+  }
+}
+
+inline void sender::wake() noexcept {
+  if ((_writer_waiting && (_size > 0 || _closed)) ||
+      (_waiting && satisfied(_waiting_for))) {
+    _hub.ready(*this);
+  }
+}
+
+inline void sender::resume() {
+  if (_writer_waiting && (_size > 0 || _closed)) {
+    coro::frame_allocator_scope scope(_writer_allocator);
+    std::exchange(_writer_waiting, nullptr).resume();
+  }
+  // Last, the producer may destroy the sender
+  if (_waiting && satisfied(_waiting_for)) {
+    coro::frame_allocator_scope scope(_waiting_allocator);
+    std::exchange(_waiting, nullptr).resume();
+  }
+}
+
+inline void sender::writer_done(void* context) {
+  auto self = static_cast<sender*>(context);
+  // The frames the writer could not write are of no use anymore
+  self->_closed = true;
+  self->wake();
+}
+
+template<typename channel_type>
+coro::sync_task<bool> sender::write(channel_type& channel) {
+  std::vector<shared_frame> sending;
+  std::vector<iovec> parts;
+  sending.reserve(max_frames_per_write);
+  parts.reserve(max_frames_per_write);
+  while (true) {
+    co_await next_frames{ *this };
+    if (_size == 0) {
+      co_return true; // closed
+    }
+    std::size_t bytes = 0;
+    while (_size > 0 && sending.size() < max_frames_per_write) {
+      auto& f = sending.emplace_back(std::move(_queue[_head]));
+      parts.push_back({ const_cast<char*>(f->data()), f->size() });
+      bytes += f->size();
+      _head = (_head + 1) % _queue.size();
+      _size--;
+    }
+    if (!co_await channel.async_writev(parts.data(), (int)parts.size())) {
+      co_return false;
+    }
+    _bytes -= bytes;
+    metrics::add(metrics::counter::WEBSOCKET_FRAMES_OUT, sending.size());
+    sending.clear();
+    parts.clear();
+    wake();
+  }
+}
+
+inline subscriber::subscriber(hub& h, std::size_t capacity)
+  : sender(h, capacity) {
+  _hub.join(*this);
+}
+
+inline subscriber::~subscriber() {
+  _hub.leave(*this);
+}
+
+////////////////////////////////////////////////////////////////////////////////
+
+// Notices clients that went silent. One that sends nothing for the duration
+// of the queue gets a ping through its sender, browsers answer those on
+// their own. One that does not even answer is given up: its connection fd is
+// shut down, which ends reader and writer as if the client was gone.
+template<typename reader_type>
+class keepalive final {
+public:
+  keepalive(event::timeout_queue& queue, reader_type const& r, sender& s,
+            int fd)
+    : _queue(queue), _reader(r), _sender(s), _fd(fd)
+    , _seen(r.reads()) {
+    _deadline.arm(_queue, this);
+  }
+  keepalive(keepalive const&) = delete;
+  keepalive& operator = (keepalive const&) = delete;
+
+  // Whether the client was given up
+  bool expired() const noexcept {
+    return _expired;
+  }
+private:
+  friend class event::deadline;
+  void expire() {
+    if (_reader.reads() != _seen) {
+      _seen = _reader.reads();
+      _pinged = false;
+    } else if (!_pinged) {
+      _pinged = true;
+      _sender.push(encode(opcode::PING, nullptr, 0));
+    } else {
+      _expired = true;
+      ::shutdown(_fd, SHUT_RDWR);
+      return;
+    }
+    _deadline.arm(_queue, this);
+  }
+
+  event::timeout_queue& _queue;
+  reader_type const& _reader;
+  sender& _sender;
+  int _fd;
+  std::size_t _seen;
+  bool _pinged = false;
+  bool _expired = false;
+  event::deadline _deadline;
+};
+
+} // namespace websocket
+
+////////////////////////////////////////////////////////////////////////////////
+
+#endif // BACKEND_HUB_HPP
+
+////////////////////////////////////////////////////////////////////////////////
@@ -0,0 +1,137 @@
+////////////////////////////////////////////////////////////////////////////////
+
+#include "log.hpp"
+
+#include <iostream>
+#include <sstream>
+#include <chrono>
+
+////////////////////////////////////////////////////////////////////////////////
+
+namespace logging {
+
+////////////////////////////////////////////////////////////////////////////////
+
+bool parse_level(std::string_view name, level& out) {
+  if (name == "debug") {
+    out = level::DEBUG;
+  } else if (name == "info") {
+    out = level::INFO;
+  } else if (name == "warning") {
+    out = level::WARNING;
+  } else if (name == "error") {
+    out = level::ERROR;
+  } else {
+    return false;
+  }
+  return true;
+}
+
+////////////////////////////////////////////////////////////////////////////////
+
+void formatter::format(record const& r, std::string& out) {
+  if (r.time != mSecond) {
+    std::tm local;
+    localtime_r(&r.time, &local);
+    mDateLength = std::strftime(mDate, sizeof(mDate), "%Y-%m-%d %X", &local);
+    mSecond = r.time;
+  }
+  std::stringstream ss;
+  ss << r.about.local << r.about.arrow << r.about.remote;
+  out.append(mDate, mDateLength);
+  out += " - ";
+  out += ss.str();
+  out += " - ";
+  out += r.event;
+  out += '(';
+  out += r.context;
+  out += ')';
+  out += r.detail;
+  out += '\n';
+}
+
+////////////////////////////////////////////////////////////////////////////////
+
+sink::sink(std::ostream& out, std::size_t capacity, level threshold)
+  : mOut(out), mRecords(capacity), mThreshold(threshold) {
+  mWriter = std::thread([this]() {
+    drain();
+  });
+}
+
+sink::~sink() {
+  {
+    std::lock_guard<std::mutex> lock(mMutex);
+    mStop.store(true, std::memory_order_release);
+  }
+  mWakeup.notify_one();
+  mWriter.join();
+}
+
+void sink::wake() {
+  {
+    std::lock_guard<std::mutex> lock(mMutex);
+    if (!mSleeping.exchange(false, std::memory_order_relaxed)) {
+      return; // another producer woke it
+    }
+  }
+  mWakeup.notify_one();
+}
+
+void sink::flush() {
+  auto pushed = mRecords.pushed();
+  while (mWritten.load(std::memory_order_acquire) < pushed) {
+    std::this_thread::sleep_for(std::chrono::microseconds(100));
+  }
+}
+
+void sink::drain() {
+  formatter f;
+  std::string buffer;
+  record r;
+  while (true) {
+    // Stops only after a pass that started after the stop request
+    bool stopping = mStop.load(std::memory_order_acquire);
+    std::size_t count = 0;
+    while (mRecords.try_pop(r)) {
+      f.format(r, buffer);
+      count++;
+      if (buffer.size() >= 64 * 1024) {
+        mOut.write(buffer.data(), buffer.size());
+        buffer.clear();
+      }
+    }
+    if (count > 0) {
+      mOut.write(buffer.data(), buffer.size());
+      mOut.flush();
+      buffer.clear();
+      mWritten.fetch_add(count, std::memory_order_release);
+    } else if (stopping) {
+      break;
+    } else {
+      // Nothing to do. Only the producer that finds the writer asleep pays
+      // for waking it.
+      std::unique_lock<std::mutex> lock(mMutex);
+      mSleeping.store(true, std::memory_order_relaxed);
+      std::atomic_thread_fence(std::memory_order_seq_cst);
+      if (!mRecords.ready() && !mStop.load(std::memory_order_acquire)) {
+        mWakeup.wait(lock, [this]() {
+          return !mSleeping.load(std::memory_order_relaxed) ||
+            mStop.load(std::memory_order_acquire);
+        });
+      }
+      mSleeping.store(false, std::memory_order_relaxed);
+    }
+  }
+}
+
+sink& default_sink() {
+  static sink s(std::cout);
+  return s;
+}
+
+////////////////////////////////////////////////////////////////////////////////
+
+} // namespace logging
+
+////////////////////////////////////////////////////////////////////////////////
@@ -0,0 +1,204 @@
+////////////////////////////////////////////////////////////////////////////////
+
+#ifndef BACKEND_LOG_HPP
+#define BACKEND_LOG_HPP
+
+////////////////////////////////////////////////////////////////////////////////
+
+#include "net.hpp"
+#include "metrics.hpp"
+#include <atomic>
+#include <condition_variable>
+#include <mutex>
+#include <thread>
+#include <memory>
+#include <string>
+#include <string_view>
+#include <ostream>
+#include <ctime>
+#include <cstdint>
+
+////////////////////////////////////////////////////////////////////////////////
+
+namespace logging {
+
+enum class level {
+  DEBUG, INFO, WARNING, ERROR
+};
+
+// Accepts "debug", "info", "warning" and "error"
+bool parse_level(std::string_view name, level& out);
+
+// Bounded queue with many producers and one consumer. Producers claim a cell
+// with a single compare and swap and never wait for each other or for the
+// consumer. A full queue rejects values instead of blocking.
+template<typename value_type>
+class ring final {
+public:
+  // Capacity is rounded up to a power of two
+  explicit ring(std::size_t capacity) {
+    std::size_t size = 2;
+    while (size < capacity) {
+      size *= 2;
+    }
+    mCells.reset(new cell[size]);
+    mMask = size - 1;
+    for (std::size_t i = 0; i < size; ++i) {
+      mCells[i].sequence.store(i, std::memory_order_relaxed);
+    }
+  }
+  ring(ring const&) = delete;
+  ring& operator = (ring const&) = delete;
+
+  std::size_t capacity() const {
+    return mMask + 1;
+  }
+  // Number of values pushed so far
+  std::size_t pushed() const {
+    return mTail.load(std::memory_order_acquire);
+  }
+
+  bool try_push(value_type&& value) {
+    auto position = mTail.load(std::memory_order_relaxed);
+    while (true) {
+      auto& c = mCells[position & mMask];
+      auto sequence = c.sequence.load(std::memory_order_acquire);
+      auto difference = (std::intptr_t)sequence - (std::intptr_t)position;
+      if (difference == 0) {
+        if (mTail.compare_exchange_weak(position, position + 1,
+                                        std::memory_order_relaxed)) {
+          c.value = std::move(value);
+          c.sequence.store(position + 1, std::memory_order_release);
+          return true;
+        }
+      } else if (difference < 0) {
+        return false; // full
+      } else {
+        position = mTail.load(std::memory_order_relaxed);
+      }
+    }
+  }
+  // Whether try_pop would get a value. Only ever called by the consumer.
+  bool ready() const {
+    auto sequence = mCells[mHead & mMask].sequence.load(std::memory_order_acquire);
+    return (std::intptr_t)sequence - (std::intptr_t)(mHead + 1) >= 0;
+  }
+  // Only ever called by the consumer
+  bool try_pop(value_type& out) {
+    auto& c = mCells[mHead & mMask];
+    auto sequence = c.sequence.load(std::memory_order_acquire);
+    if ((std::intptr_t)sequence - (std::intptr_t)(mHead + 1) < 0) {
+      return false; // empty, or the producer is not done yet
+    }
+    out = std::move(c.value);
+    c.sequence.store(mHead + mMask + 1, std::memory_order_release);
+    mHead++;
+    return true;
+  }
+
+private:
+  struct cell {
+    std::atomic<std::size_t> sequence;
+    value_type value;
+  };
+  std::unique_ptr<cell[]> mCells;
+  std::size_t mMask;
+  alignas(64) std::atomic<std::size_t> mTail{0};
+  alignas(64) std::size_t mHead = 0;
+};
+
+// Who a record is about. Addresses stay raw until the writer formats them.
+struct subject {
+  net::address local;
+  net::address remote;
+  char const* arrow = " <-> ";
+};
+
+// One line of the log, and whatever follows it. Context and event are string
+// literals, so records without detail do not allocate.
+struct record {
+  std::time_t time = 0;
+  level severity = level::INFO;
+  char const* context = "";
+  char const* event = "";
+  // Appended verbatim after "event(context)"
+  std::string detail;
+  subject about;
+};
+
+// Formats "date - subject - event(context)detail" and a newline
+class formatter final {
+public:
+  void format(record const& r, std::string& out);
+private:
+  // Dates only change once per second
+  std::time_t mSecond = -1;
+  char mDate[32] = {};
+  std::size_t mDateLength = 0;
+};
+
+// Log records are queued by the event loops and written by a thread of the
+// sink. Writing a record costs the loop a move into the queue, no formatting
+// and no system call, unless the writer is asleep and has to be woken up.
+// Records that do not fit into the queue are dropped rather than blocking a
+// loop, and counted in metrics::counter::LOG_RECORDS_DROPPED.
+class sink final {
+public:
+  explicit sink(std::ostream& out, std::size_t capacity = 4096,
+                level threshold = level::INFO);
+  ~sink();
+  sink(sink const&) = delete;
+  sink& operator = (sink const&) = delete;
+
+  void set_level(level threshold) {
+    mThreshold.store(threshold, std::memory_order_relaxed);
+  }
+  bool enabled(level severity) const {
+    return severity >= mThreshold.load(std::memory_order_relaxed);
+  }
+  void write(record&& r) {
+    if (!mRecords.try_push(std::move(r))) {
+      mDropped.fetch_add(1, std::memory_order_relaxed);
+      metrics::add(metrics::counter::LOG_RECORDS_DROPPED);
+      return;
+    }
+    // Pairs with the fence of the writer before it checks the queue a last
+    // time, either it sees the record or this sees it sleeping
+    std::atomic_thread_fence(std::memory_order_seq_cst);
+    if (mSleeping.load(std::memory_order_relaxed)) {
+      wake();
+    }
+  }
+  // Waits until everything written so far is out
+  void flush();
+  std::size_t dropped() const {
+    return mDropped.load(std::memory_order_relaxed);
+  }
+
+private:
+  void drain();
+  void wake();
+
+  std::ostream& mOut;
+  ring<record> mRecords;
+  std::atomic<level> mThreshold;
+  std::atomic<std::size_t> mDropped{0};
+  std::atomic<std::size_t> mWritten{0};
+  std::atomic<bool> mStop{false};
+  // The writer waits for records while the queue is empty
+  std::atomic<bool> mSleeping{false};
+  std::mutex mMutex;
+  std::condition_variable mWakeup;
+  std::thread mWriter;
+};
+
+// The sink of the server, writes to std::cout
+sink& default_sink();
+
+} // namespace logging
+
+////////////////////////////////////////////////////////////////////////////////
+
+#endif // BACKEND_LOG_HPP
+
+////////////////////////////////////////////////////////////////////////////////
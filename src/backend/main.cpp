@@ -1,39 +1,86 @@
 #include "utils.hpp"
 #include "http.hpp"
 #include "websocket.hpp"
+#include "hub.hpp"
 #include "fs.hpp"
 #include "net.hpp"
+#include "log.hpp"
+#include "metrics.hpp"
 
 #include <vector>
+#include <deque>
 #include <iostream>
 #include <sstream>
 #include <functional>
+#include <optional>
+#include <chrono>
+#include <csignal>
+#include <ctime>
+#include <type_traits>
+#include <sys/socket.h>
 
 static std::string
 dateAndTime() {
-  // NOTE: Not thread safe!
   auto now = std::chrono::system_clock::now();
   auto time = std::chrono::system_clock::to_time_t(now);
+  std::tm local;
+  localtime_r(&time, &local);
   std::stringstream ss;
-  ss << std::put_time(std::localtime(&time), "%Y-%m-%d %X");
+  ss << std::put_time(&local, "%Y-%m-%d %X");
   return ss.str();
 }
 
 enum class ConnectionStatus {
-  Ok, OkClose, Error, Upgrade
+  Ok, OkClose, Error, Upgrade, Closed
 };
 
-static ConnectionStatus
-generateHttpErrorResponse(http::response::status_code code,
-                          fs::cache const& files,
-                          http::response& response) {
+// Body of a single response, generated for it
+class generated_content final : public http::content {
+public:
+  generated_content(std::string location, std::string data, mime_type type)
+    : mLocation(std::move(location)), mData(std::move(data)), mType(type) {}
+  virtual std::size_t size() const override { return mData.size(); }
+  virtual char const* data() const override { return mData.data(); }
+  virtual std::string const& location() const override { return mLocation; }
+  virtual mime_type type() const override { return mType; }
+private:
+  std::string mLocation;
+  std::string mData;
+  mime_type mType;
+};
+
+static std::uint64_t
+nanosecondsSince(std::chrono::steady_clock::time_point start) {
+  return std::chrono::duration_cast<std::chrono::nanoseconds>(
+    std::chrono::steady_clock::now() - start).count();
+}
+
+// Counts a response and how long it took since start
+static void
+countResponse(http::response const& response,
+              std::chrono::steady_clock::time_point start) {
+  metrics::count_response((int)response.get_status_code());
+  metrics::record(metrics::histogram::REQUEST, nanosecondsSince(start));
+}
+
+// The page of a status code, if there is one
+static void
+setErrorPage(http::response::status_code code, fs::cache const& files,
+             http::response& response) {
   response.set_status_code(code);
-  response.get_headers().insert(std::make_pair("Connection", "close"));
   std::string url = "/" + std::to_string((int)code) + ".html";
   auto error = files.find(url);
   if (error) {
     response.set_content(error);
   }
+}
+
+static ConnectionStatus
+generateHttpErrorResponse(http::response::status_code code,
+                          fs::cache const& files,
+                          http::response& response) {
+  response.get_headers().insert(std::make_pair("Connection", "close"));
+  setErrorPage(code, files, response);
   return ConnectionStatus::Error;
 }
 
@@ -41,81 +88,117 @@ static ConnectionStatus
 generateWebsocketHandshake(http::request const& request,
                            fs::cache const& files,
                            http::response& response) {
-  auto& headers = request.get_headers();
-  auto key = headers.find("sec-websocket-key");
-  auto version = headers.find("sec-websocket-version");
-  if (key == headers.end() || version == headers.end()) {
+  auto key = request.get_header(http::request::header::SEC_WEBSOCKET_KEY);
+  auto version = request.get_header(http::request::header::SEC_WEBSOCKET_VERSION);
+  if (!key || !version) {
     return generateHttpErrorResponse(
       http::response::status_code::BAD_REQUEST, files, response);
   }
-  if (version->second != "13") {
+  if (*version != "13") {
     return generateHttpErrorResponse(
       http::response::status_code::BAD_REQUEST, files, response);
   }
   std::string magicString = "258EAFA5-E914-47DA-95CA-C5AB0DC85B11";
-  utils::SHA1 acceptHash = utils::sha1(key->second + magicString);
+  utils::SHA1 acceptHash = utils::sha1(std::string(*key) + magicString);
   auto acceptHash64 = utils::base64(acceptHash.data, 20);
   response.set_status_code(http::response::status_code::SWITCHING_PROTOCOLS);
   response.get_headers().insert(std::make_pair("Upgrade", "websocket"));
   response.get_headers().insert(std::make_pair("Connection", "Upgrade"));
   response.get_headers().insert(std::make_pair("Sec-WebSocket-Accept", acceptHash64));
-  return ConnectionStatus::Ok;
+  return ConnectionStatus::Upgrade;
 }
 
 static bool
 wantsToClose(http::request const& request) {
-  auto& headers = request.get_headers();
-  auto h = headers.find("connection");
-  return h != headers.end() && h->second == "close";
+  auto h = request.get_header(http::request::header::CONNECTION);
+  return h && *h == "close";
 }
 
 static bool
-wantsToUpgrade(http::request const& request, std::string& protocol) {
-  auto& headers = request.get_headers();
-  auto h = headers.find("upgrade");
-  if (h != headers.end()) {
-    protocol = h->second;
+wantsToUpgrade(http::request const& request, std::string_view& protocol) {
+  auto h = request.get_header(http::request::header::UPGRADE);
+  if (h) {
+    protocol = *h;
     return true;
   }
   return false;
 }
 
 static bool
-hasHostHeader(http::request const& request, std::string& host) {
-  auto& headers = request.get_headers();
-  auto h = headers.find("host");
-  if (h != headers.end()) {
-    host = h->second;
+hasHostHeader(http::request const& request, std::string_view& host) {
+  auto h = request.get_header(http::request::header::HOST);
+  if (h) {
+    host = *h;
     return true;
   }
   return false;
 }
 
+// Decodes the %XX escapes of a query. False if one of them is malformed.
+static bool
+percentDecode(std::string_view query, std::string& decoded) {
+  auto digit = [](char c) {
+    return c >= '0' && c <= '9' ? c - '0'
+      : c >= 'a' && c <= 'f' ? c - 'a' + 10
+      : c >= 'A' && c <= 'F' ? c - 'A' + 10
+      : -1;
+  };
+  decoded.clear();
+  decoded.reserve(query.size());
+  for (std::size_t i = 0; i < query.size(); ++i) {
+    if (query[i] != '%') {
+      decoded += query[i];
+      continue;
+    }
+    if (i + 2 >= query.size() ||
+        digit(query[i + 1]) < 0 || digit(query[i + 2]) < 0) {
+      return false;
+    }
+    decoded += (char)(digit(query[i + 1]) * 16 + digit(query[i + 2]));
+    i += 2;
+  }
+  return true;
+}
+
+// The smallest precompressed alternative the client accepts
+static fs::resource const*
+selectEncoding(http::request const& request, fs::resource const* content) {
+  for (auto& encoded : content->encodings()) {
+    if (http::accepts_encoding(request, encoded->encoding())) {
+      return encoded.get();
+    }
+  }
+  return content;
+}
+
 static ConnectionStatus
 generateResponse(http::request const& request,
                  fs::cache const& files,
                  http::response& response) {
+  response.set_body_omitted(request.get_method() == http::request::method::HEAD);
   switch (request.get_method()) {
-  case http::request::method::GET: {
-    std::string host;
+  case http::request::method::GET:
+  case http::request::method::HEAD: {
+    std::string_view host;
     if (!hasHostHeader(request, host)) {
       return generateHttpErrorResponse(
           http::response::status_code::BAD_REQUEST, files, response);
     }
     
     bool closeOnClientRequest = false;
-    std::string upgradeTo;
+    std::string_view upgradeTo;
     if (wantsToClose(request)) {
       closeOnClientRequest = true;
     } else if (wantsToUpgrade(request, upgradeTo)) {
-      if (upgradeTo == "websocket") {
+      if (upgradeTo == "websocket" &&
+          request.get_method() == http::request::method::GET) {
         return generateWebsocketHandshake(request, files, response);
       } else {
         return generateHttpErrorResponse(
           http::response::status_code::NOT_IMPLEMENTED, files, response);
       }
     }
-    auto uri = request.get_uri();
+    std::string_view uri = request.get_uri();
     if (uri == "/") {
       uri = "/index.html";
     }
@@ -124,8 +207,36 @@ generateResponse(http::request const& request,
       return generateHttpErrorResponse(
         http::response::status_code::NOT_FOUND, files, response);
     }
-    response.set_status_code(http::response::status_code::OK);
-    response.set_content(content);
+    content = selectEncoding(request, content);
+    http::byte_range range;
+    if (http::not_modified(request, *content)) {
+      response.set_status_code(http::response::status_code::NOT_MODIFIED);
+    } else {
+      switch (http::requested_range(request, *content, range)) {
+      case http::range_status::WHOLE:
+        response.set_status_code(http::response::status_code::OK);
+        break;
+      case http::range_status::PARTIAL:
+        response.set_status_code(http::response::status_code::PARTIAL_CONTENT);
+        response.set_range(range);
+        break;
+      case http::range_status::UNSATISFIABLE:
+        // A well-formed request, the connection stays open
+        response.get_headers().insert(
+          std::make_pair("Content-Range", "bytes */" + std::to_string(content->size())));
+        setErrorPage(http::response::status_code::RANGE_NOT_SATISFIABLE,
+                     files, response);
+        if (!response.get_content()) {
+          // Tells the client where the next response begins
+          response.get_headers().insert(std::make_pair("Content-Length", "0"));
+        }
+        content = nullptr;
+        break;
+      }
+    }
+    if (content) {
+      response.set_content(content);
+    }
     if (closeOnClientRequest) {
       response.get_headers().insert(std::make_pair("Connection", "close"));
       return ConnectionStatus::OkClose;
@@ -138,21 +249,25 @@ generateResponse(http::request const& request,
   }
 }
 
+// Logs what happens on a socket to the default sink. Only ever formats
+// anything if the record passes the sink's level, and then on the sink's
+// thread.
 class scoped_logger final {
 public:
   template<typename tocket_type>
   scoped_logger(tocket_type const& client,
-                std::string const& context)
-    : _context(context) {
-    std::stringstream ss;
-    ss << client;
-    _name = ss.str();
-    std::cout << dateAndTime() << " - " << _name
-              << " - begin(" << _context << ")" << std::endl;
+                char const* context)
+    : _sink(logging::default_sink())
+    , _context(context) {
+    _subject.local = client.local_address();
+    _subject.remote = client.remote_address();
+    if constexpr (std::is_same_v<tocket_type, net::tls_socket>) {
+      _subject.arrow = " <-TLS-> ";
+    }
+    log(logging::level::INFO, "begin");
   }
   ~scoped_logger() {
-    std::cout << dateAndTime() << " - " << _name
-              << " - end(" << _context << ")" << std::endl;
+    log(logging::level::INFO, "end");
   }
   scoped_logger(scoped_logger const&) = delete;
   scoped_logger(scoped_logger&&) = delete;
@@ -160,68 +275,210 @@ public:
   scoped_logger& operator = (scoped_logger&&) = delete;
   void noteworthy(http::request const& request,
                   http::response const& response) const {
-    std::cout << dateAndTime() << " - " << _name
-              << " - noteworthy(" << _context << ")" << std::endl;
-    std::cout << ">>>>" << std::endl;
-    std::cout << request;
-    std::cout << "====" << std::endl;
-    std::cout << response;
-    std::cout << "<<<<" << std::endl;
-  }
-  void fatal(std::string const& what) {
-    std::cout << dateAndTime() << " - " << _name
-              << " - fatal(" << _context << ")" << std::endl;
-    std::cout << what << std::endl;
-  }
-  void note(std::string const& what) {
-    std::cout << dateAndTime() << " - " << _name
-              << " - note(" << _context << "): "
-              << what << std::endl;
+    if (!_sink.enabled(logging::level::WARNING)) {
+      return;
+    }
+    std::stringstream ss;
+    ss << std::endl << ">>>>" << std::endl;
+    ss << request;
+    ss << "====" << std::endl;
+    ss << response;
+    ss << "<<<<";
+    log(logging::level::WARNING, "noteworthy", ss.str());
+  }
+  void fatal(std::string const& what) const {
+    log(logging::level::ERROR, "fatal", "\n" + what);
+  }
+  void note(std::string const& what,
+            logging::level severity = logging::level::INFO) const {
+    if (_sink.enabled(severity)) {
+      log(severity, "note", ": " + what);
+    }
   }
 private:
-  std::string _name;
-  std::string _context;
+  void log(logging::level severity, char const* event,
+           std::string detail = std::string()) const {
+    if (_sink.enabled(severity)) {
+      _sink.write(logging::record{
+        std::time(nullptr), severity, _context, event, std::move(detail), _subject
+      });
+    }
+  }
+
+  logging::sink& _sink;
+  char const* _context;
+  logging::subject _subject;
+};
+
+// Deadlines of http connections, in seconds. A connection that misses one is
+// closed.
+// * Time from accepting a TLS connection until the handshake is done
+constexpr ev_tstamp handshakeTimeout = 10.;
+// * Time to wait for the next request on a keep-alive connection
+constexpr ev_tstamp idleTimeout = 60.;
+// * Time from accepting a connection, or the end of its TLS handshake, or
+//   from the first byte of a request after the first one, until the request
+//   header is complete
+constexpr ev_tstamp headerTimeout = 10.;
+// * Time from the first byte of a request until the response is written
+constexpr ev_tstamp requestTimeout = 300.;
+
+// * Time a websocket client may send nothing before it is pinged, and then
+//   again before it is closed
+constexpr ev_tstamp websocketPingInterval = 30.;
+
+// What a websocket client may send. Messages are read as a whole, so a
+// connection holds on to at most one message of 64 KiB while it reads it.
+constexpr websocket::limits websocketLimits{ 64 * 1024, 64 * 1024, 16 * 1024 };
+
+// The push channel of the server, a hub per shard. What a producer of the
+// server publishes, e.g. /publish on the control port, goes to the websocket
+// clients of every shard. Messages of clients only go to the other clients
+// with --websocket-relay.
+struct websocketHubs {
+  // They outlive the shards, whose connections leave them when they are
+  // destroyed.
+  std::deque<websocket::hub> shards;
+  bool relay = false;
+
+  // Publishes f from the shard of local to every shard
+  void publish(websocket::hub& local, websocket::shared_frame const& f,
+               websocket::subscriber const* from = nullptr) {
+    for (auto& hub : shards) {
+      if (&hub == &local) {
+        hub.publish(f, from);
+      } else {
+        hub.post(f);
+      }
+    }
+  }
 };
 
+// Advances to the next request of a stream. False if the connection was
+// closed instead.
+template<typename iterator_type>
+static coro::task<bool>
+nextRequest(iterator_type& it, iterator_type end) {
+  co_await ++it;
+  co_return it != end;
+}
+
+// Reads one request and writes its response. Reports how many bytes the
+// client sent ahead of the response in unread.
+template<typename channel_type, typename iterator_type>
+static coro::task<ConnectionStatus>
+serveRequest(event::scheduler& s, channel_type& channel,
+             iterator_type& it, iterator_type end,
+             fs::cache const& files, scoped_logger& logger,
+             std::size_t& unread) {
+  if (!co_await event::with_timeout(s, nextRequest(it, end), headerTimeout)) {
+    co_return ConnectionStatus::Closed;
+  }
+  auto start = std::chrono::steady_clock::now();
+  auto request = *it;
+  // The header block stays buffered until the next request is read
+  unread = channel.peek().size() - request.size();
+  http::response response;
+  auto status = generateResponse(request, files, response);
+  if (status != ConnectionStatus::Ok && status != ConnectionStatus::Upgrade) {
+    logger.noteworthy(request, response);
+  }
+  auto written = co_await http::response::async_write(channel, response);
+  countResponse(response, start);
+  if (!written) {
+    co_return ConnectionStatus::Closed;
+  }
+  co_return status;
+}
+
+// Sends what is published to a websocket client until the client closes the
+// connection, or stops answering pings. Relays the messages of the client to
+// the other clients if that is enabled, and drops them otherwise.
+template<typename channel_type>
+static coro::task<void>
+serveWebsocket(event::scheduler& s, channel_type& channel, int fd,
+               websocketHubs& hubs, websocket::hub& hub,
+               scoped_logger& logger) {
+  websocket::subscriber subscriber(hub);
+  subscriber.start(channel);
+  // Replies go through the queue as well, the subscriber's writer is the
+  // only one writing to the connection.
+  auto reply = [&subscriber](websocket::frame const& f) -> coro::task<bool> {
+    subscriber.push(websocket::encode(f));
+    co_return true;
+  };
+  websocket::reader reader(channel, websocketLimits);
+  websocket::keepalive keepalive(s.timeouts(websocketPingInterval), reader,
+                                 subscriber, fd);
+  websocket::buffer_pool payloads;
+  try {
+    for co_await (auto message : websocket::messages(reader, reply, &payloads)) {
+      if (hubs.relay) {
+        hubs.publish(hub, websocket::encode(message), &subscriber);
+      }
+      payloads.release(std::move(message.data));
+    }
+  } catch (std::runtime_error&) {
+    // TLS connections may fail to read once they are shut down
+    if (!keepalive.expired()) {
+      throw;
+    }
+  }
+  if (keepalive.expired()) {
+    logger.note("timeout");
+    co_return;
+  }
+  if (reader.status() != 0 &&
+      reader.status() != (std::uint16_t)websocket::close_status::NORMAL) {
+    logger.note("websocket closed with status " + std::to_string(reader.status()));
+  }
+  // Lets the writer send the reply to a close
+  co_await subscriber.close();
+}
+
 template<typename socket_type>
 static coro::sync_task<void>
 httpServer(event::scheduler& s,
            socket_type client,
-           fs::cache const& files) {
+           fs::cache const& files,
+           websocketHubs& hubs,
+           websocket::hub& hub) {
   using channel_type = com::channel<event::scheduler, socket_type>;
+  // Frames of everything this connection awaits come from its own arena,
+  // which is returned in one go when the connection ends.
+  coro::frame_arena frames;
+  coro::frame_allocator_scope scope(frames);
   scoped_logger logger(client, "https");
-  channel_type channel(s, client);
-  auto chars = channel.async_char_stream();
+  metrics::scoped_gauge active(metrics::counter::ACTIVE);
+  channel_type channel(s, client, com::default_buffer_size);
   ConnectionStatus status = ConnectionStatus::Ok;
   try {
-  for co_await (auto request : http::request::stream(chars)) {
-      http::response response;
-      status = generateResponse(request, files, response);
-      if (status != ConnectionStatus::Ok) {
-        logger.noteworthy(request, response);
-      }
-
-      if (!co_await http::response::async_write(channel, response)) {
-        co_return;
-      }
-      if (status != ConnectionStatus::Ok) {
-        break;
-      }
+    if constexpr (std::is_same_v<socket_type, net::tls_socket>) {
+      co_await client.async_handshake(s, handshakeTimeout);
     }
-  if (status == ConnectionStatus::Upgrade) {
-#if 0
-    std::cout << dateAndTime() << " - upgrade: " << clientName << std::endl;
-    for co_await (auto frame : websocket::stream(channel)) {
-        std::string msg(frame.data.begin(), frame.data.end());
-        if (!co_await websocket::async_send_text(channel, "Hey there!")) {
-          break;
+    {
+      // Gone before the upgrade, the request stream consumes what is left of
+      // the last header when it ends
+      auto requests = http::request::stream(channel);
+      auto it = requests.begin();
+      std::size_t unread = 0;
+      for (bool first = true; status == ConnectionStatus::Ok; first = false) {
+        // Idle until the next request begins, unless it was sent ahead
+        if (!first && unread == 0 &&
+            co_await event::with_timeout(s, channel.async_fill(), idleTimeout) == 0) {
+          co_return; // connection was closed
         }
-        co_await websocket::async_send_close(channel);
+        status = co_await event::with_timeout(
+          s, serveRequest(s, channel, it, requests.end(), files, logger, unread),
+          requestTimeout);
       }
-#else
-    throw std::runtime_error("error: Ignoring attempt to upgrade");
-#endif
-  }
+    }
+    if (status == ConnectionStatus::Upgrade) {
+      logger.note("upgrade");
+      co_await serveWebsocket(s, channel, client.fd(), hubs, hub, logger);
+    }
+  } catch (event::timeout&) {
+    logger.note("timeout");
   } catch (std::runtime_error& err) {
     logger.fatal(err.what());
   }
@@ -232,11 +489,16 @@ static coro::sync_task<void>
 httpsForwarder(event::scheduler& s,
                net::socket client) {
   scoped_logger logger(client, "http");
-  open_channel channel(s, client);
-  auto chars = channel.async_char_stream();
+  metrics::scoped_gauge active(metrics::counter::ACTIVE);
+  open_channel channel(s, client, com::default_buffer_size);
   try {
-    for co_await (auto request : http::request::stream(chars)) {
-        std::string host;
+    auto requests = http::request::stream(channel);
+    auto it = requests.begin();
+    if (co_await event::with_timeout(s, nextRequest(it, requests.end()),
+                                     headerTimeout)) {
+        auto start = std::chrono::steady_clock::now();
+        auto request = *it;
+        std::string_view host;
         http::response response;
         if (!hasHostHeader(request, host)) {
           // Host header is required
@@ -245,7 +507,7 @@ httpsForwarder(event::scheduler& s,
           response.get_headers().insert(std::make_pair("Connection", "close"));
         } else {
           // TODO: be more strict about the host header?
-          auto location = "https://" + host + request.get_uri();
+          auto location = "https://" + std::string(host) + std::string(request.get_uri());
           response.set_status_code(http::response::status_code::MOVED_PERMANENTLY);
           response.get_headers().insert(std::make_pair("Location", location));
           response.get_headers().insert(std::make_pair("Connection", "close"));
@@ -253,11 +515,12 @@ httpsForwarder(event::scheduler& s,
     
         logger.noteworthy(request, response);
 
-        if (!co_await http::response::async_write(channel, response)) {
-          co_return;
-        }
-        co_return;
+        co_await event::with_timeout(
+          s, http::response::async_write(channel, response), requestTimeout);
+        countResponse(response, start);
       }
+  } catch (event::timeout&) {
+    logger.note("timeout");
   } catch (std::runtime_error& err) {
     logger.fatal(err.what());
   }
@@ -266,41 +529,74 @@ httpsForwarder(event::scheduler& s,
 using open_channel = com::channel<event::scheduler, net::socket>;
 static coro::sync_task<void>
 controlHandler(event::scheduler& s,
-               net::socket client) {
+               net::socket client,
+               websocketHubs& hubs,
+               websocket::hub& hub) {
   bool shutdown = false;
+  std::string message;
   scoped_logger logger(client, "control");
-  open_channel channel(s, client);
-  auto chars = channel.async_char_stream();
+  metrics::scoped_gauge active(metrics::counter::ACTIVE);
+  open_channel channel(s, client, com::default_buffer_size);
   try {
-    for co_await (auto request : http::request::stream(chars)) {
-        std::string host;
+    auto requests = http::request::stream(channel);
+    auto it = requests.begin();
+    if (co_await event::with_timeout(s, nextRequest(it, requests.end()),
+                                     headerTimeout)) {
+        auto request = *it;
+        std::string_view host;
         http::response response;
+        std::optional<generated_content> body;
+        response.get_headers().insert(std::make_pair("Connection", "close"));
         if (request.get_method() != http::request::method::GET ||
-            !hasHostHeader(request, host) ||
-            request.get_uri() != "/shutdown") {
+            !hasHostHeader(request, host)) {
           // TODO: Describe reason in message body?
           response.set_status_code(http::response::status_code::BAD_REQUEST);
-          response.get_headers().insert(std::make_pair("Connection", "close"));
-        } else {
+        } else if (request.get_uri() == "/shutdown") {
           response.set_status_code(http::response::status_code::OK);
-          response.get_headers().insert(std::make_pair("Connection", "close"));
           shutdown = true;
+        } else if (request.get_uri().substr(0, 9) == "/publish?" &&
+                   percentDecode(request.get_uri().substr(9), message)) {
+          hubs.publish(hub, websocket::encode(websocket::opcode::TEXT_FRAME,
+                                              message.data(), message.size()));
+          response.set_status_code(http::response::status_code::OK);
+        } else if (request.get_uri() == "/metrics") {
+          body.emplace("/metrics", metrics::prometheus(metrics::collect()),
+                       http::content::mime_type::TEXT);
+        } else if (request.get_uri() == "/stats") {
+          body.emplace("/stats", metrics::json(metrics::collect()),
+                       http::content::mime_type::JSON);
+        } else {
+          response.set_status_code(http::response::status_code::BAD_REQUEST);
         }
-        logger.noteworthy(request, response);
-        if (!co_await http::response::async_write(channel, response)) {
+        if (body) {
+          // Scraped all the time, not worth a log entry
+          response.set_status_code(http::response::status_code::OK);
+          response.set_content(&*body);
+        } else {
+          logger.noteworthy(request, response);
+        }
+        if (!co_await event::with_timeout(
+              s, http::response::async_write(channel, response),
+              requestTimeout)) {
           co_return;
         }
         if (shutdown) {
           logger.note("shutdown");
           s.trigger_shutdown_from_task();
         }
-        co_return;
       }
+  } catch (event::timeout&) {
+    logger.note("timeout");
   } catch (std::runtime_error& err) {
     logger.fatal(err.what());
   }
 }
 
+// Connections taken per wakeup of a listener. Clients queued up during a
+// burst are accepted without going through the loop for each of them, but
+// the established connections get their turn after every batch.
+constexpr std::size_t acceptBatch = 64;
+
 template<typename socket_type, typename handler_type>
 coro::sync_task<void>
 acceptor(event::scheduler& s, socket_type listener,
@@ -313,17 +609,51 @@ acceptor(event::scheduler& s, socket_type listener,
         logger.fatal("accept failed");
         continue;
       }
-      logger.note("accepted");
-      //std::cout << dateAndTime() << " - " << client << " - accepted" << std::endl;
-      s.execute(handler(std::move(client)));
+      std::size_t accepted = 0;
+      while (client) {
+        logger.note("accepted", logging::level::DEBUG);
+        metrics::add(metrics::counter::ACCEPTED);
+        s.execute(handler(std::move(client)));
+        if (++accepted == acceptBatch) {
+          break;
+        }
+        client = listener.accept();
+      }
+      if (accepted == acceptBatch) {
+        // More may be pending. Lets the loop poll before the next batch.
+        co_await event::timer(s, 0.);
+      }
     } catch (std::runtime_error& err) {
       logger.fatal(err.what());
     }
   }
 }
 
+// Gives the config of a shard the next session ticket key whenever one is
+// due. Every shard does that for its own config, libtls configs are not
+// thread-safe.
+static coro::sync_task<void>
+rotateTicketKeys(event::scheduler& s, crypto::sessions& sessions,
+                 crypto::config& config) {
+  while (true) {
+    co_await event::timer(s, sessions.next_rotation(std::time(nullptr)));
+    try {
+      sessions.rotate(config, std::time(nullptr));
+    } catch (std::runtime_error& err) {
+      // Tickets of the previous key still work until it expires
+      auto& sink = logging::default_sink();
+      if (sink.enabled(logging::level::ERROR)) {
+        sink.write(logging::record{ std::time(nullptr), logging::level::ERROR,
+                                    "tickets", "error",
+                                    std::string(": ") + err.what(), {} });
+      }
+    }
+  }
+}
+
 template<typename socket_type, typename... arg_types>
-auto createListeners(char const* host, char const* port, arg_types&& ...args) {
+auto createListeners(char const* host, char const* port, int backlog,
+                     bool reusePort, arg_types&& ...args) {
   std::vector<socket_type> listeners;
   {
     // First try to bind to IPv6
@@ -331,7 +661,7 @@ auto createListeners(char const* host, char const* port, arg_types&& ...args) {
     for (auto& info : options) {
       std::cout << "Try to listen on " << info << std::endl;
       try {
-        auto l = socket_type(info, 10, args...);
+        auto l = socket_type(info, backlog, args..., reusePort);
         std::cout << "  Listening: " << l << std::endl;
         listeners.push_back(std::move(l));
         
@@ -346,7 +676,7 @@ auto createListeners(char const* host, char const* port, arg_types&& ...args) {
     for (auto& info : options) {
       std::cout << "Try to listen on " << info << std::endl;
       try {
-        auto l = socket_type(info, 10, args...);
+        auto l = socket_type(info, backlog, args..., reusePort);
         std::cout << "  Listening: " << l << std::endl;
         listeners.push_back(std::move(l));
       } catch (std::runtime_error& ex) {
@@ -359,10 +689,23 @@ auto createListeners(char const* host, char const* port, arg_types&& ...args) {
 
 int main(int argc, char const* argv[]) {
   std::cout << dateAndTime() << " - Launching Server" << std::endl;
+  // sendfile has no MSG_NOSIGNAL. Closed connections are reported as EPIPE.
+  std::signal(SIGPIPE, SIG_IGN);
   for (int i = 0; i < argc; ++i) {
     std::cout << "argv[" << i << "] = \"" << argv[i] << "\"" << std::endl;
   }
   bool devMode = false;
+  bool mapFiles = false;
+  bool relayWebsockets = false;
+  std::size_t threads = 1;
+  // The kernel caps it at net.core.somaxconn / kern.ipc.somaxconn
+  int backlog = SOMAXCONN;
+  // TLS handshakes in progress per listener. Handshakes cost more CPU than
+  // anything else the server does, a flood of them must not starve the
+  // established connections.
+  std::size_t maxHandshakes = 64;
+  // Seconds a client may resume its TLS session, zero disables resumption
+  int sessionLifetime = 2 * 60 * 60;
   std::string path(".");
   std::string cert;
   std::string key;
@@ -382,43 +725,108 @@ int main(int argc, char const* argv[]) {
     if (std::string(argv[i]) == "--dev") {
       devMode = true;
     }
+    if (std::string(argv[i]) == "--mmap") {
+      mapFiles = true;
+    }
+    if (std::string(argv[i]) == "--websocket-relay") {
+      relayWebsockets = true;
+    }
+    if (std::string(argv[i]) == "--threads") {
+      assert(i+1 < argc);
+      threads = std::max(1, std::stoi(argv[++i]));
+    }
+    if (std::string(argv[i]) == "--log-level") {
+      assert(i+1 < argc);
+      logging::level level;
+      if (logging::parse_level(argv[++i], level)) {
+        logging::default_sink().set_level(level);
+      } else {
+        std::cout << "Ignoring unknown --log-level " << argv[i] << std::endl;
+      }
+    }
+    if (std::string(argv[i]) == "--backlog") {
+      assert(i+1 < argc);
+      backlog = std::max(1, std::stoi(argv[++i]));
+    }
+    if (std::string(argv[i]) == "--max-handshakes") {
+      assert(i+1 < argc);
+      maxHandshakes = std::max(1, std::stoi(argv[++i]));
+    }
+    if (std::string(argv[i]) == "--session-lifetime") {
+      assert(i+1 < argc);
+      sessionLifetime = std::max(0, std::stoi(argv[++i]));
+    }
+  }
+  if (devMode && threads > 1) {
+    // Resources get reloaded in dev mode. That must not race with other
+    // shards serving the same resource.
+    std::cout << "Ignoring --threads " << threads << " in dev mode" << std::endl;
+    threads = 1;
+  }
+  if (devMode && mapFiles) {
+    // Editors rewrite files in place. Serving a mapping of a truncated file
+    // raises SIGBUS.
+    std::cout << "Ignoring --mmap in dev mode" << std::endl;
+    mapFiles = false;
   }
 
-  event::scheduler s;
-  std::vector<coro::sync_task<void>> tasks;
-  fs::cache files(path, devMode);
-  auto controlListeners = createListeners<net::socket>(nullptr, "6789");
+  websocketHubs hubs;
+  hubs.relay = relayWebsockets;
+  // Every shard gets its own loop, thread and SO_REUSEPORT listeners. A
+  // connection stays on the shard that accepted it.
+  event::scheduler_pool shards(threads);
+  bool reusePort = shards.size() > 1;
+  fs::cache files(path, devMode,
+                  mapFiles ? fs::storage::MAP : fs::storage::COPY);
+  // One config per shard, as each of them rotates its ticket keys on its own
+  // thread. Sessions are resumed by ticket on every shard, by session ID only
+  // on the shard that created the session.
+  std::optional<crypto::sessions> sessions;
+  std::deque<crypto::config> tlsConfigs;
+  if (!devMode && sessionLifetime > 0) {
+    sessions.emplace(sessionLifetime);
+  }
+  for (std::size_t i = 0; i < shards.size(); ++i) {
+    event::scheduler& s = shards[i];
+    auto& hub = hubs.shards.emplace_back(s);
+    if (devMode) {
+      auto httpListeners = createListeners<net::socket>(nullptr, "8080", backlog, reusePort);
+      for (auto& listener : httpListeners) {
+        s.execute(acceptor(s, std::move(listener), [&s, &files, &hubs, &hub](auto client) {
+          return httpServer(s, std::move(client), files, hubs, hub);
+        }));
+      }
+    } else {
+      auto& tlsConfig = tlsConfigs.emplace_back(cert, key);
+      if (sessions) {
+        sessions->configure(tlsConfig, std::time(nullptr));
+        s.execute(rotateTicketKeys(s, *sessions, tlsConfig));
+      }
+      auto httpsListeners = createListeners<net::tls_socket>(nullptr, "443", backlog, reusePort, tlsConfig, maxHandshakes);
+      auto httpListeners = createListeners<net::socket>(nullptr, "80", backlog, reusePort);
+      for (auto& listener : httpsListeners) {
+        s.execute(acceptor(s, std::move(listener), [&s, &files, &hubs, &hub](auto client) {
+          return httpServer(s, std::move(client), files, hubs, hub);
+        }));
+      }
+      for (auto& listener : httpListeners) {
+        s.execute(acceptor(s, std::move(listener), [&s](auto client) {
+          return httpsForwarder(s, std::move(client));
+        }));
+      }
+    }
+  }
   if (devMode) {
-    auto httpListeners = createListeners<net::socket>(nullptr, "8080");
-    for (auto& listener : httpListeners) {
-      s.execute(acceptor(s, std::move(listener), [&s, &files](auto client) {
-        return httpServer(s, std::move(client), files);
-      }));
-    }
-    for (auto& listener : controlListeners) {
-      s.execute(acceptor(s, std::move(listener), [&s](auto client) {
-        return controlHandler(s, std::move(client));
-      }));
-    }
-  } else {
-    crypto::config tlsConfig(cert, key);
-    auto httpsListeners = createListeners<net::tls_socket>(nullptr, "443", tlsConfig);
-    auto httpListeners = createListeners<net::socket>(nullptr, "80");
-    for (auto& listener : httpsListeners) {
-      s.execute(acceptor(s, std::move(listener), [&s, &files](auto client) {
-        return httpServer(s, std::move(client), files);
-      }));
-    }
-    for (auto& listener : httpListeners) {
-      s.execute(acceptor(s, std::move(listener), [&s](auto client) {
-        return httpsForwarder(s, std::move(client));
-      }));
-    }
-    for (auto& listener : controlListeners) {
-      s.execute(acceptor(s, std::move(listener), [&s](auto client) {
-        return controlHandler(s, std::move(client));
-      }));
-    }
-  }
-  return s.run();
+    shards[0].execute(files.watch(shards[0]));
+  }
+  // The control port only lives on the first shard, which owns shutdown.
+  event::scheduler& control = shards[0];
+  auto& controlHub = hubs.shards[0];
+  auto controlListeners = createListeners<net::socket>(nullptr, "6789", 10, false);
+  for (auto& listener : controlListeners) {
+    control.execute(acceptor(control, std::move(listener), [&control, &hubs, &controlHub](auto client) {
+      return controlHandler(control, std::move(client), hubs, controlHub);
+    }));
+  }
+  return shards.run();
 }
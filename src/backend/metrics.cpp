@@ -0,0 +1,201 @@
+////////////////////////////////////////////////////////////////////////////////
+
+#include "metrics.hpp"
+
+#include <deque>
+#include <mutex>
+#include <sstream>
+#include <iomanip>
+#include <iterator>
+#include <algorithm>
+
+////////////////////////////////////////////////////////////////////////////////
+
+namespace metrics {
+
+////////////////////////////////////////////////////////////////////////////////
+
+namespace {
+struct registry {
+  std::mutex mutex;
+  // Never shrinks, shards stay in place
+  std::deque<shard> shards;
+};
+
+registry& shards() {
+  static registry r;
+  return r;
+}
+
+struct description {
+  char const* name;
+  char const* type;
+  char const* help;
+};
+
+description const counterDescriptions[] = {
+  { "connections_accepted_total", "counter", "Connections accepted." },
+  { "connections_active", "gauge", "Connections open right now." },
+  { "received_bytes_total", "counter", "Payload bytes read from connections." },
+  { "sent_bytes_total", "counter", "Payload bytes written to connections." },
+  { "tls_handshakes_total", "counter", "TLS handshakes completed." },
+  { "tls_resumed_sessions_total", "counter",
+    "TLS handshakes that resumed a session." },
+  { "tls_handshake_failures_total", "counter", "TLS handshakes that failed." },
+  { "websocket_frames_received_total", "counter", "Websocket frames read." },
+  { "websocket_frames_sent_total", "counter", "Websocket frames written." },
+  { "scheduler_tasks", "gauge", "Scheduler tasks that did not finish yet." },
+  { "log_records_dropped_total", "counter",
+    "Log records dropped because the log writer fell behind." },
+};
+static_assert(std::size(counterDescriptions) == (std::size_t)counter::COUNT);
+
+description const histogramDescriptions[] = {
+  { "request_duration_seconds", "histogram",
+    "Time from a complete request header until the response is written." },
+  { "io_wait_seconds", "histogram",
+    "Time an I/O operation waits for its file descriptor." },
+  { "tls_handshake_duration_seconds", "histogram",
+    "Time a successful TLS handshake takes." },
+};
+static_assert(std::size(histogramDescriptions) == (std::size_t)histogram::COUNT);
+
+constexpr char const* prefix = "ld48_";
+// Exported bucket bounds are powers of two from about a microsecond to
+// about a minute. Prometheus wants the same bounds in every scrape.
+constexpr unsigned firstExportedPower = 10;
+constexpr unsigned lastExportedPower = 36;
+
+double seconds(std::uint64_t nanoseconds) {
+  return nanoseconds * 1e-9;
+}
+}
+
+////////////////////////////////////////////////////////////////////////////////
+
+shard* attach() {
+  auto& r = shards();
+  std::lock_guard<std::mutex> lock(r.mutex);
+  return &r.shards.emplace_back();
+}
+
+std::uint64_t snapshot::distribution::quantile(double q) const {
+  if (count == 0) {
+    return 0;
+  }
+  auto rank = std::min(static_cast<std::uint64_t>(q * count), count - 1);
+  std::uint64_t seen = 0;
+  for (std::size_t i = 0; i < buckets::count; ++i) {
+    seen += counts[i];
+    if (seen > rank) {
+      return buckets::upper(i);
+    }
+  }
+  return buckets::upper(buckets::count - 1);
+}
+
+snapshot collect() {
+  snapshot s;
+  auto& r = shards();
+  std::lock_guard<std::mutex> lock(r.mutex);
+  for (auto& shard : r.shards) {
+    for (std::size_t i = 0; i < s.counters.size(); ++i) {
+      s.counters[i] += shard.counters[i].load(std::memory_order_relaxed);
+    }
+    for (std::size_t i = 0; i < s.responses.size(); ++i) {
+      s.responses[i] += shard.responses[i].load(std::memory_order_relaxed);
+    }
+    for (std::size_t h = 0; h < s.histograms.size(); ++h) {
+      auto& from = shard.histograms[h];
+      auto& to = s.histograms[h];
+      for (std::size_t i = 0; i < buckets::count; ++i) {
+        auto count = from.counts[i].load(std::memory_order_relaxed);
+        to.counts[i] += count;
+        to.count += count;
+      }
+      to.sum += from.sum.load(std::memory_order_relaxed);
+    }
+  }
+  return s;
+}
+
+std::string prometheus(snapshot const& s) {
+  std::stringstream ss;
+  ss << std::setprecision(9);
+  for (std::size_t i = 0; i < s.counters.size(); ++i) {
+    auto& d = counterDescriptions[i];
+    ss << "# HELP " << prefix << d.name << " " << d.help << "\n";
+    ss << "# TYPE " << prefix << d.name << " " << d.type << "\n";
+    ss << prefix << d.name << " " << s.counters[i] << "\n";
+  }
+  ss << "# HELP " << prefix << "responses_total Responses by status code.\n";
+  ss << "# TYPE " << prefix << "responses_total counter\n";
+  for (std::size_t code = 0; code < s.responses.size(); ++code) {
+    if (s.responses[code] != 0) {
+      ss << prefix << "responses_total{code=\"" << code << "\"} "
+         << s.responses[code] << "\n";
+    }
+  }
+  for (std::size_t h = 0; h < s.histograms.size(); ++h) {
+    auto& d = histogramDescriptions[h];
+    auto& values = s.histograms[h];
+    ss << "# HELP " << prefix << d.name << " " << d.help << "\n";
+    ss << "# TYPE " << prefix << d.name << " " << d.type << "\n";
+    std::uint64_t cumulative = 0;
+    std::size_t i = 0;
+    for (auto power = firstExportedPower; power <= lastExportedPower; ++power) {
+      // Buckets end right below a power of two
+      auto bound = std::uint64_t(1) << power;
+      for (; i < buckets::index(bound); ++i) {
+        cumulative += values.counts[i];
+      }
+      ss << prefix << d.name << "_bucket{le=\"" << seconds(bound) << "\"} "
+         << cumulative << "\n";
+    }
+    ss << prefix << d.name << "_bucket{le=\"+Inf\"} " << values.count << "\n";
+    ss << prefix << d.name << "_sum " << seconds(values.sum) << "\n";
+    ss << prefix << d.name << "_count " << values.count << "\n";
+  }
+  return ss.str();
+}
+
+std::string json(snapshot const& s) {
+  std::stringstream ss;
+  ss << std::setprecision(9);
+  ss << "{";
+  for (std::size_t i = 0; i < s.counters.size(); ++i) {
+    ss << "\"" << counterDescriptions[i].name << "\":" << s.counters[i] << ",";
+  }
+  ss << "\"responses_total\":{";
+  bool first = true;
+  for (std::size_t code = 0; code < s.responses.size(); ++code) {
+    if (s.responses[code] != 0) {
+      ss << (first ? "" : ",") << "\"" << code << "\":" << s.responses[code];
+      first = false;
+    }
+  }
+  ss << "}";
+  auto handshakes = s[counter::TLS_HANDSHAKES];
+  ss << ",\"tls_resumption_rate\":"
+     << (handshakes > 0 ? double(s[counter::TLS_RESUMED_SESSIONS]) / handshakes : 0.);
+  for (std::size_t h = 0; h < s.histograms.size(); ++h) {
+    auto& values = s.histograms[h];
+    ss << ",\"" << histogramDescriptions[h].name << "\":{"
+       << "\"count\":" << values.count
+       << ",\"sum\":" << seconds(values.sum)
+       << ",\"p50\":" << seconds(values.quantile(0.5))
+       << ",\"p90\":" << seconds(values.quantile(0.9))
+       << ",\"p99\":" << seconds(values.quantile(0.99))
+       << ",\"p999\":" << seconds(values.quantile(0.999))
+       << ",\"max\":" << seconds(values.quantile(1.))
+       << "}";
+  }
+  ss << "}\n";
+  return ss.str();
+}
+
+////////////////////////////////////////////////////////////////////////////////
+
+} // namespace metrics
+
+////////////////////////////////////////////////////////////////////////////////
@@ -0,0 +1,164 @@
+////////////////////////////////////////////////////////////////////////////////
+
+#ifndef BACKEND_METRICS_HPP
+#define BACKEND_METRICS_HPP
+
+////////////////////////////////////////////////////////////////////////////////
+
+#include <atomic>
+#include <array>
+#include <string>
+#include <cstddef>
+#include <cstdint>
+
+////////////////////////////////////////////////////////////////////////////////
+
+// Counters and latency histograms of the server. Every thread updates a shard
+// of its own, with plain loads and stores instead of locked instructions, and
+// never shares a cache line with another thread. The shards are only summed
+// up when somebody asks for the numbers.
+namespace metrics {
+
+enum class counter {
+  ACCEPTED,               // connections accepted
+  ACTIVE,                 // connections open right now
+  BYTES_IN,               // payload bytes read from connections
+  BYTES_OUT,              // payload bytes written to connections
+  TLS_HANDSHAKES,         // completed, including resumed sessions
+  TLS_RESUMED_SESSIONS,
+  TLS_HANDSHAKE_FAILURES,
+  WEBSOCKET_FRAMES_IN,
+  WEBSOCKET_FRAMES_OUT,
+  TASKS,                  // scheduler tasks that did not finish yet
+  LOG_RECORDS_DROPPED,    // log records the log sink had no room for
+  COUNT
+};
+
+enum class histogram {
+  REQUEST,   // from the complete request header until the response is written
+  IO_WAIT,   // time an io_operation spends suspended
+  HANDSHAKE, // successful TLS handshakes
+  COUNT
+};
+
+// Log-linear buckets in the style of HdrHistogram. Every power of two is split
+// into 2^precision buckets, so a value is known within 1/2^precision of itself
+// across the whole range of 64 bit nanoseconds.
+struct buckets {
+  static constexpr unsigned precision = 3;
+  static constexpr std::size_t count = (64 - precision + 1) << precision;
+
+  static std::size_t index(std::uint64_t value) {
+    if (value < (1u << precision)) {
+      return value;
+    }
+    unsigned exponent = 63 - __builtin_clzll(value);
+    return ((exponent - precision + 1) << precision)
+      + ((value >> (exponent - precision)) & ((1u << precision) - 1));
+  }
+  // Smallest value of a bucket
+  static std::uint64_t lower(std::size_t index) {
+    if (index < (1u << precision)) {
+      return index;
+    }
+    auto sub = index & ((1u << precision) - 1);
+    return ((1ull << precision) + sub) << ((index >> precision) - 1);
+  }
+  // Largest value of a bucket
+  static std::uint64_t upper(std::size_t index) {
+    return index + 1 < count ? lower(index + 1) - 1 : UINT64_MAX;
+  }
+};
+
+// Status codes above that are counted as that
+constexpr int max_status = 599;
+
+// Written by one thread only. Adding is a load and a store, other threads
+// may see the store late but never a torn value.
+struct alignas(64) shard {
+  std::array<std::atomic<std::int64_t>, (std::size_t)counter::COUNT> counters{};
+  std::array<std::atomic<std::uint64_t>, max_status + 1> responses{};
+  struct distribution {
+    std::array<std::atomic<std::uint64_t>, buckets::count> counts{};
+    std::atomic<std::uint64_t> sum{0};
+  };
+  std::array<distribution, (std::size_t)histogram::COUNT> histograms;
+};
+
+// Creates the shard of the calling thread. Shards outlive their threads, what
+// they counted stays part of the totals.
+shard* attach();
+
+inline shard& local() {
+  static thread_local shard* current = attach();
+  return *current;
+}
+
+template<typename value_type>
+inline void bump(std::atomic<value_type>& v, value_type amount) {
+  v.store(v.load(std::memory_order_relaxed) + amount,
+          std::memory_order_relaxed);
+}
+
+inline void add(counter c, std::int64_t amount = 1) {
+  bump(local().counters[(std::size_t)c], amount);
+}
+
+inline void count_response(int status) {
+  bump<std::uint64_t>(local().responses[
+    status < 0 ? 0 : status > max_status ? max_status : status], 1);
+}
+
+inline void record(histogram h, std::uint64_t nanoseconds) {
+  auto& d = local().histograms[(std::size_t)h];
+  bump<std::uint64_t>(d.counts[buckets::index(nanoseconds)], 1);
+  bump(d.sum, nanoseconds);
+}
+
+// Counts one up for as long as it lives
+class scoped_gauge final {
+public:
+  explicit scoped_gauge(counter c) : mCounter(c) { add(mCounter, 1); }
+  ~scoped_gauge() { add(mCounter, -1); }
+  scoped_gauge(scoped_gauge const&) = delete;
+  scoped_gauge& operator = (scoped_gauge const&) = delete;
+private:
+  counter mCounter;
+};
+
+// Sum of all shards at some point in time
+struct snapshot {
+  struct distribution {
+    std::array<std::uint64_t, buckets::count> counts{};
+    std::uint64_t count = 0;
+    std::uint64_t sum = 0;
+    // Largest value of the bucket the q-th quantile falls into, zero if
+    // nothing was recorded
+    std::uint64_t quantile(double q) const;
+  };
+  std::array<std::int64_t, (std::size_t)counter::COUNT> counters{};
+  std::array<std::uint64_t, max_status + 1> responses{};
+  std::array<distribution, (std::size_t)histogram::COUNT> histograms;
+
+  std::int64_t operator [] (counter c) const {
+    return counters[(std::size_t)c];
+  }
+  distribution const& operator [] (histogram h) const {
+    return histograms[(std::size_t)h];
+  }
+};
+
+snapshot collect();
+
+// Prometheus text exposition format
+std::string prometheus(snapshot const& s);
+// The same as a JSON object, with quantiles instead of buckets
+std::string json(snapshot const& s);
+
+} // namespace metrics
+
+////////////////////////////////////////////////////////////////////////////////
+
+#endif // BACKEND_METRICS_HPP
+
+////////////////////////////////////////////////////////////////////////////////
@@ -1,6 +1,7 @@
 ////////////////////////////////////////////////////////////////////////////////
 
 #include "net.hpp"
+#include "metrics.hpp"
 
 #include <unistd.h>
 #include <sys/types.h>
@@ -9,29 +10,51 @@
 #include <netdb.h>
 #include <fcntl.h>
 #include <errno.h>
+#include <limits.h>
+#include <sys/uio.h>
+#if !defined(__APPLE__)
+#include <sys/sendfile.h>
+#endif
 #include <iostream>
 #include <sstream>
 #include <cassert>
+#include <algorithm>
+#include <cstring>
+#include <chrono>
 #include <string.h>
 
 #ifndef MSG_NOSIGNAL
 #define MSG_NOSIGNAL 0
 #endif
+#ifdef SO_NOSIGPIPE
 #define NET_DISABLE_SIGPIPE_ON_SOCKET
+#endif
 
 ////////////////////////////////////////////////////////////////////////////////
 
+// accept, with the client non-blocking and close-on-exec from the start where
+// accept4 exists. Saves two fcntl calls per connection.
+static int
+acceptClient(int socket, sockaddr* address, socklen_t* addressLength) {
+#if defined(__linux__)
+  return ::accept4(socket, address, addressLength, SOCK_NONBLOCK | SOCK_CLOEXEC);
+#else
+  return ::accept(socket, address, addressLength);
+#endif
+}
+#if defined(__linux__)
+#define NET_ACCEPT4
+#endif
+
 struct async_accept_impl {
-  static constexpr int events = EV_READ;
-  static constexpr decltype(::accept)* func = ::accept;
+  static constexpr decltype(acceptClient)* func = acceptClient;
   static inline bool is_ready(int result) {
     return result >= 0 || (errno != EAGAIN && errno != EWOULDBLOCK);
   }
 };
-using async_accept = event::io_operation<async_accept_impl, decltype(::accept)>;
+using async_accept = event::io_operation<async_accept_impl, decltype(acceptClient)>;
 
 struct async_read_impl {
-  static constexpr int events = EV_READ;
   static constexpr decltype(::read)* func = ::read;
   static inline bool is_ready(ssize_t result) {
     return result >= 0 || (errno != EAGAIN && errno != EWOULDBLOCK);
@@ -40,7 +63,6 @@ struct async_read_impl {
 using async_read = event::io_operation<async_read_impl, decltype(::read)>;
 
 struct async_write_impl {
-  static constexpr int events = EV_WRITE;
   static constexpr decltype(::send)* func = ::send;
   static inline bool is_ready(ssize_t result) {
     return result >= 0 || (errno != EAGAIN && errno != EWOULDBLOCK);
@@ -48,8 +70,47 @@ struct async_write_impl {
 };
 using async_write = event::io_operation<async_write_impl, decltype(::send)>;
 
+// writev that does not raise SIGPIPE
+static ssize_t
+sendVector(int socket, iovec const* buffers, int count) {
+  msghdr message = {};
+  message.msg_iov = const_cast<iovec*>(buffers);
+  message.msg_iovlen = std::min(count, IOV_MAX);
+  return ::sendmsg(socket, &message, MSG_NOSIGNAL);
+}
+
+struct async_writev_impl {
+  static constexpr decltype(sendVector)* func = sendVector;
+  static inline bool is_ready(ssize_t result) {
+    return result >= 0 || (errno != EAGAIN && errno != EWOULDBLOCK);
+  }
+};
+using async_writev = event::io_operation<async_writev_impl, decltype(sendVector)>;
+
+// Same semantics on every platform: Returns the number of bytes sent, or -1
+// with errno set. EAGAIN only if nothing could be sent.
+static ssize_t
+sendFile(int socket, int file, off_t offset, std::size_t count) {
+#if defined(__APPLE__)
+  off_t length = count;
+  if (::sendfile(file, socket, offset, &length, nullptr, 0) == 0 || length > 0) {
+    return length;
+  }
+  return -1;
+#else
+  return ::sendfile(socket, file, &offset, count);
+#endif
+}
+
+struct async_sendfile_impl {
+  static constexpr decltype(sendFile)* func = sendFile;
+  static inline bool is_ready(ssize_t result) {
+    return result >= 0 || (errno != EAGAIN && errno != EWOULDBLOCK);
+  }
+};
+using async_sendfile = event::io_operation<async_sendfile_impl, decltype(sendFile)>;
+
 struct async_tls_read_impl {
-  static constexpr int events = EV_READ;
   static constexpr decltype(::tls_read)* func = ::tls_read;
   static inline bool is_ready(ssize_t result) {
     return result >= 0 || (result != TLS_WANT_POLLIN);
@@ -57,8 +118,25 @@ struct async_tls_read_impl {
 };
 using async_tls_read = event::io_operation<async_tls_read_impl, decltype(::tls_read)>;
 
+struct async_tls_handshake_in_impl {
+  static constexpr decltype(::tls_handshake)* func = ::tls_handshake;
+  static inline bool is_ready(int result) {
+    return result != TLS_WANT_POLLIN;
+  }
+};
+using async_tls_handshake_in =
+  event::io_operation<async_tls_handshake_in_impl, decltype(::tls_handshake)>;
+
+struct async_tls_handshake_out_impl {
+  static constexpr decltype(::tls_handshake)* func = ::tls_handshake;
+  static inline bool is_ready(int result) {
+    return result != TLS_WANT_POLLOUT;
+  }
+};
+using async_tls_handshake_out =
+  event::io_operation<async_tls_handshake_out_impl, decltype(::tls_handshake)>;
+
 struct async_tls_write_impl {
-  static constexpr int events = EV_WRITE;
   static constexpr decltype(::tls_write)* func = ::tls_write;
   static inline bool is_ready(ssize_t result) {
     return result >= 0 || (result != TLS_WANT_POLLOUT);
@@ -136,7 +214,7 @@ address_options::iterator address_options::end() const {
 
 ////////////////////////////////////////////////////////////////////////////////
 
-static std::string addressToString(sockaddr* address, socklen_t addressLength) {
+static std::string addressToString(sockaddr const* address, socklen_t addressLength) {
   char hostName[256];
   char serviceName[256];
   if (getnameinfo(address, addressLength,
@@ -164,6 +242,16 @@ static bool makeNonBlocking(int socket) {
   return true;
 }
 
+#ifndef NET_ACCEPT4
+static bool makeCloseOnExec(int socket) {
+  int opts = fcntl(socket, F_GETFD);
+  if (opts < 0) {
+    return false;
+  }
+  return fcntl(socket, F_SETFD, opts | FD_CLOEXEC) == 0;
+}
+#endif
+
 #ifdef NET_DISABLE_SIGPIPE_ON_SOCKET
 static bool disableSIGPIPE(int socket) {
   int on = 1;
@@ -175,6 +263,40 @@ static bool disableSIGPIPE(int socket) {
 }
 #endif
 
+// Whether a listener is bound to every address of the host
+static bool isWildcard(net::address const& address) {
+  switch (address.storage.ss_family) {
+  case AF_INET:
+    return reinterpret_cast<sockaddr_in const*>(&address.storage)
+      ->sin_addr.s_addr == htonl(INADDR_ANY);
+  case AF_INET6:
+    return IN6_IS_ADDR_UNSPECIFIED(
+      &reinterpret_cast<sockaddr_in6 const*>(&address.storage)->sin6_addr);
+  default:
+    return false;
+  }
+}
+
+// Whatever accept4 could not do already. Closes the client on failure.
+static int prepareClient(int client) {
+  if (client < 0) {
+    return -1;
+  }
+#ifndef NET_ACCEPT4
+  if (!makeNonBlocking(client) || !makeCloseOnExec(client)) {
+    ::close(client);
+    return -1;
+  }
+#endif
+#ifdef NET_DISABLE_SIGPIPE_ON_SOCKET
+  if (!disableSIGPIPE(client)) {
+    ::close(client);
+    return -1;
+  }
+#endif
+  return client;
+}
+
 ////////////////////////////////////////////////////////////////////////////////
 
 socket::socket()
@@ -183,7 +305,7 @@ socket::socket()
 socket::socket(int fd)
   : mSocket(fd < 0 ? -1 : fd) {}
 
-socket::socket(address_info const& info, int maxQueue)
+socket::socket(address_info const& info, int maxQueue, bool reusePort)
   : mSocket(-1) {
   mSocket = ::socket(info.ai_family, info.ai_socktype, 0);
   if (mSocket < 0) {
@@ -199,6 +321,11 @@ socket::socket(address_info const& info, int maxQueue)
     close();
     throw std::runtime_error("error: setsockopt(SO_REUSEADDR) failed");
   }
+  if (reusePort &&
+      setsockopt(mSocket, SOL_SOCKET, SO_REUSEPORT, (char *)&on, sizeof(on))) {
+    close();
+    throw std::runtime_error("error: setsockopt(SO_REUSEPORT) failed");
+  }
   if (::bind(mSocket, info.ai_addr, info.ai_addrlen)) {
     close();
     throw std::runtime_error("error: bind() failed");
@@ -208,10 +335,19 @@ socket::socket(address_info const& info, int maxQueue)
     close();
     throw std::runtime_error("error: listen() failed");
   }
+  mLocal.length = sizeof(mLocal.storage);
+  if (getsockname(mSocket, reinterpret_cast<sockaddr*>(&mLocal.storage),
+                  &mLocal.length) != 0) {
+    mLocal.length = 0;
+  }
 }
 
 socket::socket(socket&& other)
-  : mSocket(other.mSocket) {
+  : mSocket(other.mSocket)
+  , mLocal(other.mLocal)
+  , mRemote(other.mRemote)
+  , mReader(std::move(other.mReader))
+  , mWriter(std::move(other.mWriter)) {
   other.mSocket = -1;
 }
 
@@ -223,6 +359,10 @@ socket::~socket() {
 socket& socket::operator = (socket&& nbs) {
   close();
   std::swap(mSocket, nbs.mSocket);
+  std::swap(mLocal, nbs.mLocal);
+  std::swap(mRemote, nbs.mRemote);
+  mReader = std::move(nbs.mReader);
+  mWriter = std::move(nbs.mWriter);
   return *this;
 }
 
@@ -231,6 +371,9 @@ socket::operator bool() const {
 }
 
 void socket::close() {
+  // libev requires watchers to be stopped before their fd is closed
+  mReader.disarm();
+  mWriter.disarm();
   if (mSocket >= 0) {
     ::close(mSocket);
   }
@@ -239,34 +382,53 @@ void socket::close() {
 
 coro::task<socket>
 socket::async_accept(event::scheduler& s) {
-  sockaddr_storage clientAddress;
-  socklen_t clientAddressLength = sizeof(clientAddress);
+  address remote;
+  remote.length = sizeof(remote.storage);
   int client;
   do {
-    client = co_await ::async_accept(s, mSocket, mSocket,
-                                     (sockaddr*)&clientAddress,
-                                     &clientAddressLength);
+    client = co_await ::async_accept(reader(s), mSocket,
+                                     (sockaddr*)&remote.storage,
+                                     &remote.length);
   } while (client == -1 && errno == EINTR);
-  if (client == -1) {
-    co_return socket();
-  }
-  if (!makeNonBlocking(client)) {
-    ::close(client);
-    co_return socket();
-  }
-#ifdef NET_DISABLE_SIGPIPE_ON_SOCKET
-  if (!disableSIGPIPE(client)) {
-    ::close(client);
-    co_return socket();
+  co_return accepted(prepareClient(client), remote);
+}
+
+socket
+socket::accept() {
+  address remote;
+  remote.length = sizeof(remote.storage);
+  int client;
+  do {
+    client = acceptClient(mSocket, (sockaddr*)&remote.storage,
+                          &remote.length);
+  } while (client == -1 && errno == EINTR);
+  return accepted(prepareClient(client), remote);
+}
+
+socket
+socket::accepted(int client, address const& remote) const {
+  socket result(client);
+  if (result) {
+    result.mRemote = remote;
+    if (!isWildcard(mLocal)) {
+      result.mLocal = mLocal;
+      return result;
+    }
+    // Clients of a wildcard listener may have come in on any address
+    result.mLocal.length = sizeof(result.mLocal.storage);
+    if (getsockname(client, reinterpret_cast<sockaddr*>(&result.mLocal.storage),
+                    &result.mLocal.length) != 0) {
+      result.mLocal.length = 0;
+    }
   }
-#endif
-  co_return socket(client);
+  return result;
 }
 
 coro::task<std::size_t>
 socket::async_read(event::scheduler& s, void* buffer, size_t count) {
-  auto result = co_await ::async_read(s, mSocket, mSocket, buffer, count);
+  auto result = co_await ::async_read(reader(s), mSocket, buffer, count);
   if (result >= 0) {
+    metrics::add(metrics::counter::BYTES_IN, result);
     co_return result;
   }
   auto error_msg = ::strerror(errno);
@@ -281,8 +443,9 @@ socket::async_read(event::scheduler& s, void* buffer, size_t count) {
 
 coro::task<std::size_t>
 socket::async_write(event::scheduler& s, void const* buffer, size_t count) {
-  auto result = co_await ::async_write(s, mSocket, mSocket, buffer, count, MSG_NOSIGNAL);
+  auto result = co_await ::async_write(writer(s), mSocket, buffer, count, MSG_NOSIGNAL);
   if (result >= 0) {
+    metrics::add(metrics::counter::BYTES_OUT, result);
     co_return result;
   }
   auto error_msg = ::strerror(errno);
@@ -295,6 +458,47 @@ socket::async_write(event::scheduler& s, void const* buffer, size_t count) {
   co_return 0;
 }
 
+coro::task<std::size_t>
+socket::async_writev(event::scheduler& s, iovec const* buffers, int count) {
+  auto result = co_await ::async_writev(writer(s), mSocket, buffers, count);
+  if (result >= 0) {
+    metrics::add(metrics::counter::BYTES_OUT, result);
+    co_return result;
+  }
+  auto error_msg = ::strerror(errno);
+  std::stringstream ss;
+  ss << "error: writev failed with result " << result;
+  if (error_msg != nullptr) {
+    ss << std::endl << "note: \"" << error_msg << "\"";
+  }
+  throw std::runtime_error(ss.str());
+  co_return 0;
+}
+
+coro::task<std::size_t>
+socket::async_sendfile(event::scheduler& s, int file, std::size_t offset,
+                       std::size_t count) {
+  auto result = co_await ::async_sendfile(writer(s), mSocket, file,
+                                          offset, count);
+  if (result > 0) {
+    metrics::add(metrics::counter::BYTES_OUT, result);
+    co_return result;
+  }
+  std::stringstream ss;
+  if (result == 0) {
+    // A socket does not report a closed connection this way
+    ss << "error: sendfile hit the end of the file at offset " << offset;
+    throw std::runtime_error(ss.str());
+  }
+  auto error_msg = ::strerror(errno);
+  ss << "error: sendfile failed with result " << result;
+  if (error_msg != nullptr) {
+    ss << std::endl << "note: \"" << error_msg << "\"";
+  }
+  throw std::runtime_error(ss.str());
+  co_return 0;
+}
+
 std::string socket::local_name() const {
   std::string local = "<void>";
   sockaddr_storage address;
@@ -327,33 +531,115 @@ tls_socket::tls_socket(socket&& other, crypto::context&& tls)
   : socket(std::move(other)), mTls(std::move(tls)) {}
 
 tls_socket::tls_socket(address_info const& info, int maxQueue,
-                       crypto::config const& tlsConfig)
-  : socket(info, maxQueue), mTls(tlsConfig) {}
+                       crypto::config const& tlsConfig,
+                       std::size_t maxHandshakes, bool reusePort)
+  : socket(info, maxQueue, reusePort), mTls(tlsConfig)
+  , mHandshakes(std::make_shared<event::limiter>(maxHandshakes)) {}
 
 tls_socket::tls_socket(tls_socket&& other)
   : socket(std::move(other))
-  , mTls(std::move(other.mTls)) {}
+  , mTls(std::move(other.mTls))
+  , mHandshakes(std::move(other.mHandshakes))
+  , mHandshaking(std::exchange(other.mHandshaking, false)) {}
+
+tls_socket::~tls_socket() {
+  finishHandshake();
+}
 
 tls_socket&
 tls_socket::operator = (tls_socket&& other) {
   if (std::addressof(other) != this) {
     socket::operator = (std::move(other));
     std::swap(mTls, other.mTls);
+    std::swap(mHandshakes, other.mHandshakes);
+    std::swap(mHandshaking, other.mHandshaking);
   }
   return *this;
 }
 
 coro::task<tls_socket>
 tls_socket::async_accept(event::scheduler& s) {
-  auto client = co_await socket::async_accept(s);
+  co_await mHandshakes->wait(s);
+  co_return secure(co_await socket::async_accept(s));
+}
+
+tls_socket
+tls_socket::accept() {
+  if (!mHandshakes->available()) {
+    return tls_socket(socket(), crypto::context());
+  }
+  return secure(socket::accept());
+}
+
+tls_socket
+tls_socket::secure(socket&& client) {
+  if (!client) {
+    return tls_socket(std::move(client), crypto::context());
+  }
   auto context = mTls.accept(client.fd());
-  co_return tls_socket(std::move(client), std::move(context));
+  tls_socket secured(std::move(client), std::move(context));
+  mHandshakes->acquire();
+  secured.mHandshakes = mHandshakes;
+  secured.mHandshaking = true;
+  return secured;
+}
+
+coro::task<void>
+tls_socket::async_handshake(event::scheduler& s, ev_tstamp timeout) {
+  auto start = std::chrono::steady_clock::now();
+  try {
+    co_await event::with_timeout(s, handshake(s), timeout);
+  } catch (std::runtime_error&) {
+    finishHandshake();
+    metrics::add(metrics::counter::TLS_HANDSHAKE_FAILURES);
+    throw;
+  }
+  finishHandshake();
+  metrics::record(metrics::histogram::HANDSHAKE,
+                  std::chrono::duration_cast<std::chrono::nanoseconds>(
+                    std::chrono::steady_clock::now() - start).count());
+  metrics::add(metrics::counter::TLS_HANDSHAKES);
+  if (tls_conn_session_resumed(mTls.get_context()) == 1) {
+    metrics::add(metrics::counter::TLS_RESUMED_SESSIONS);
+  }
+}
+
+coro::task<void>
+tls_socket::handshake(event::scheduler& s) {
+  // Whichever way libtls wants to go next
+  int result = TLS_WANT_POLLIN;
+  while (result == TLS_WANT_POLLIN || result == TLS_WANT_POLLOUT) {
+    if (result == TLS_WANT_POLLIN) {
+      result = co_await async_tls_handshake_in(reader(s), mTls.get_context());
+    } else {
+      result = co_await async_tls_handshake_out(writer(s), mTls.get_context());
+    }
+  }
+  if (result == 0) {
+    co_return;
+  }
+  auto error_msg = tls_error(mTls.get_context());
+  std::stringstream ss;
+  ss << "error: tls_handshake failed with result " << result;
+  if (error_msg != nullptr) {
+    ss << std::endl << "note: \"" << error_msg << "\"";
+  }
+  throw std::runtime_error(ss.str());
+}
+
+void
+tls_socket::finishHandshake() noexcept {
+  if (mHandshaking) {
+    mHandshaking = false;
+    mHandshakes->release();
+  }
 }
 
 coro::task<std::size_t>
 tls_socket::async_read(event::scheduler& s, char* buffer, std::size_t count) {
-  auto result = co_await async_tls_read(s, fd(), mTls.get_context(), buffer, count);
+  auto result = co_await async_tls_read(reader(s), mTls.get_context(), buffer, count);
   if (result >= 0) {
+    metrics::add(metrics::counter::BYTES_IN, result);
     co_return result;
   }
   auto error_msg = tls_error(mTls.get_context());
@@ -368,8 +654,9 @@ tls_socket::async_read(event::scheduler& s, char* buffer, std::size_t count) {
 
 coro::task<std::size_t>
 tls_socket::async_write(event::scheduler& s, char const* buffer, std::size_t count) {
-  auto result = co_await async_tls_write(s, fd(), mTls.get_context(), buffer, count);
+  auto result = co_await async_tls_write(writer(s), mTls.get_context(), buffer, count);
   if (result >= 0) {
+    metrics::add(metrics::counter::BYTES_OUT, result);
     co_return result;
   }
   auto error_msg = tls_error(mTls.get_context());
@@ -382,6 +669,31 @@ tls_socket::async_write(event::scheduler& s, char const* buffer, std::size_t cou
   co_return 0;
 }
 
+coro::task<std::size_t>
+tls_socket::async_writev(event::scheduler& s, iovec const* buffers, int count) {
+  // libtls has no gather write. Everything is copied into a TLS record anyway,
+  // so small buffers are merged here instead of becoming records of their own.
+  int i = 0;
+  while (i < count && buffers[i].iov_len == 0) {
+    ++i;
+  }
+  if (i == count) {
+    co_return 0;
+  }
+  if (buffers[i].iov_len >= tls_record_size) {
+    co_return co_await async_write(s, (char const*)buffers[i].iov_base,
+                                   buffers[i].iov_len);
+  }
+  char record[tls_record_size];
+  std::size_t size = 0;
+  for (; i < count && size < tls_record_size; ++i) {
+    auto bytes = std::min(buffers[i].iov_len, tls_record_size - size);
+    std::memcpy(record + size, buffers[i].iov_base, bytes);
+    size += bytes;
+  }
+  co_return co_await async_write(s, record, size);
+}
+
 ////////////////////////////////////////////////////////////////////////////////
 
 } // namespace net
@@ -393,6 +705,15 @@ std::ostream& operator << (std::ostream& stream, net::address_info const& info)
   return stream;
 }
 
+std::ostream& operator << (std::ostream& stream, net::address const& address) {
+  if (address.length == 0) {
+    return stream << "<void>";
+  }
+  stream << net::addressToString(
+    reinterpret_cast<sockaddr const*>(&address.storage), address.length);
+  return stream;
+}
+
 std::ostream& operator << (std::ostream& stream, net::socket const& socket) {
   stream << socket.local_name() << " <-> " << socket.remote_name();
   return stream;
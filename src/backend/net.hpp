@@ -8,10 +8,13 @@
 #include "event.hpp"
 #include "tls.hpp"
 #include <iostream>
+#include <memory>
+#include <sys/socket.h>
 
 ////////////////////////////////////////////////////////////////////////////////
 
 struct addrinfo;
+struct iovec;
 
 ////////////////////////////////////////////////////////////////////////////////
 
@@ -32,6 +35,12 @@ enum socket_type {
 
 using address_info = addrinfo;
 
+// A socket address as the kernel reported it. Only formatted when printed.
+struct address {
+  sockaddr_storage storage;
+  socklen_t length = 0;
+};
+
 ////////////////////////////////////////////////////////////////////////////////
 
 class address_options {
@@ -71,7 +80,7 @@ public:
 class socket {
 public:
   socket();
-  socket(address_info const& info, int maxQueue);
+  socket(address_info const& info, int maxQueue, bool reusePort = false);
   socket(socket&& nbs);
   socket(socket const&) = delete;
   socket& operator = (socket&& nbs);
@@ -82,45 +91,108 @@ public:
   void close();
   int fd() const { return mSocket; }
 
+  // Waits for a client to connect. The client is non-blocking, and invalid
+  // if accepting it failed.
   coro::task<socket>
   async_accept(event::scheduler& s);
+  // Takes a pending client without waiting. Invalid if there is none.
+  socket accept();
   coro::task<std::size_t>
   async_read(event::scheduler& s, void* buffer, size_t count);
   coro::task<std::size_t>
   async_write(event::scheduler& s, void const* buffer, size_t count);
+  // Gathers the buffers into a single send. Returns the number of bytes sent,
+  // which may end in the middle of any buffer.
+  coro::task<std::size_t>
+  async_writev(event::scheduler& s, iovec const* buffers, int count);
+  // Sends up to count bytes of file, starting at offset, without copying
+  // them through user space.
+  coro::task<std::size_t>
+  async_sendfile(event::scheduler& s, int file, std::size_t offset,
+                 std::size_t count);
 
   std::string local_name() const;
   std::string remote_name() const;
+  // Same addresses without a system call. Clients remember the address of
+  // the listener that accepted them, and the peer address accept reported.
+  address const& local_address() const { return mLocal; }
+  address const& remote_address() const { return mRemote; }
 
 protected:
   socket(int fd);
+  // A client this listener accepted
+  socket accepted(int client, address const& remote) const;
+
+  event::io_watcher& reader(event::scheduler& s) {
+    mReader.bind(s.loop(), mSocket);
+    return mReader;
+  }
+  event::io_watcher& writer(event::scheduler& s) {
+    mWriter.bind(s.loop(), mSocket);
+    return mWriter;
+  }
 
 private:
   int mSocket;
+  address mLocal;
+  address mRemote;
+  event::io_watcher mReader{EV_READ};
+  event::io_watcher mWriter{EV_WRITE};
 }; // socket
 
 class tls_socket final : public socket {
 public:
+  // Maximum plaintext per TLS record
+  static constexpr std::size_t tls_record_size = 16 * 1024;
+
+  // Listens, with at most maxHandshakes clients between accept and the end
+  // of their handshake
   tls_socket(address_info const& info, int maxQueue,
-             crypto::config const& tlsConfig);
+             crypto::config const& tlsConfig, std::size_t maxHandshakes,
+             bool reusePort = false);
   tls_socket(tls_socket&& nbs);
   tls_socket(tls_socket const&) = delete;
   tls_socket& operator = (tls_socket&& nbs);
   tls_socket& operator = (tls_socket const&) = delete;
-  ~tls_socket() = default;
+  ~tls_socket();
 
+  // Waits until a handshake may start before it waits for a client. Clients
+  // beyond the limit queue up in the backlog, and the loop serves the
+  // established connections instead of more handshakes.
   coro::task<tls_socket>
   async_accept(event::scheduler& s);
+  // Also returns an invalid socket while the handshakes are at their limit
+  tls_socket accept();
+  // Handshakes with an accepted client. Throws if it fails, or with an
+  // event::timeout if it takes longer than timeout seconds.
+  coro::task<void>
+  async_handshake(event::scheduler& s, ev_tstamp timeout);
   coro::task<std::size_t>
   async_read(event::scheduler& s, char* buffer, std::size_t count);
   coro::task<std::size_t>
   async_write(event::scheduler& s, char const* buffer, std::size_t count);
+  // Gathers the buffers into one TLS record, at most tls_record_size bytes.
+  coro::task<std::size_t>
+  async_writev(event::scheduler& s, iovec const* buffers, int count);
+  // Would bypass the encryption
+  coro::task<std::size_t>
+  async_sendfile(event::scheduler& s, int file, std::size_t offset,
+                 std::size_t count) = delete;
 
 private:
   tls_socket(socket&& other, crypto::context&& tls);
+  // Sets up the TLS context of an accepted client
+  tls_socket secure(socket&& client);
+  coro::task<void>
+  handshake(event::scheduler& s);
+  // Gives back the listener's handshake slot, if still held
+  void finishHandshake() noexcept;
 
 private:
   crypto::context mTls;
+  // Handshakes in progress on the clients of a listener
+  std::shared_ptr<event::limiter> mHandshakes;
+  bool mHandshaking = false;
 }; // tls_socket
 
 ////////////////////////////////////////////////////////////////////////////////
@@ -130,6 +202,7 @@ private:
 ////////////////////////////////////////////////////////////////////////////////
 
 std::ostream& operator << (std::ostream& stream, net::address_info const& info);
+std::ostream& operator << (std::ostream& stream, net::address const& address);
 std::ostream& operator << (std::ostream& stream, net::socket const& socket);
 std::ostream& operator << (std::ostream& stream, net::tls_socket const& socket);
 
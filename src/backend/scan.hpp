@@ -0,0 +1,213 @@
+////////////////////////////////////////////////////////////////////////////////
+
+#ifndef BACKEND_SCAN_HPP
+#define BACKEND_SCAN_HPP
+
+////////////////////////////////////////////////////////////////////////////////
+
+#include <string_view>
+#include <cstddef>
+#include <cstdint>
+#if defined(__AVX2__) || defined(__SSE2__)
+#include <immintrin.h>
+#elif defined(__ARM_NEON)
+#include <arm_neon.h>
+#endif
+
+////////////////////////////////////////////////////////////////////////////////
+
+// Character classes of RFC 7230, checked for whole blocks of a buffer at once
+namespace scan {
+
+inline constexpr bool
+isVCHAR(char c) {
+  return (c >= 0x20 && c < 0x7f) || c == 0x09;
+}
+
+inline constexpr bool
+isDIGIT(char c) {
+  return c >= '0' && c <= '9';
+}
+
+inline constexpr bool
+isALPHA(char c) {
+  return (c >= 'A' && c <= 'Z') || (c >= 'a' && c <= 'z');
+}
+
+inline constexpr bool
+isTCHAR(char c) {
+  return isALPHA(c) || isDIGIT(c)
+    || c == '!' || c == '#' || c == '$' || c == '%' || c == '&'
+    || c == '\'' || c == '*' || c == '+' || c == '-' || c == '.'
+    || c == '^' || c == '_' || c == '`' || c == '|' || c == '~';
+}
+
+namespace scalar {
+
+// Number of leading characters of str in the class
+template<bool (*valid)(char)>
+inline std::size_t
+prefix(std::string_view str) {
+  std::size_t i = 0;
+  while (i < str.size() && valid(str[i])) {
+    ++i;
+  }
+  return i;
+}
+
+inline std::size_t
+vcharPrefix(std::string_view str) {
+  return prefix<isVCHAR>(str);
+}
+
+inline std::size_t
+tcharPrefix(std::string_view str) {
+  return prefix<isTCHAR>(str);
+}
+
+} // scalar
+
+// One vector register worth of bytes. Comparisons yield all ones in the
+// lanes where they hold.
+#if defined(__AVX2__)
+constexpr char const* implementation = "avx2";
+struct block {
+  static constexpr std::size_t size = 32;
+  __m256i v;
+
+  static block load(char const* p) {
+    return { _mm256_loadu_si256(reinterpret_cast<__m256i const*>(p)) };
+  }
+  block is(char c) const {
+    return { _mm256_cmpeq_epi8(v, _mm256_set1_epi8(c)) };
+  }
+  // Only for ASCII bounds, bytes above 0x7f compare as negative
+  block within(char first, char last) const {
+    return { _mm256_and_si256(_mm256_cmpgt_epi8(v, _mm256_set1_epi8(first - 1)),
+                              _mm256_cmpgt_epi8(_mm256_set1_epi8(last + 1), v)) };
+  }
+  block operator | (block other) const {
+    return { _mm256_or_si256(v, other.v) };
+  }
+  block without(block other) const {
+    return { _mm256_andnot_si256(other.v, v) };
+  }
+  // Index of the first lane that does not hold, or size
+  std::size_t firstFalse() const {
+    auto mask = ~static_cast<std::uint32_t>(_mm256_movemask_epi8(v));
+    return mask == 0 ? size : __builtin_ctz(mask);
+  }
+};
+#elif defined(__SSE2__)
+constexpr char const* implementation = "sse2";
+struct block {
+  static constexpr std::size_t size = 16;
+  __m128i v;
+
+  static block load(char const* p) {
+    return { _mm_loadu_si128(reinterpret_cast<__m128i const*>(p)) };
+  }
+  block is(char c) const {
+    return { _mm_cmpeq_epi8(v, _mm_set1_epi8(c)) };
+  }
+  // Only for ASCII bounds, bytes above 0x7f compare as negative
+  block within(char first, char last) const {
+    return { _mm_and_si128(_mm_cmpgt_epi8(v, _mm_set1_epi8(first - 1)),
+                           _mm_cmplt_epi8(v, _mm_set1_epi8(last + 1))) };
+  }
+  block operator | (block other) const {
+    return { _mm_or_si128(v, other.v) };
+  }
+  block without(block other) const {
+    return { _mm_andnot_si128(other.v, v) };
+  }
+  // Index of the first lane that does not hold, or size
+  std::size_t firstFalse() const {
+    auto mask = ~static_cast<std::uint32_t>(_mm_movemask_epi8(v)) & 0xffffu;
+    return mask == 0 ? size : __builtin_ctz(mask);
+  }
+};
+#elif defined(__ARM_NEON)
+constexpr char const* implementation = "neon";
+struct block {
+  static constexpr std::size_t size = 16;
+  uint8x16_t v;
+
+  static block load(char const* p) {
+    return { vld1q_u8(reinterpret_cast<std::uint8_t const*>(p)) };
+  }
+  block is(char c) const {
+    return { vceqq_u8(v, vdupq_n_u8(static_cast<std::uint8_t>(c))) };
+  }
+  block within(char first, char last) const {
+    return { vandq_u8(vcgeq_u8(v, vdupq_n_u8(static_cast<std::uint8_t>(first))),
+                      vcleq_u8(v, vdupq_n_u8(static_cast<std::uint8_t>(last)))) };
+  }
+  block operator | (block other) const {
+    return { vorrq_u8(v, other.v) };
+  }
+  block without(block other) const {
+    return { vbicq_u8(v, other.v) };
+  }
+  // Index of the first lane that does not hold, or size. Narrows every lane
+  // to four bits, NEON has no movemask.
+  std::size_t firstFalse() const {
+    auto narrowed = vshrn_n_u16(vreinterpretq_u16_u8(vmvnq_u8(v)), 4);
+    auto mask = vget_lane_u64(vreinterpret_u64_u8(narrowed), 0);
+    return mask == 0 ? size : __builtin_ctzll(mask) / 4;
+  }
+};
+#else
+constexpr char const* implementation = "scalar";
+#endif
+
+#if defined(__AVX2__) || defined(__SSE2__) || defined(__ARM_NEON)
+inline block
+vchars(block b) {
+  return b.within(0x20, 0x7e) | b.is('\t');
+}
+
+// Visible characters except the delimiters "(),/:;<=>?@[\]{}
+inline block
+tchars(block b) {
+  auto delimiters = b.is('"') | b.within('(', ')') | b.is(',') | b.is('/')
+    | b.within(':', '@') | b.within('[', ']') | b.is('{') | b.is('}');
+  return b.within(0x21, 0x7e).without(delimiters);
+}
+
+template<block (*valid)(block), bool (*scalarValid)(char)>
+inline std::size_t
+prefix(std::string_view str) {
+  std::size_t i = 0;
+  for (; i + block::size <= str.size(); i += block::size) {
+    auto first = valid(block::load(str.data() + i)).firstFalse();
+    if (first < block::size) {
+      return i + first;
+    }
+  }
+  return i + scalar::prefix<scalarValid>(str.substr(i));
+}
+
+// Number of leading field content characters, VCHAR and whitespace
+inline std::size_t
+vcharPrefix(std::string_view str) {
+  return prefix<vchars, isVCHAR>(str);
+}
+
+// Number of leading token characters
+inline std::size_t
+tcharPrefix(std::string_view str) {
+  return prefix<tchars, isTCHAR>(str);
+}
+#else
+using scalar::vcharPrefix;
+using scalar::tcharPrefix;
+#endif
+
+} // scan
+
+////////////////////////////////////////////////////////////////////////////////
+
+#endif // BACKEND_SCAN_HPP
+
+////////////////////////////////////////////////////////////////////////////////
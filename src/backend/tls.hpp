@@ -8,11 +8,34 @@
 #include <tls.h>
 #include <string>
 #include <iostream>
+#include <array>
+#include <map>
+#include <mutex>
+#include <optional>
+#include <utility>
+#include <algorithm>
+#include <stdexcept>
+#include <cstdint>
+#include <ctime>
+#include <unistd.h>
+#include <sys/random.h>
 
 ////////////////////////////////////////////////////////////////////////////////
 
 namespace crypto {
 
+// Fills out with bytes from the kernel's random number generator
+inline void random_bytes(unsigned char* out, std::size_t size) {
+  // getentropy hands out at most 256 bytes per call
+  for (std::size_t done = 0; done < size; done += 256) {
+    if (::getentropy(out + done, std::min<std::size_t>(size - done, 256))) {
+      throw std::runtime_error("TLS: getentropy failed");
+    }
+  }
+}
+
+using ticket_key = std::array<unsigned char, TLS_TICKET_KEY_SIZE>;
+
 class config final {
 public:
   config(std::string const& certFile,
@@ -33,13 +56,110 @@ public:
   ~config() {
     ::tls_config_free(mConfig);
   }
+  config(config const&) = delete;
+  config& operator = (config const&) = delete;
 
   auto configure(tls* context) const {
     return ::tls_configure(context, mConfig);
   }
 
+  // Lets clients resume sessions for lifetime seconds, by session ID or by
+  // session ticket. The ID tells sessions of this server from those of
+  // others. Affects contexts configured afterwards.
+  void set_sessions(unsigned char const* id, std::size_t size, int lifetime) {
+    if (::tls_config_set_session_id(mConfig, id, size)) {
+      fail("tls_config_set_session_id");
+    }
+    if (::tls_config_set_session_lifetime(mConfig, lifetime)) {
+      fail("tls_config_set_session_lifetime");
+    }
+  }
+  // Encrypts new session tickets with key from now on. Tickets encrypted
+  // with the keys added before are still accepted, up to the session
+  // lifetime. Revisions have to increase. Affects configured contexts.
+  void add_ticket_key(std::uint32_t revision, ticket_key key) {
+    if (::tls_config_add_ticket_key(mConfig, revision, key.data(), key.size())) {
+      fail("tls_config_add_ticket_key");
+    }
+    mTicketRevision = revision;
+  }
+  std::optional<std::uint32_t> ticket_revision() const {
+    return mTicketRevision;
+  }
+
 private:
+  [[noreturn]] void fail(char const* function) const {
+    auto error = ::tls_config_error(mConfig);
+    throw std::runtime_error(std::string("TLSConfig: ") + function + " failed"
+                             + (error != nullptr ? std::string(": ") + error : ""));
+  }
+
   tls_config* mConfig;
+  std::optional<std::uint32_t> mTicketRevision;
+};
+
+// Session resumption state shared by all configs of a server. A returning
+// client may reach any shard, so all of them have to encrypt tickets with the
+// same keys. Keys belong to rotation periods and are created by whoever asks
+// for a period first. Thread-safe.
+class sessions final {
+public:
+  // Tickets are valid for lifetime seconds
+  explicit sessions(int lifetime)
+    : mLifetime(lifetime) {
+    random_bytes(mId.data(), mId.size());
+  }
+  sessions(sessions const&) = delete;
+  sessions& operator = (sessions const&) = delete;
+
+  int lifetime() const {
+    return mLifetime;
+  }
+  // libtls keeps the last four keys. Rotating every half lifetime keeps
+  // every ticket decryptable for as long as it is valid.
+  int rotation_interval() const {
+    return std::max(1, mLifetime / 2);
+  }
+  // Seconds from now until the next key is due
+  int next_rotation(std::time_t now) const {
+    return rotation_interval() - now % rotation_interval();
+  }
+  // The key of the rotation period now falls into, and its revision
+  std::pair<std::uint32_t, ticket_key> key(std::time_t now) {
+    auto revision = static_cast<std::uint32_t>(now / rotation_interval());
+    std::lock_guard<std::mutex> lock(mMutex);
+    auto it = mKeys.find(revision);
+    if (it == mKeys.end()) {
+      it = mKeys.emplace(revision, ticket_key()).first;
+      random_bytes(it->second.data(), it->second.size());
+      // Configs only ever ask for the current period, or a late one for the
+      // previous period
+      while (mKeys.size() > 2) {
+        auto& oldest = mKeys.begin()->second;
+        std::fill(oldest.begin(), oldest.end(), 0);
+        mKeys.erase(mKeys.begin());
+      }
+    }
+    return *it;
+  }
+  // Turns on sessions for c and gives it the current key
+  void configure(config& c, std::time_t now) {
+    c.set_sessions(mId.data(), mId.size(), mLifetime);
+    rotate(c, now);
+  }
+  // Gives c the key of the current period, unless it has it already
+  void rotate(config& c, std::time_t now) {
+    auto [revision, key] = this->key(now);
+    if (!c.ticket_revision() || *c.ticket_revision() < revision) {
+      c.add_ticket_key(revision, key);
+    }
+  }
+
+private:
+  std::array<unsigned char, TLS_MAX_SESSION_ID_LENGTH> mId;
+  int mLifetime;
+  std::mutex mMutex;
+  std::map<std::uint32_t, ticket_key> mKeys;
 };
 
 class context final {
@@ -3,6 +3,8 @@
 #include "../com.hpp"
 #include <gtest/gtest.h>
 #include <algorithm>
+#include <deque>
+#include <vector>
 
 ////////////////////////////////////////////////////////////////////////////////
 
@@ -238,3 +240,295 @@ TEST(com, async_write_close) {
 }
 
 ////////////////////////////////////////////////////////////////////////////////
+
+namespace {
+// Serves one queued chunk (or as much of it as fits) per read, like a socket
+// that has exactly that much data pending.
+struct ChunkSocket {
+  coro::task<std::size_t>
+  async_read(TestCtx&, char* buffer, std::size_t count) {
+    _reads++;
+    if (_chunks.empty()) {
+      co_return 0;
+    }
+    auto& chunk = _chunks.front();
+    auto bytes = std::min(count, chunk.size());
+    std::copy(chunk.begin(), chunk.begin() + bytes, buffer);
+    chunk.erase(0, bytes);
+    if (chunk.empty()) {
+      _chunks.pop_front();
+    }
+    co_return bytes;
+  }
+  coro::task<std::size_t>
+  async_write(TestCtx&, char const*, std::size_t count) {
+    co_return count;
+  }
+  std::deque<std::string> _chunks;
+  std::size_t _reads = 0;
+};
+
+using chunk_channel = com::channel<TestCtx, ChunkSocket>;
+
+coro::sync_task<void>
+pullOneByOne(chunk_channel& channel, std::string& out) {
+  for co_await (auto c : channel.async_char_stream()) {
+    out += c;
+  }
+}
+
+coro::sync_task<bool>
+pullBuffer(chunk_channel& channel, std::size_t n, std::string& out) {
+  out.resize(n);
+  co_return co_await channel.async_read(out.data(), n);
+}
+
+coro::sync_task<std::size_t>
+fill(chunk_channel& channel) {
+  co_return co_await channel.async_fill();
+}
+}
+
+TEST(com, buffered_char_stream) {
+  TestCtx ctx;
+  ChunkSocket socket;
+  socket._chunks = { "hello", ", world" };
+  chunk_channel c(ctx, socket, 64);
+  EXPECT_TRUE(c.buffered());
+
+  std::string str;
+  auto task = pullOneByOne(c, str);
+  task.start();
+  EXPECT_TRUE(task.done());
+  EXPECT_EQ(str, "hello, world");
+  EXPECT_EQ(socket._reads, 3ull); // two chunks and the close
+}
+
+TEST(com, buffered_peek_consume) {
+  TestCtx ctx;
+  ChunkSocket socket;
+  socket._chunks = { "GET / HTTP/1.1\r\n", "\r\n" };
+  chunk_channel c(ctx, socket, 64);
+  EXPECT_EQ(c.peek(), "");
+
+  auto f0 = fill(c);
+  f0.start();
+  EXPECT_EQ(f0.result(), 16ull);
+  EXPECT_EQ(c.peek(), "GET / HTTP/1.1\r\n");
+  c.consume(4);
+  EXPECT_EQ(c.peek(), "/ HTTP/1.1\r\n");
+
+  auto f1 = fill(c);
+  f1.start();
+  EXPECT_EQ(f1.result(), 2ull);
+  EXPECT_EQ(c.peek(), "/ HTTP/1.1\r\n\r\n");
+  c.consume(c.peek().size());
+  EXPECT_EQ(c.peek(), "");
+
+  auto f2 = fill(c);
+  f2.start();
+  EXPECT_EQ(f2.result(), 0ull);
+  EXPECT_EQ(socket._reads, 3ull);
+}
+
+TEST(com, buffered_fill_compacts) {
+  TestCtx ctx;
+  ChunkSocket socket;
+  socket._chunks = { "0123456789", "abcdef" };
+  chunk_channel c(ctx, socket, 10);
+
+  auto f0 = fill(c);
+  f0.start();
+  EXPECT_EQ(f0.result(), 10ull);
+  c.consume(6);
+  auto f1 = fill(c);
+  f1.start();
+  EXPECT_EQ(f1.result(), 6ull);
+  EXPECT_EQ(c.peek(), "6789abcdef");
+
+  auto f2 = fill(c);
+  f2.start();
+  bool exception = false;
+  try {
+    f2.result();
+  } catch (std::runtime_error&) {
+    exception = true;
+  }
+  EXPECT_TRUE(exception);
+}
+
+TEST(com, buffered_async_read) {
+  TestCtx ctx;
+  ChunkSocket socket;
+  socket._chunks = { "abc", "defgh", std::string(100, 'x') };
+  chunk_channel c(ctx, socket, 16);
+
+  std::string small;
+  auto t0 = pullBuffer(c, 4, small);
+  t0.start();
+  EXPECT_TRUE(t0.result());
+  EXPECT_EQ(small, "abcd");
+  EXPECT_EQ(c.peek(), "efgh");
+  EXPECT_EQ(socket._reads, 2ull);
+
+  // Served from the buffer first, the rest directly into the destination
+  std::string large;
+  auto t1 = pullBuffer(c, 104, large);
+  t1.start();
+  EXPECT_TRUE(t1.result());
+  EXPECT_EQ(large, "efgh" + std::string(100, 'x'));
+  EXPECT_EQ(socket._reads, 3ull);
+}
+
+////////////////////////////////////////////////////////////////////////////////
+
+namespace {
+// Writes at most 7 bytes per call, and has no async_sendfile
+struct WriteSocket {
+  coro::task<std::size_t>
+  async_write(TestCtx&, char const* buffer, std::size_t count) {
+    auto bytes = std::min(count, (std::size_t)7);
+    _written.append(buffer, bytes);
+    _writes++;
+    co_return bytes;
+  }
+  std::string _written;
+  std::size_t _writes = 0;
+};
+
+// The same with files, which are identified by their contents
+struct FileSocket : WriteSocket {
+  coro::task<std::size_t>
+  async_sendfile(TestCtx&, int file, std::size_t offset, std::size_t count) {
+    auto bytes = std::min(count, (std::size_t)7);
+    _written.append(_files.at(file), offset, bytes);
+    _sends++;
+    co_return bytes;
+  }
+  std::vector<std::string> _files;
+  std::size_t _sends = 0;
+};
+
+using write_channel = com::channel<TestCtx, WriteSocket>;
+using file_channel = com::channel<TestCtx, FileSocket>;
+
+template<typename channel_type>
+coro::sync_task<bool>
+pushFile(channel_type& channel, int file, std::string const& data,
+         std::size_t offset, std::size_t count) {
+  co_return co_await channel.async_write_file(file, data.data(), offset, count);
+}
+}
+
+TEST(com, async_write_file_sendfile) {
+  TestCtx ctx;
+  FileSocket socket;
+  socket._files = { "not this one", "0123456789abcdefghij" };
+  file_channel c(ctx, socket);
+
+  std::string data = "ignored";
+  auto task = pushFile(c, 1, data, 3, 15);
+  task.start();
+  EXPECT_TRUE(task.result());
+  EXPECT_EQ(socket._written, "3456789abcdefgh");
+  EXPECT_EQ(socket._sends, 3ull);
+  EXPECT_EQ(socket._writes, 0ull);
+}
+
+TEST(com, async_write_file_without_file) {
+  TestCtx ctx;
+  FileSocket socket;
+  file_channel c(ctx, socket);
+
+  std::string data = "0123456789abcdefghij";
+  auto task = pushFile(c, -1, data, 3, 15);
+  task.start();
+  EXPECT_TRUE(task.result());
+  EXPECT_EQ(socket._written, "3456789abcdefgh");
+  EXPECT_EQ(socket._sends, 0ull);
+  EXPECT_EQ(socket._writes, 3ull);
+}
+
+TEST(com, async_write_file_fallback) {
+  TestCtx ctx;
+  WriteSocket socket;
+  write_channel c(ctx, socket);
+
+  // Written from memory, the socket cannot send file 1
+  std::string data = "0123456789";
+  auto task = pushFile(c, 1, data, 2, 5);
+  task.start();
+  EXPECT_TRUE(task.result());
+  EXPECT_EQ(socket._written, "23456");
+  EXPECT_EQ(socket._writes, 1ull);
+}
+
+////////////////////////////////////////////////////////////////////////////////
+
+namespace {
+// Sends at most 5 bytes per gather write
+struct VectorSocket {
+  coro::task<std::size_t>
+  async_write(TestCtx&, char const* buffer, std::size_t count) {
+    _written.append(buffer, count);
+    _writes++;
+    co_return count;
+  }
+  coro::task<std::size_t>
+  async_writev(TestCtx&, iovec const* buffers, int count) {
+    std::size_t bytes = 0;
+    for (int i = 0; i < count && bytes < 5; ++i) {
+      auto part = std::min(buffers[i].iov_len, 5 - bytes);
+      _written.append((char const*)buffers[i].iov_base, part);
+      bytes += part;
+    }
+    _writevs++;
+    co_return bytes;
+  }
+  std::string _written;
+  std::size_t _writes = 0;
+  std::size_t _writevs = 0;
+};
+
+template<typename channel_type>
+coro::sync_task<bool>
+pushBuffers(channel_type& channel, std::vector<std::string>& in) {
+  std::vector<iovec> buffers;
+  for (auto& s : in) {
+    buffers.push_back(iovec{ s.data(), s.size() });
+  }
+  co_return co_await channel.async_writev(buffers.data(), buffers.size());
+}
+}
+
+TEST(com, async_writev) {
+  TestCtx ctx;
+  VectorSocket socket;
+  com::channel<TestCtx, VectorSocket> c(ctx, socket);
+
+  std::vector<std::string> in = { "", "ab", "", "cdefg", "hijkl", "m", "" };
+  auto task = pushBuffers(c, in);
+  task.start();
+  EXPECT_TRUE(task.result());
+  EXPECT_EQ(socket._written, "abcdefghijklm");
+  EXPECT_EQ(socket._writevs, 3ull);
+  EXPECT_EQ(socket._writes, 0ull);
+}
+
+TEST(com, async_writev_fallback) {
+  TestCtx ctx;
+  TestSocket socket;
+  test_channel c(ctx, socket);
+
+  std::vector<std::string> in = { "Hello", ", ", "world!" };
+  auto task = pushBuffers(c, in);
+  task.start();
+  for (int i = 0; i < 13; ++i) {
+    ctx.resume();
+  }
+  EXPECT_TRUE(task.done());
+  EXPECT_TRUE(task.result());
+  EXPECT_EQ(socket._written, "Hello, world!");
+}
+
+////////////////////////////////////////////////////////////////////////////////
@@ -0,0 +1,544 @@
+////////////////////////////////////////////////////////////////////////////////
+
+#include "../event.hpp"
+#include <gtest/gtest.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <errno.h>
+#include <chrono>
+#include <vector>
+#include <memory>
+#include <sstream>
+#include <atomic>
+#include <thread>
+
+////////////////////////////////////////////////////////////////////////////////
+
+namespace {
+struct pipe_read_impl {
+  static constexpr decltype(::read)* func = ::read;
+  static inline bool is_ready(ssize_t result) {
+    return result >= 0 || (errno != EAGAIN && errno != EWOULDBLOCK);
+  }
+};
+using pipe_read = event::io_operation<pipe_read_impl, decltype(::read)>;
+
+struct Pipe {
+  Pipe() {
+    EXPECT_EQ(::pipe(fds), 0);
+    ::fcntl(fds[0], F_SETFL, ::fcntl(fds[0], F_GETFL) | O_NONBLOCK);
+  }
+  ~Pipe() {
+    ::close(fds[0]);
+    ::close(fds[1]);
+  }
+  void send(char c) {
+    EXPECT_EQ(::write(fds[1], &c, 1), 1);
+  }
+  int fds[2];
+};
+
+coro::sync_task<std::size_t>
+readBytes(event::io_watcher& watcher, int fd, std::size_t count,
+          bool disarmAfterRead) {
+  std::size_t received = 0;
+  while (received < count) {
+    char c;
+    auto result = co_await pipe_read(watcher, fd, &c, 1);
+    if (result != 1) {
+      break;
+    }
+    received++;
+    if (disarmAfterRead) {
+      // What io_operation used to do: stop the watcher after every wakeup
+      watcher.disarm();
+    }
+  }
+  co_return received;
+}
+
+struct RoundTrips {
+  std::size_t arms;
+  std::size_t disarms;
+  double seconds;
+};
+
+RoundTrips
+roundTrips(std::size_t count, bool disarmAfterRead) {
+  event::scheduler s(event::scheduler::secondary);
+  Pipe p;
+  event::io_watcher watcher(EV_READ);
+  watcher.bind(s.loop(), p.fds[0]);
+  auto begin = std::chrono::steady_clock::now();
+  auto task = readBytes(watcher, p.fds[0], count, disarmAfterRead);
+  task.start();
+  for (std::size_t i = 0; i < count; ++i) {
+    p.send('x');
+    s.run_once();
+  }
+  auto end = std::chrono::steady_clock::now();
+  EXPECT_TRUE(task.done());
+  EXPECT_EQ(task.result(), count);
+  return RoundTrips {
+    watcher.arm_count(), watcher.disarm_count(),
+    std::chrono::duration<double>(end - begin).count()
+  };
+}
+}
+
+TEST(event, io_watcher_stays_armed) {
+  event::scheduler s(event::scheduler::secondary);
+  Pipe p;
+  event::io_watcher watcher(EV_READ);
+  watcher.bind(s.loop(), p.fds[0]);
+
+  auto task = readBytes(watcher, p.fds[0], 3, false);
+  task.start();
+  EXPECT_FALSE(task.done());
+  EXPECT_EQ(watcher.arm_count(), 1ull);
+  p.send('a');
+  s.run_once();
+  p.send('b');
+  s.run_once();
+  EXPECT_FALSE(task.done());
+  p.send('c');
+  s.run_once();
+  EXPECT_TRUE(task.done());
+  EXPECT_EQ(task.result(), 3ull);
+  EXPECT_EQ(watcher.arm_count(), 1ull);
+  EXPECT_EQ(watcher.disarm_count(), 0ull);
+}
+
+TEST(event, io_watcher_disarms_when_idle) {
+  event::scheduler s(event::scheduler::secondary);
+  Pipe p;
+  event::io_watcher watcher(EV_READ);
+  watcher.bind(s.loop(), p.fds[0]);
+
+  auto task = readBytes(watcher, p.fds[0], 1, false);
+  task.start();
+  p.send('a');
+  s.run_once();
+  EXPECT_TRUE(task.done());
+  EXPECT_EQ(watcher.disarm_count(), 0ull);
+  // Nobody waits for this one
+  p.send('b');
+  s.run_once();
+  EXPECT_EQ(watcher.arm_count(), 1ull);
+  EXPECT_EQ(watcher.disarm_count(), 1ull);
+}
+
+TEST(event, io_watcher_rebind_disarms) {
+  event::scheduler s(event::scheduler::secondary);
+  Pipe p0;
+  Pipe p1;
+  event::io_watcher watcher(EV_READ);
+  watcher.bind(s.loop(), p0.fds[0]);
+  {
+    auto task = readBytes(watcher, p0.fds[0], 1, false);
+    task.start();
+    EXPECT_EQ(watcher.arm_count(), 1ull);
+  }
+  watcher.bind(s.loop(), p1.fds[0]);
+  EXPECT_EQ(watcher.disarm_count(), 1ull);
+  auto task = readBytes(watcher, p1.fds[0], 1, false);
+  task.start();
+  p1.send('a');
+  s.run_once();
+  EXPECT_TRUE(task.done());
+  EXPECT_EQ(watcher.arm_count(), 2ull);
+}
+
+TEST(event, benchmark_interest_list_changes) {
+  constexpr std::size_t count = 10000;
+  auto persistent = roundTrips(count, false);
+  auto perAwait = roundTrips(count, true);
+  std::cout << "io_watcher: " << count << " blocking reads" << std::endl;
+  std::cout << "  persistent: " << persistent.arms << " arms, "
+            << persistent.disarms << " disarms, "
+            << persistent.seconds * 1e9 / count << " ns/read" << std::endl;
+  std::cout << "  per await:  " << perAwait.arms << " arms, "
+            << perAwait.disarms << " disarms, "
+            << perAwait.seconds * 1e9 / count << " ns/read" << std::endl;
+  EXPECT_EQ(persistent.arms, 1ull);
+  EXPECT_EQ(persistent.disarms, 0ull);
+  EXPECT_EQ(perAwait.arms, count);
+  EXPECT_EQ(perAwait.disarms, count);
+}
+
+////////////////////////////////////////////////////////////////////////////////
+
+namespace {
+coro::sync_task<void>
+sleep(event::scheduler& s, ev_tstamp seconds) {
+  co_await event::timer(s, seconds);
+}
+
+// Records the order in which its deadlines expire
+struct Expiries {
+  struct entry {
+    Expiries* owner;
+    int id;
+    event::deadline deadline;
+    void expire() {
+      owner->order.push_back(id);
+    }
+  };
+  std::vector<int> order;
+};
+
+coro::task<int>
+answer() {
+  co_return 42;
+}
+
+coro::task<std::size_t>
+readForever(event::io_watcher& watcher, int fd) {
+  char c;
+  auto result = co_await pipe_read(watcher, fd, &c, 1);
+  co_return result;
+}
+
+coro::sync_task<bool>
+timesOut(event::scheduler& s, coro::task<std::size_t> task,
+         ev_tstamp seconds) {
+  try {
+    co_await event::with_timeout(s, std::move(task), seconds);
+  } catch (event::timeout&) {
+    co_return true;
+  }
+  co_return false;
+}
+
+double
+rearmSeconds(std::size_t connections) {
+  event::scheduler s(event::scheduler::secondary);
+  auto& queue = s.timeouts(60.);
+  Expiries expiries;
+  std::vector<std::unique_ptr<Expiries::entry>> entries;
+  for (std::size_t i = 0; i < connections; ++i) {
+    entries.push_back(std::make_unique<Expiries::entry>());
+    entries.back()->owner = &expiries;
+    entries.back()->deadline.arm(queue, entries.back().get());
+  }
+  EXPECT_EQ(queue.size(), connections);
+  // Every connection received something and starts over
+  constexpr std::size_t rounds = 10;
+  auto begin = std::chrono::steady_clock::now();
+  for (std::size_t round = 0; round < rounds; ++round) {
+    for (auto& entry : entries) {
+      entry->deadline.arm(queue, entry.get());
+    }
+  }
+  auto end = std::chrono::steady_clock::now();
+  entries.clear();
+  EXPECT_EQ(queue.size(), 0ull);
+  return std::chrono::duration<double>(end - begin).count() / (rounds * connections);
+}
+}
+
+TEST(event, timer) {
+  event::scheduler s(event::scheduler::secondary);
+  auto begin = std::chrono::steady_clock::now();
+  auto task = sleep(s, 0.01);
+  task.start();
+  EXPECT_FALSE(task.done());
+  while (!task.done()) {
+    s.run_once();
+  }
+  EXPECT_GE(std::chrono::steady_clock::now() - begin,
+            std::chrono::milliseconds(10));
+}
+
+TEST(event, timeout_queue_expires_in_order) {
+  event::scheduler s(event::scheduler::secondary);
+  auto& queue = s.timeouts(0.01);
+  EXPECT_EQ(&queue, &s.timeouts(0.01));
+  Expiries expiries;
+  Expiries::entry entries[4] = {
+    { &expiries, 0, {} }, { &expiries, 1, {} },
+    { &expiries, 2, {} }, { &expiries, 3, {} }
+  };
+  for (auto& entry : entries) {
+    entry.deadline.arm(queue, &entry);
+  }
+  EXPECT_EQ(queue.size(), 4ull);
+  // Armed again, so it expires last
+  entries[0].deadline.arm(queue, &entries[0]);
+  entries[2].deadline.disarm();
+  EXPECT_FALSE(entries[2].deadline.armed());
+  EXPECT_EQ(queue.size(), 3ull);
+  while (queue.size() > 0) {
+    s.run_once();
+  }
+  EXPECT_EQ(expiries.order, (std::vector<int>{ 1, 3, 0 }));
+  EXPECT_FALSE(entries[0].deadline.armed());
+}
+
+TEST(event, with_timeout_result) {
+  event::scheduler s(event::scheduler::secondary);
+  auto task = [](event::scheduler& s) -> coro::sync_task<int> {
+    co_return co_await event::with_timeout(s, answer(), 10.);
+  }(s);
+  task.start();
+  EXPECT_TRUE(task.done());
+  EXPECT_EQ(task.result(), 42);
+  EXPECT_EQ(s.timeouts(10.).size(), 0ull);
+}
+
+TEST(event, with_timeout_completes_in_time) {
+  event::scheduler s(event::scheduler::secondary);
+  Pipe p;
+  event::io_watcher watcher(EV_READ);
+  watcher.bind(s.loop(), p.fds[0]);
+  auto task = timesOut(s, readForever(watcher, p.fds[0]), 10.);
+  task.start();
+  EXPECT_EQ(s.timeouts(10.).size(), 1ull);
+  p.send('a');
+  s.run_once();
+  EXPECT_TRUE(task.done());
+  EXPECT_FALSE(task.result());
+  EXPECT_EQ(s.timeouts(10.).size(), 0ull);
+}
+
+TEST(event, with_timeout_cancels_task) {
+  event::scheduler s(event::scheduler::secondary);
+  Pipe p;
+  event::io_watcher watcher(EV_READ);
+  watcher.bind(s.loop(), p.fds[0]);
+  auto task = timesOut(s, readForever(watcher, p.fds[0]), 0.01);
+  task.start();
+  while (!task.done()) {
+    s.run_once();
+  }
+  EXPECT_TRUE(task.result());
+  // The read was destroyed and left the watcher
+  p.send('a');
+  s.run_once();
+  EXPECT_EQ(watcher.disarm_count(), 1ull);
+  // A new read can wait on the same watcher
+  auto again = timesOut(s, readForever(watcher, p.fds[0]), 10.);
+  again.start();
+  EXPECT_TRUE(again.done());
+  EXPECT_FALSE(again.result());
+}
+
+TEST(event, benchmark_deadlines) {
+  constexpr std::size_t few = 1000;
+  constexpr std::size_t many = 100000;
+  auto fewSeconds = rearmSeconds(few);
+  auto manySeconds = rearmSeconds(many);
+  std::cout << "timeout_queue: re-arming a deadline" << std::endl;
+  std::cout << "  " << few << " connections:   "
+            << fewSeconds * 1e9 << " ns" << std::endl;
+  std::cout << "  " << many << " connections: "
+            << manySeconds * 1e9 << " ns" << std::endl;
+}
+
+////////////////////////////////////////////////////////////////////////////////
+
+namespace {
+coro::sync_task<void>
+readOne(event::io_watcher& watcher, int fd) {
+  char c;
+  co_await pipe_read(watcher, fd, &c, 1);
+}
+
+coro::sync_task<void>
+failLater(event::scheduler& s) {
+  co_await event::timer(s, 0.);
+  throw std::runtime_error("error: Failed on purpose");
+}
+
+// Suspends until opened
+struct Gate {
+  bool await_ready() noexcept {
+    return false;
+  }
+  void await_suspend(std::experimental::coroutine_handle<> handle) noexcept {
+    _handle = handle;
+  }
+  void await_resume() noexcept {}
+  void open() {
+    std::exchange(_handle, nullptr).resume();
+  }
+  std::experimental::coroutine_handle<> _handle;
+};
+
+coro::sync_task<void>
+pass(Gate& gate) {
+  co_await gate;
+}
+
+// Tasks come and go while others stay
+double
+churnSeconds(std::size_t live, std::size_t churn) {
+  event::scheduler s(event::scheduler::secondary);
+  std::vector<Gate> closed(live);
+  for (auto& gate : closed) {
+    s.execute(pass(gate));
+  }
+  Gate gate;
+  auto begin = std::chrono::steady_clock::now();
+  for (std::size_t i = 0; i < churn; ++i) {
+    s.execute(pass(gate));
+    gate.open();
+  }
+  auto end = std::chrono::steady_clock::now();
+  EXPECT_EQ(s.task_count(), live);
+  return std::chrono::duration<double>(end - begin).count() / churn;
+}
+}
+
+namespace {
+coro::sync_task<void>
+waitForRoom(event::scheduler& s, event::limiter& l) {
+  co_await l.wait(s);
+  l.acquire();
+}
+}
+
+TEST(event, limiter_resumes_from_loop) {
+  event::scheduler s(event::scheduler::secondary);
+  event::limiter l(2);
+  auto room = waitForRoom(s, l);
+  room.start();
+  EXPECT_TRUE(room.done());
+  EXPECT_EQ(l.active(), 1ull);
+  l.acquire();
+  EXPECT_FALSE(l.available());
+
+  auto waiting = waitForRoom(s, l);
+  waiting.start();
+  EXPECT_FALSE(waiting.done());
+  l.release();
+  // Not from within release()
+  EXPECT_FALSE(waiting.done());
+  // Taken again before the loop came around
+  l.acquire();
+  s.run_once();
+  EXPECT_FALSE(waiting.done());
+  l.release();
+  while (!waiting.done()) {
+    s.run_once();
+  }
+  EXPECT_EQ(l.active(), 2ull);
+}
+
+TEST(event, limiter_waiter_destroyed) {
+  event::scheduler s(event::scheduler::secondary);
+  event::limiter l(1);
+  l.acquire();
+  {
+    auto waiting = waitForRoom(s, l);
+    waiting.start();
+    EXPECT_FALSE(waiting.done());
+  }
+  l.release();
+  s.run_once();
+  EXPECT_TRUE(l.available());
+}
+
+TEST(event, scheduler_task_count) {
+  event::scheduler s(event::scheduler::secondary);
+  Pipe p0;
+  Pipe p1;
+  event::io_watcher w0(EV_READ);
+  event::io_watcher w1(EV_READ);
+  w0.bind(s.loop(), p0.fds[0]);
+  w1.bind(s.loop(), p1.fds[0]);
+  s.execute(readOne(w0, p0.fds[0]));
+  s.execute(readOne(w1, p1.fds[0]));
+  EXPECT_EQ(s.task_count(), 2ull);
+  // Finishes right away
+  p0.send('a');
+  s.execute(readOne(w0, p0.fds[0]));
+  EXPECT_EQ(s.task_count(), 2ull);
+  p1.send('b');
+  s.run_once();
+  EXPECT_EQ(s.task_count(), 1ull);
+  // Reuses the slot of the finished task
+  s.execute(readOne(w1, p1.fds[0]));
+  EXPECT_EQ(s.task_count(), 2ull);
+  p0.send('c');
+  p1.send('d');
+  s.run_once();
+  EXPECT_EQ(s.task_count(), 0ull);
+}
+
+TEST(event, scheduler_reports_exceptions) {
+  std::stringstream out;
+  auto previous = std::cout.rdbuf(out.rdbuf());
+  {
+    event::scheduler s(event::scheduler::secondary);
+    s.execute(failLater(s));
+    EXPECT_EQ(s.task_count(), 1ull);
+    s.run_once();
+    EXPECT_EQ(s.task_count(), 0ull);
+  }
+  std::cout.rdbuf(previous);
+  EXPECT_EQ(out.str(), "exception: error: Failed on purpose\n");
+}
+
+namespace {
+// Notes the thread it is destroyed on
+struct ThreadWitness {
+  std::thread::id& destroyedOn;
+  ~ThreadWitness() {
+    destroyedOn = std::this_thread::get_id();
+  }
+};
+
+coro::sync_task<void>
+waitForever(event::scheduler& s, std::thread::id& destroyedOn,
+            std::atomic<bool>& waiting) {
+  ThreadWitness witness{ destroyedOn };
+  event::timer forever(s, 3600.);
+  waiting = true;
+  co_await forever;
+}
+
+// Starts waitForever on the thread of the loop, not the calling one
+coro::sync_task<void>
+spawnWaiter(event::scheduler& s, std::thread::id& destroyedOn,
+            std::atomic<bool>& waiting) {
+  event::timer next(s, 0.);
+  co_await next;
+  s.execute(waitForever(s, destroyedOn, waiting));
+}
+
+coro::sync_task<void>
+stopOnceWaiting(event::scheduler& s, std::atomic<bool>& waiting) {
+  while (!waiting) {
+    event::timer poll(s, 0.001);
+    co_await poll;
+  }
+  s.trigger_shutdown_from_task();
+}
+}
+
+TEST(event, scheduler_pool_destroys_tasks_on_their_thread) {
+  std::thread::id destroyedOn;
+  std::atomic<bool> waiting{false};
+  event::scheduler_pool pool(2);
+  pool[1].execute(spawnWaiter(pool[1], destroyedOn, waiting));
+  pool[0].execute(stopOnceWaiting(pool[0], waiting));
+  pool.run();
+  // Not left for the destructor on this thread, the frame pool of the
+  // secondary thread is gone by then
+  EXPECT_TRUE(waiting);
+  EXPECT_NE(destroyedOn, std::thread::id());
+  EXPECT_NE(destroyedOn, std::this_thread::get_id());
+  EXPECT_EQ(pool[1].task_count(), 0ull);
+}
+
+TEST(event, benchmark_task_churn) {
+  constexpr std::size_t churn = 100000;
+  std::cout << "scheduler: " << churn << " tasks coming and going" << std::endl;
+  for (std::size_t live : { std::size_t(10), std::size_t(10000) }) {
+    std::cout << "  next to " << live << " live tasks: "
+              << churnSeconds(live, churn) * 1e9 << " ns/task" << std::endl;
+  }
+}
+
+////////////////////////////////////////////////////////////////////////////////
@@ -0,0 +1,43 @@
+////////////////////////////////////////////////////////////////////////////////
+
+#ifndef BACKEND_UNITTEST_FDSOCKET_HPP
+#define BACKEND_UNITTEST_FDSOCKET_HPP
+
+////////////////////////////////////////////////////////////////////////////////
+
+#include <common/coro.hpp>
+#include <cstddef>
+#include <sys/uio.h>
+#include <unistd.h>
+
+////////////////////////////////////////////////////////////////////////////////
+
+struct FdCtx {};
+
+// Blocking writes to a file descriptor, one syscall per call
+struct FdSocket {
+  coro::task<std::size_t>
+  async_write(FdCtx&, char const* buffer, std::size_t count) {
+    _syscalls++;
+    auto result = ::write(_fd, buffer, count);
+    co_return result > 0 ? result : 0;
+  }
+  int _fd = -1;
+  std::size_t _syscalls = 0;
+};
+
+// Also writes gathered buffers, with a single syscall
+struct FdGatherSocket : FdSocket {
+  coro::task<std::size_t>
+  async_writev(FdCtx&, iovec const* buffers, int count) {
+    _syscalls++;
+    auto result = ::writev(_fd, buffers, count);
+    co_return result > 0 ? result : 0;
+  }
+};
+
+////////////////////////////////////////////////////////////////////////////////
+
+#endif // BACKEND_UNITTEST_FDSOCKET_HPP
+
+////////////////////////////////////////////////////////////////////////////////
@@ -1,11 +1,60 @@
 ////////////////////////////////////////////////////////////////////////////////
 
 #include "../fs.hpp"
+#include "../com.hpp"
 #include <gtest/gtest.h>
 #include <fstream>
 
 ////////////////////////////////////////////////////////////////////////////////
 
+namespace {
+struct ParkingCtx {};
+
+// Holds every write until it is released, like a client that reads slowly
+struct ParkingSocket {
+  struct gate {
+    ParkingSocket& socket;
+    bool await_ready() const noexcept {
+      return socket._released;
+    }
+    void await_suspend(std::experimental::coroutine_handle<> handle) noexcept {
+      socket._parked = handle;
+    }
+    void await_resume() const noexcept {}
+  };
+  coro::task<std::size_t>
+  async_write(ParkingCtx&, char const* buffer, std::size_t count) {
+    co_await gate{ *this };
+    _written.append(buffer, count);
+    co_return count;
+  }
+  coro::task<std::size_t>
+  async_writev(ParkingCtx&, iovec const* buffers, int count) {
+    co_await gate{ *this };
+    std::size_t bytes = 0;
+    for (int i = 0; i < count; ++i) {
+      _written.append(static_cast<char const*>(buffers[i].iov_base),
+                      buffers[i].iov_len);
+      bytes += buffers[i].iov_len;
+    }
+    co_return bytes;
+  }
+  void release() {
+    _released = true;
+    std::exchange(_parked, nullptr).resume();
+  }
+  std::experimental::coroutine_handle<> _parked;
+  bool _released = false;
+  std::string _written;
+};
+
+coro::sync_task<bool>
+sendResponse(com::channel<ParkingCtx, ParkingSocket>& channel,
+             http::response const& r) {
+  co_return co_await http::response::async_write(channel, r);
+}
+}
+
 TEST(fs, cache_invalid_whitelist) {
   fs::cache c("bla", false);
   EXPECT_EQ(c.entries().size(), 0ull);
@@ -93,4 +142,267 @@ TEST(fs, cache_find) {
   ASSERT_EQ(r2, nullptr);
 }
 
+TEST(fs, resource_ok_header) {
+  {
+    std::ofstream wl("whitelist.ini",
+                     std::ofstream::out);
+    wl << "test.txt" << std::endl;
+  }
+  {
+    std::ofstream file("test.txt",
+                       std::ofstream::out);
+    file << "hello" << std::endl;
+  }
+
+  fs::cache c(".", true);
+  auto r0 = c.find("/test.txt");
+  ASSERT_NE(r0, nullptr);
+  // Reloaded files are sent from memory, the others from their file
+  EXPECT_EQ(r0->fd(), -1);
+  fs::resource fixed(".", "/test.txt");
+  EXPECT_GE(fixed.fd(), 0);
+  auto etag = std::string(r0->etag());
+  EXPECT_EQ(etag.size(), 18ull);
+  EXPECT_EQ(r0->last_modified().substr(r0->last_modified().size() - 4), " GMT");
+  EXPECT_EQ(r0->ok_header(),
+            "HTTP/1.1 200 OK\r\n"
+            "Content-Length: 6\r\n"
+            "Accept-Ranges: bytes\r\n"
+            "Content-Location: /test.txt\r\n"
+            "Content-Type: text/plain\r\n"
+            "ETag: " + etag + "\r\n"
+            "Last-Modified: " + std::string(r0->last_modified()) + "\r\n"
+            "\r\n");
+  EXPECT_EQ(r0->not_modified_header().substr(0, 27), "HTTP/1.1 304 Not Modified\r\n");
+
+  {
+    std::ofstream file("test.txt",
+                       std::ofstream::out);
+    file << "hello, world" << std::endl;
+  }
+  auto time = std::filesystem::last_write_time("test.txt");
+  std::filesystem::last_write_time("test.txt", time + std::chrono::seconds(1));
+  auto r1 = c.find("/test.txt");
+  ASSERT_EQ(r1, r0);
+  EXPECT_EQ(std::string(r1->data(), r1->size()), "hello, world\n");
+  EXPECT_NE(r1->ok_header().find("Content-Length: 13\r\n"), std::string::npos);
+  EXPECT_NE(r1->etag(), etag);
+}
+
+TEST(fs, cache_encodings) {
+  {
+    std::ofstream wl("whitelist.ini",
+                     std::ofstream::out);
+    wl << "main.js" << std::endl;
+    wl << "main.js.gz" << std::endl;
+    wl << "main.js.br" << std::endl;
+    wl << "orphan.js.gz" << std::endl;
+  }
+  {
+    std::ofstream file("main.js",
+                       std::ofstream::out);
+    file << "console.log('hello, world');" << std::endl;
+  }
+  {
+    std::ofstream file("main.js.gz",
+                       std::ofstream::out);
+    file << "gzipped" << std::endl;
+  }
+  {
+    std::ofstream file("main.js.br",
+                       std::ofstream::out);
+    file << "brotli" << std::endl;
+  }
+
+  fs::cache c(".", false);
+  EXPECT_EQ(c.entries().size(), 1ull);
+  EXPECT_EQ(c.find("/main.js.gz"), nullptr);
+  auto r = c.find("/main.js");
+  ASSERT_NE(r, nullptr);
+  EXPECT_TRUE(r->encoding().empty());
+  EXPECT_TRUE(r->has_alternatives());
+  EXPECT_NE(r->ok_header().find("Vary: Accept-Encoding\r\n"), std::string::npos);
+
+  ASSERT_EQ(r->encodings().size(), 2ull);
+  auto& br = *r->encodings()[0];
+  EXPECT_EQ(br.encoding(), "br");
+  EXPECT_EQ(std::string(br.data(), br.size()), "brotli\n");
+  EXPECT_EQ(br.location(), "/main.js");
+  EXPECT_EQ(br.type(), http::content::mime_type::JS);
+  EXPECT_NE(br.ok_header().find("Content-Encoding: br\r\n"), std::string::npos);
+  EXPECT_NE(br.ok_header().find("Vary: Accept-Encoding\r\n"), std::string::npos);
+  EXPECT_NE(br.etag(), r->etag());
+  auto& gz = *r->encodings()[1];
+  EXPECT_EQ(gz.encoding(), "gzip");
+  EXPECT_EQ(std::string(gz.data(), gz.size()), "gzipped\n");
+}
+
+TEST(fs, resource_mapped) {
+  {
+    std::ofstream file("mapped.js",
+                       std::ofstream::out);
+    file << "console.log('hello');" << std::endl;
+  }
+
+  fs::resource r(".", "/mapped.js", std::string(), fs::storage::MAP);
+  EXPECT_EQ(std::string(r.data(), r.size()), "console.log('hello');\n");
+  EXPECT_GE(r.fd(), 0);
+  EXPECT_NE(r.ok_header().find("Content-Length: 22\r\n"), std::string::npos);
+  auto etag = std::string(r.etag());
+  EXPECT_EQ(etag.front(), '"');
+  EXPECT_EQ(etag.back(), '"');
+  // Tagged by content, the same as a copy of it
+  fs::resource copied(".", "/mapped.js", std::string(), fs::storage::COPY);
+  EXPECT_EQ(copied.etag(), etag);
+
+  // Replaced, the mapping of the old file stays valid until the reload
+  auto old = r.data();
+  {
+    std::ofstream file("mapped.js.tmp",
+                       std::ofstream::out);
+    file << "console.log('hello, world');" << std::endl;
+  }
+  std::filesystem::rename("mapped.js.tmp", "mapped.js");
+  EXPECT_EQ(std::string(r.data(), r.size()), "console.log('hello');\n");
+  r.reload(true);
+  EXPECT_NE(r.data(), old);
+  EXPECT_EQ(std::string(r.data(), r.size()), "console.log('hello, world');\n");
+  EXPECT_NE(r.ok_header().find("Content-Length: 29\r\n"), std::string::npos);
+  EXPECT_NE(r.etag(), etag);
+
+  {
+    std::ofstream file("empty.txt",
+                       std::ofstream::out);
+  }
+  fs::resource e(".", "/empty.txt", std::string(), fs::storage::MAP);
+  EXPECT_EQ(e.size(), 0ull);
+  EXPECT_NE(e.ok_header().find("Content-Length: 0\r\n"), std::string::npos);
+}
+
+TEST(fs, cache_mapped) {
+  {
+    std::ofstream wl("whitelist.ini",
+                     std::ofstream::out);
+    wl << "main.js" << std::endl;
+    wl << "main.js.gz" << std::endl;
+  }
+  {
+    std::ofstream file("main.js",
+                       std::ofstream::out);
+    file << "console.log('hello, world');" << std::endl;
+  }
+  {
+    std::ofstream file("main.js.gz",
+                       std::ofstream::out);
+    file << "gzipped" << std::endl;
+  }
+
+  fs::cache c(".", false, fs::storage::MAP);
+  auto r = c.find("/main.js");
+  ASSERT_NE(r, nullptr);
+  EXPECT_EQ(std::string(r->data(), r->size()), "console.log('hello, world');\n");
+  ASSERT_EQ(r->encodings().size(), 1ull);
+  auto& gz = *r->encodings()[0];
+  EXPECT_EQ(std::string(gz.data(), gz.size()), "gzipped\n");
+}
+
+TEST(fs, reload_while_writing) {
+  std::filesystem::create_directories("reloaded");
+  {
+    std::ofstream wl("reloaded/whitelist.ini",
+                     std::ofstream::out);
+    wl << "test.txt" << std::endl;
+  }
+  {
+    std::ofstream file("reloaded/test.txt",
+                       std::ofstream::out);
+    file << "the first version" << std::endl;
+  }
+
+  fs::cache c("reloaded", true);
+  auto r = c.find("/test.txt");
+  ASSERT_NE(r, nullptr);
+  // Could be rewritten in place, so sent from memory
+  EXPECT_EQ(r->fd(), -1);
+  http::response response;
+  response.set_status_code(http::response::status_code::OK);
+  response.set_content(r);
+  auto expected = std::string(r->ok_header()) + "the first version\n";
+
+  ParkingCtx ctx;
+  ParkingSocket socket;
+  com::channel<ParkingCtx, ParkingSocket> channel(ctx, socket);
+  auto task = sendResponse(channel, response);
+  task.start();
+  ASSERT_FALSE(task.done());
+
+  // Rewritten in place and reloaded while the response waits for the client
+  {
+    std::ofstream file("reloaded/test.txt",
+                       std::ofstream::out | std::ofstream::trunc);
+    file << "v2" << std::endl;
+  }
+  c.entries().at("/test.txt")->reload(true);
+  EXPECT_EQ(std::string(r->data(), r->size()), "v2\n");
+
+  socket.release();
+  ASSERT_TRUE(task.done());
+  EXPECT_TRUE(task.result());
+  EXPECT_EQ(socket._written, expected);
+  // The response holds the version it started with
+  EXPECT_EQ(response.get_content()->etag().size(), 18ull);
+  EXPECT_NE(response.get_content()->etag(), r->etag());
+}
+
+#if defined(__linux__)
+TEST(fs, cache_watch) {
+  std::filesystem::create_directories("watched");
+  {
+    std::ofstream wl("watched/whitelist.ini",
+                     std::ofstream::out);
+    wl << "test.txt" << std::endl;
+  }
+  {
+    std::ofstream file("watched/test.txt",
+                       std::ofstream::out);
+    file << "hello" << std::endl;
+  }
+
+  event::scheduler s(event::scheduler::secondary);
+  fs::cache c("watched", true);
+  s.execute(c.watch(s));
+  auto r = c.find("/test.txt");
+  ASSERT_NE(r, nullptr);
+
+  // Replaced rather than written, like editors do
+  {
+    std::ofstream file("watched/test.txt.tmp",
+                       std::ofstream::out);
+    file << "hello, world" << std::endl;
+  }
+  std::filesystem::rename("watched/test.txt.tmp", "watched/test.txt");
+  s.run_once();
+  EXPECT_EQ(std::string(r->data(), r->size()), "hello, world\n");
+
+  {
+    std::ofstream file("watched/new.txt",
+                       std::ofstream::out);
+    file << "new" << std::endl;
+  }
+  s.run_once();
+  EXPECT_EQ(c.find("/new.txt"), nullptr);
+  {
+    std::ofstream wl("watched/whitelist.ini",
+                     std::ofstream::out);
+    wl << "test.txt" << std::endl;
+    wl << "new.txt" << std::endl;
+  }
+  s.run_once();
+  auto n = c.find("/new.txt");
+  ASSERT_NE(n, nullptr);
+  EXPECT_EQ(std::string(n->data(), n->size()), "new\n");
+  EXPECT_EQ(c.find("/test.txt"), r);
+}
+#endif
+
 ////////////////////////////////////////////////////////////////////////////////
@@ -8,7 +8,11 @@
 ////////////////////////////////////////////////////////////////////////////////
 
 #include "../http.hpp"
+#include "../com.hpp"
+#include <common/unittest/allocations.hpp>
 #include <gtest/gtest.h>
+#include <deque>
+#include <chrono>
 
 ////////////////////////////////////////////////////////////////////////////////
 
@@ -58,28 +62,27 @@ TEST(http, request_stream) {
     "\r\n"
     "GET bla HTTP/1.1\r\n";
 
-  std::vector<http::request> expected;
-  expected.resize(3);
-  
-  //expected[0].addLine("GET / HTTP/1.1");
-  expected[0].set_method(http::request::method::GET);
-  expected[0].set_uri("/");
-  expected[0].get_headers().insert(std::make_pair("host", "localhost"));
-  expected[0].get_headers().insert(std::make_pair("accept", "text/html,application/xhtml+xml,application/xml;q=0.9,*/*;q=0.8"));
-  expected[0].get_headers().insert(std::make_pair("accept-language", "en-gb"));
-  expected[0].get_headers().insert(std::make_pair("connection", "keep-alive"));
-  expected[0].get_headers().insert(std::make_pair("accept-encoding", "gzip, deflate, br"));
-  expected[0].get_headers().insert(std::make_pair("user-agent", "Mozilla/5.0 (Macintosh; Intel Mac OS X 10_15_4) AppleWebKit/605.1.15 (KHTML, like Gecko) Version/13.1 Safari/605.1.15"));
-
-  //expected[1].addLine("GET / HTTP/1.1");
-  expected[1].set_method(http::request::method::GET);
-  expected[1].set_uri("/hello/world.txt");
-  expected[1].get_headers().insert(std::make_pair("key", "value"));
-
-  expected[2].set_method(http::request::method::GET);
-  expected[2].set_uri("/some/uri");
-  expected[2].get_headers().insert(std::make_pair("header0", "split over\tmultiple \tlines"));
-  expected[2].get_headers().insert(std::make_pair("regular", "header"));
+  struct expected_request {
+    std::string uri;
+    std::vector<std::pair<std::string, std::string>> headers;
+  };
+  std::vector<expected_request> expected {
+    { "/", {
+        { "Host", "localhost" },
+        { "Accept", "text/html,application/xhtml+xml,application/xml;q=0.9,*/*;q=0.8" },
+        { "Accept-Language", "en-gb" },
+        { "Connection", "keep-alive" },
+        { "Accept-Encoding", "gzip, deflate, br" },
+        { "User-Agent", "Mozilla/5.0 (Macintosh; Intel Mac OS X 10_15_4) AppleWebKit/605.1.15 (KHTML, like Gecko) Version/13.1 Safari/605.1.15" }
+      } },
+    { "/hello/world.txt", {
+        { "Key", "value" }
+      } },
+    { "/some/uri", {
+        { "Header0", "split over\tmultiple \tlines" },
+        { "Regular", "header" }
+      } }
+  };
 
   auto it = expected.begin();
 
@@ -87,9 +90,13 @@ TEST(http, request_stream) {
   for (auto& r : blocking(http::request::stream(chars))) {
     ASSERT_TRUE(it != expected.end());
     auto& e = *(it++);
-    EXPECT_EQ(e.get_method(), r.get_method());
-    EXPECT_EQ(e.get_uri(), r.get_uri());
-    EXPECT_EQ(e.get_headers(), r.get_headers());
+    EXPECT_EQ(r.get_method(), http::request::method::GET);
+    EXPECT_EQ(e.uri, r.get_uri());
+    std::vector<std::pair<std::string, std::string>> headers;
+    for (auto& h : r.get_headers()) {
+      headers.emplace_back(h.first, h.second);
+    }
+    EXPECT_EQ(e.headers, headers);
   }
   EXPECT_TRUE(it == expected.end());
 }
@@ -196,3 +203,549 @@ TEST(http, illegal_character_in_field_name) {
 }
 
 ////////////////////////////////////////////////////////////////////////////////
+
+namespace {
+struct ChunkCtx {};
+struct ChunkSocket {
+  coro::task<std::size_t>
+  async_read(ChunkCtx&, char* buffer, std::size_t count) {
+    _reads++;
+    if (_chunks.empty()) {
+      co_return 0;
+    }
+    auto& chunk = _chunks.front();
+    auto bytes = std::min(count, chunk.size());
+    std::copy(chunk.begin(), chunk.begin() + bytes, buffer);
+    chunk.erase(0, bytes);
+    if (chunk.empty()) {
+      _chunks.pop_front();
+    }
+    co_return bytes;
+  }
+  std::deque<std::string> _chunks;
+  std::size_t _reads = 0;
+};
+using chunk_channel = com::channel<ChunkCtx, ChunkSocket>;
+}
+
+TEST(http, request_parse_incomplete) {
+  std::string s = "GET /index.html HTTP/1.1\r\n"
+    "Host: localhost\r\n"
+    "\r\n";
+  http::request r;
+  for (std::size_t i = 0; i < s.size(); ++i) {
+    EXPECT_EQ(http::request::parse(std::string_view(s.data(), i), r), 0ull);
+  }
+  EXPECT_EQ(http::request::parse(s, r), s.size());
+  EXPECT_EQ(r.get_uri(), "/index.html");
+  EXPECT_EQ(r.get_header("host"), "localhost");
+  EXPECT_EQ(r.get_header(http::request::header::HOST), "localhost");
+}
+
+TEST(http, request_stream_channel_single_read) {
+  std::string s = "GET /game.wasm HTTP/1.1\r\n"
+    "Host: localhost:8080\r\n"
+    "Accept: */*\r\n"
+    "Accept-Language: en-gb\r\n"
+    "Connection: keep-alive\r\n"
+    "Accept-Encoding: gzip, deflate, br\r\n"
+    "Referer: http://localhost:8080/\r\n"
+    "User-Agent: Mozilla/5.0 (Macintosh; Intel Mac OS X 10_15_4) AppleWebKit/605.1.15 (KHTML, like Gecko) Version/13.1 Safari/605.1.15\r\n"
+    "\r\n";
+  ChunkCtx ctx;
+  ChunkSocket socket;
+  socket._chunks = { s };
+  chunk_channel channel(ctx, socket, com::default_buffer_size);
+
+  auto requests = blocking(http::request::stream(channel));
+  auto it = requests.begin();
+  ASSERT_TRUE(it != requests.end());
+  EXPECT_EQ(it->get_uri(), "/game.wasm");
+  EXPECT_EQ(it->get_header("user-agent")->size(), 117ull);
+  EXPECT_EQ(socket._reads, 1ull);
+}
+
+TEST(http, request_stream_channel_pipelined) {
+  ChunkCtx ctx;
+  ChunkSocket socket;
+  socket._chunks = {
+    "GET /a HTTP/1.1\r\nHost: x\r\n\r\nGET /b HTTP/1.1\r\nHo",
+    "st: y\r\n\r",
+    "\n"
+  };
+  chunk_channel channel(ctx, socket, 64);
+
+  std::vector<std::string> uris;
+  for (auto& r : blocking(http::request::stream(channel))) {
+    uris.emplace_back(r.get_uri());
+  }
+  EXPECT_EQ(uris, (std::vector<std::string>{ "/a", "/b" }));
+  EXPECT_EQ(socket._reads, 4ull);
+  EXPECT_EQ(channel.peek(), "");
+}
+
+TEST(http, request_known_headers) {
+  std::string s = "GET /index.html HTTP/1.1\r\n"
+    "HOST: localhost\r\n"
+    "accept-Encoding: gzip\r\n"
+    "Accept-Encoding: br\r\n"
+    "If-None-Match:\r\n"
+    "Folded: \r\n"
+    " first\r\n"
+    "\tsecond\r\n"
+    "\r\n";
+  http::request r;
+  EXPECT_EQ(http::request::parse(s, r), s.size());
+  EXPECT_EQ(r.get_header(http::request::header::HOST), "localhost");
+  EXPECT_EQ(r.get_header(http::request::header::ACCEPT_ENCODING), "gzip");
+  EXPECT_EQ(r.get_header(http::request::header::IF_NONE_MATCH), "");
+  EXPECT_FALSE(r.get_header(http::request::header::RANGE));
+  EXPECT_EQ(r.get_header("folded"), "first\tsecond");
+  EXPECT_FALSE(r.get_header("missing"));
+  EXPECT_EQ(r.get_headers().size(), 5ull);
+
+  // Everything else refers to the parsed bytes
+  auto inside = [&s](std::string_view v) {
+    return v.data() >= s.data() && v.data() + v.size() <= s.data() + s.size();
+  };
+  EXPECT_TRUE(inside(r.get_uri()));
+  EXPECT_TRUE(inside(*r.get_header(http::request::header::HOST)));
+  EXPECT_FALSE(inside(*r.get_header("folded")));
+
+  http::request moved(std::move(r));
+  EXPECT_EQ(moved.get_header("folded"), "first\tsecond");
+  EXPECT_EQ(moved.get_header(http::request::header::HOST), "localhost");
+}
+
+TEST(http, request_stream_channel_stopped) {
+  ChunkCtx ctx;
+  ChunkSocket socket;
+  socket._chunks = {
+    "GET /a HTTP/1.1\r\nHost: x\r\nUpgrade: websocket\r\n\r\nframes"
+  };
+  chunk_channel channel(ctx, socket, 64);
+  {
+    auto requests = blocking(http::request::stream(channel));
+    auto it = requests.begin();
+    ASSERT_TRUE(it != requests.end());
+    EXPECT_EQ(it->get_header(http::request::header::UPGRADE), "websocket");
+    // Still in the buffer while the request refers to it
+    EXPECT_EQ(channel.peek().substr(0, 6), "GET /a");
+  }
+  EXPECT_EQ(channel.peek(), "frames");
+}
+
+TEST(http, request_stream_channel_line_too_long) {
+  ChunkCtx ctx;
+  ChunkSocket socket;
+  socket._chunks = { "GET / HTTP/1.1\r\nVery-Long: " + std::string(1000, 'h') };
+  chunk_channel channel(ctx, socket, com::default_buffer_size);
+
+  bool exception = false;
+  try {
+    for (auto& r : blocking(http::request::stream(channel))) {
+      (void)r;
+      ASSERT_TRUE(false); // should not be reached
+    }
+  } catch (std::runtime_error&) {
+    exception = true;
+  }
+  EXPECT_TRUE(exception);
+}
+
+////////////////////////////////////////////////////////////////////////////////
+
+namespace {
+class test_content final : public http::content {
+public:
+  test_content(std::size_t size, int file)
+    : mData(size, 'x'), mFile(file) {}
+  virtual std::size_t size() const override { return mData.size(); }
+  virtual char const* data() const override { return mData.data(); }
+  virtual std::string const& location() const override { return mLocation; }
+  virtual mime_type type() const override { return mime_type::TEXT; }
+  virtual int fd() const override { return mFile; }
+private:
+  std::string mData;
+  std::string mLocation = "/test.txt";
+  int mFile;
+};
+
+// Counts the sends of each kind
+struct SendSocket {
+  coro::task<std::size_t>
+  async_write(ChunkCtx&, char const*, std::size_t count) {
+    _writes++;
+    _bytes += count;
+    co_return count;
+  }
+  coro::task<std::size_t>
+  async_writev(ChunkCtx&, iovec const* buffers, int count) {
+    _writevs++;
+    std::size_t bytes = 0;
+    for (int i = 0; i < count; ++i) {
+      bytes += buffers[i].iov_len;
+    }
+    _bytes += bytes;
+    co_return bytes;
+  }
+  coro::task<std::size_t>
+  async_sendfile(ChunkCtx&, int, std::size_t, std::size_t count) {
+    _sendfiles++;
+    _bytes += count;
+    co_return count;
+  }
+  std::size_t _writes = 0;
+  std::size_t _writevs = 0;
+  std::size_t _sendfiles = 0;
+  std::size_t _bytes = 0;
+};
+using send_channel = com::channel<ChunkCtx, SendSocket>;
+
+coro::sync_task<bool>
+sendResponse(send_channel& channel, http::response const& r) {
+  co_return co_await http::response::async_write(channel, r);
+}
+}
+
+TEST(http, response_write_small_body) {
+  ChunkCtx ctx;
+  SendSocket socket;
+  send_channel channel(ctx, socket);
+  test_content content(1000, 3);
+  http::response r;
+  r.set_status_code(http::response::status_code::OK);
+  r.set_content(&content);
+
+  auto task = sendResponse(channel, r);
+  task.start();
+  EXPECT_TRUE(task.result());
+  EXPECT_EQ(socket._writevs, 1ull);
+  EXPECT_EQ(socket._writes + socket._sendfiles, 0ull);
+  EXPECT_EQ(socket._bytes, r.serialize_header().size() + 1000);
+}
+
+TEST(http, response_write_large_body) {
+  ChunkCtx ctx;
+  SendSocket socket;
+  send_channel channel(ctx, socket);
+  test_content content(http::response::sendfile_threshold, 3);
+  http::response r;
+  r.set_status_code(http::response::status_code::OK);
+  r.set_content(&content);
+
+  auto task = sendResponse(channel, r);
+  task.start();
+  EXPECT_TRUE(task.result());
+  EXPECT_EQ(socket._writes, 1ull);
+  EXPECT_EQ(socket._sendfiles, 1ull);
+  EXPECT_EQ(socket._writevs, 0ull);
+
+  // Without a file the body goes out from memory
+  test_content memory(http::response::sendfile_threshold, -1);
+  r.set_content(&memory);
+  auto task2 = sendResponse(channel, r);
+  task2.start();
+  EXPECT_TRUE(task2.result());
+  EXPECT_EQ(socket._writevs, 1ull);
+  EXPECT_EQ(socket._sendfiles, 1ull);
+}
+
+TEST(http, request_head) {
+  std::string s = "HEAD /index.html HTTP/1.1\r\n"
+    "Host: localhost\r\n"
+    "\r\n";
+  http::request r;
+  EXPECT_EQ(http::request::parse(s, r), s.size());
+  EXPECT_EQ(r.get_method(), http::request::method::HEAD);
+  EXPECT_EQ(r.get_uri(), "/index.html");
+}
+
+namespace {
+class prepared_content final : public http::content {
+public:
+  prepared_content() {
+    http::response r;
+    r.set_content(this);
+    mOkHeader = r.serialize_header();
+  }
+  virtual std::size_t size() const override { return mData.size(); }
+  virtual char const* data() const override { return mData.data(); }
+  virtual std::string const& location() const override { return mLocation; }
+  virtual mime_type type() const override { return mime_type::HTML; }
+  virtual std::string_view ok_header() const override { return mOkHeader; }
+private:
+  std::string mData = "<html></html>";
+  std::string mLocation = "/index.html";
+  std::string mOkHeader;
+};
+}
+
+TEST(http, response_prepared_header) {
+  prepared_content content;
+  http::response r;
+  r.set_status_code(http::response::status_code::OK);
+  r.set_content(&content);
+
+  std::string storage;
+  auto header = r.header(storage);
+  EXPECT_EQ(header.data(), content.ok_header().data());
+  EXPECT_TRUE(storage.empty());
+  EXPECT_EQ(header, r.serialize_header());
+
+  r.get_headers().insert(std::make_pair("Connection", "close"));
+  header = r.header(storage);
+  EXPECT_EQ(header.data(), storage.data());
+  EXPECT_EQ(header, r.serialize_header());
+
+  r.set_status_code(http::response::status_code::NOT_FOUND);
+  header = r.header(storage);
+  EXPECT_EQ(header, r.serialize_header());
+  EXPECT_EQ(header.substr(0, 13), "HTTP/1.1 404 ");
+}
+
+TEST(http, response_write_body_omitted) {
+  ChunkCtx ctx;
+  SendSocket socket;
+  send_channel channel(ctx, socket);
+  test_content content(http::response::sendfile_threshold, 3);
+  http::response r;
+  r.set_status_code(http::response::status_code::OK);
+  r.set_content(&content);
+  r.set_body_omitted(true);
+
+  auto task = sendResponse(channel, r);
+  task.start();
+  EXPECT_TRUE(task.result());
+  EXPECT_EQ(socket._sendfiles, 0ull);
+  EXPECT_EQ(socket._bytes, r.serialize_header().size());
+  EXPECT_NE(r.serialize_header().find("Content-Length: 65536\r\n"),
+            std::string::npos);
+}
+
+namespace {
+class validated_content final : public http::content {
+public:
+  virtual std::size_t size() const override { return mData.size(); }
+  virtual char const* data() const override { return mData.data(); }
+  virtual std::string const& location() const override { return mLocation; }
+  virtual mime_type type() const override { return mime_type::JS; }
+  virtual std::string_view etag() const override { return "\"abc\""; }
+  virtual std::string_view last_modified() const override {
+    return "Sun, 06 Nov 1994 08:49:37 GMT";
+  }
+private:
+  std::string mData = "main();";
+  std::string mLocation = "/main.js";
+};
+
+bool
+notModified(std::string const& headers) {
+  std::string s = "GET /main.js HTTP/1.1\r\n"
+    "Host: localhost\r\n" + headers + "\r\n";
+  http::request r;
+  EXPECT_EQ(http::request::parse(s, r), s.size());
+  return http::not_modified(r, validated_content());
+}
+}
+
+TEST(http, not_modified_if_none_match) {
+  EXPECT_FALSE(notModified(""));
+  EXPECT_TRUE(notModified("If-None-Match: \"abc\"\r\n"));
+  EXPECT_TRUE(notModified("If-None-Match: W/\"abc\"\r\n"));
+  EXPECT_TRUE(notModified("If-None-Match: \"x\", \"abc\"\r\n"));
+  EXPECT_TRUE(notModified("If-None-Match: *\r\n"));
+  EXPECT_FALSE(notModified("If-None-Match: \"abcd\"\r\n"));
+  // Takes precedence
+  EXPECT_FALSE(notModified("If-None-Match: \"x\"\r\n"
+                           "If-Modified-Since: Sun, 06 Nov 1994 08:49:37 GMT\r\n"));
+}
+
+TEST(http, not_modified_if_modified_since) {
+  EXPECT_TRUE(notModified("If-Modified-Since: Sun, 06 Nov 1994 08:49:37 GMT\r\n"));
+  EXPECT_TRUE(notModified("If-Modified-Since: Mon, 07 Nov 1994 00:00:00 GMT\r\n"));
+  EXPECT_FALSE(notModified("If-Modified-Since: Sun, 06 Nov 1994 08:49:36 GMT\r\n"));
+  EXPECT_FALSE(notModified("If-Modified-Since: yesterday\r\n"));
+}
+
+TEST(http, response_not_modified) {
+  validated_content content;
+  http::response r;
+  r.set_status_code(http::response::status_code::NOT_MODIFIED);
+  r.set_content(&content);
+  EXPECT_EQ(r.serialize_header(),
+            "HTTP/1.1 304 Not Modified\r\n"
+            "Content-Location: /main.js\r\n"
+            "ETag: \"abc\"\r\n"
+            "Last-Modified: Sun, 06 Nov 1994 08:49:37 GMT\r\n"
+            "\r\n");
+
+  ChunkCtx ctx;
+  SendSocket socket;
+  send_channel channel(ctx, socket);
+  auto task = sendResponse(channel, r);
+  task.start();
+  EXPECT_TRUE(task.result());
+  EXPECT_EQ(socket._bytes, r.serialize_header().size());
+}
+
+namespace {
+bool
+acceptsEncoding(std::string const& headers, std::string_view coding) {
+  std::string s = "GET /main.js HTTP/1.1\r\n"
+    "Host: localhost\r\n" + headers + "\r\n";
+  http::request r;
+  EXPECT_EQ(http::request::parse(s, r), s.size());
+  return http::accepts_encoding(r, coding);
+}
+}
+
+TEST(http, accepts_encoding) {
+  EXPECT_FALSE(acceptsEncoding("", "gzip"));
+  EXPECT_TRUE(acceptsEncoding("Accept-Encoding: gzip, deflate, br\r\n", "gzip"));
+  EXPECT_TRUE(acceptsEncoding("Accept-Encoding: gzip, deflate, br\r\n", "br"));
+  EXPECT_FALSE(acceptsEncoding("Accept-Encoding: gzip, deflate\r\n", "br"));
+  EXPECT_TRUE(acceptsEncoding("Accept-Encoding: GZIP;q=0.5\r\n", "gzip"));
+  EXPECT_FALSE(acceptsEncoding("Accept-Encoding: gzip;q=0\r\n", "gzip"));
+  EXPECT_FALSE(acceptsEncoding("Accept-Encoding: gzip; q=0.000\r\n", "gzip"));
+  EXPECT_TRUE(acceptsEncoding("Accept-Encoding: *\r\n", "br"));
+  EXPECT_FALSE(acceptsEncoding("Accept-Encoding: *, br;q=0\r\n", "br"));
+  EXPECT_FALSE(acceptsEncoding("Accept-Encoding: identity\r\n", "gzip"));
+}
+
+namespace {
+http::range_status
+requestedRange(std::string const& headers, http::byte_range& out) {
+  std::string s = "GET /main.js HTTP/1.1\r\n"
+    "Host: localhost\r\n" + headers + "\r\n";
+  http::request r;
+  EXPECT_EQ(http::request::parse(s, r), s.size());
+  return http::requested_range(r, validated_content(), out); // 7 bytes
+}
+}
+
+TEST(http, requested_range) {
+  http::byte_range range;
+  EXPECT_EQ(requestedRange("", range), http::range_status::WHOLE);
+  EXPECT_EQ(requestedRange("Range: bytes=0-0\r\n", range), http::range_status::PARTIAL);
+  EXPECT_EQ(range.first, 0ull);
+  EXPECT_EQ(range.last, 0ull);
+  EXPECT_EQ(requestedRange("Range: bytes=2-\r\n", range), http::range_status::PARTIAL);
+  EXPECT_EQ(range.first, 2ull);
+  EXPECT_EQ(range.last, 6ull);
+  EXPECT_EQ(requestedRange("Range: bytes=3-100\r\n", range), http::range_status::PARTIAL);
+  EXPECT_EQ(range.first, 3ull);
+  EXPECT_EQ(range.last, 6ull);
+  EXPECT_EQ(requestedRange("Range: bytes=-2\r\n", range), http::range_status::PARTIAL);
+  EXPECT_EQ(range.first, 5ull);
+  EXPECT_EQ(range.last, 6ull);
+  EXPECT_EQ(requestedRange("Range: bytes=-100\r\n", range), http::range_status::PARTIAL);
+  EXPECT_EQ(range.first, 0ull);
+  EXPECT_EQ(range.last, 6ull);
+
+  EXPECT_EQ(requestedRange("Range: bytes=7-\r\n", range), http::range_status::UNSATISFIABLE);
+  EXPECT_EQ(requestedRange("Range: bytes=-0\r\n", range), http::range_status::UNSATISFIABLE);
+
+  EXPECT_EQ(requestedRange("Range: bytes=0-1,3-4\r\n", range), http::range_status::WHOLE);
+  EXPECT_EQ(requestedRange("Range: bytes=4-3\r\n", range), http::range_status::WHOLE);
+  EXPECT_EQ(requestedRange("Range: items=0-1\r\n", range), http::range_status::WHOLE);
+  EXPECT_EQ(requestedRange("Range: bytes=a-1\r\n", range), http::range_status::WHOLE);
+  EXPECT_EQ(requestedRange("Range: bytes=99999999999999999999-\r\n", range),
+            http::range_status::WHOLE);
+}
+
+TEST(http, requested_range_if_range) {
+  http::byte_range range;
+  EXPECT_EQ(requestedRange("Range: bytes=1-2\r\n"
+                           "If-Range: \"abc\"\r\n", range),
+            http::range_status::PARTIAL);
+  EXPECT_EQ(requestedRange("Range: bytes=1-2\r\n"
+                           "If-Range: Sun, 06 Nov 1994 08:49:37 GMT\r\n", range),
+            http::range_status::PARTIAL);
+  EXPECT_EQ(requestedRange("Range: bytes=1-2\r\n"
+                           "If-Range: W/\"abc\"\r\n", range),
+            http::range_status::WHOLE);
+  EXPECT_EQ(requestedRange("Range: bytes=1-2\r\n"
+                           "If-Range: \"old\"\r\n", range),
+            http::range_status::WHOLE);
+}
+
+TEST(http, response_partial_content) {
+  validated_content content;
+  http::response r;
+  r.set_status_code(http::response::status_code::PARTIAL_CONTENT);
+  r.set_content(&content);
+  r.set_range(http::byte_range{ 1, 3 });
+  EXPECT_EQ(r.serialize_header(),
+            "HTTP/1.1 206 Partial Content\r\n"
+            "Content-Length: 3\r\n"
+            "Content-Range: bytes 1-3/7\r\n"
+            "Content-Location: /main.js\r\n"
+            "Content-Type: text/javascript\r\n"
+            "ETag: \"abc\"\r\n"
+            "Last-Modified: Sun, 06 Nov 1994 08:49:37 GMT\r\n"
+            "\r\n");
+
+  ChunkCtx ctx;
+  SendSocket socket;
+  send_channel channel(ctx, socket);
+  auto task = sendResponse(channel, r);
+  task.start();
+  EXPECT_TRUE(task.result());
+  EXPECT_EQ(socket._bytes, r.serialize_header().size() + 3);
+}
+
+TEST(http, response_partial_content_sendfile) {
+  ChunkCtx ctx;
+  SendSocket socket;
+  send_channel channel(ctx, socket);
+  test_content content(4 * http::response::sendfile_threshold, 3);
+  http::response r;
+  r.set_status_code(http::response::status_code::PARTIAL_CONTENT);
+  r.set_content(&content);
+  r.set_range(http::byte_range{ 1000, 1000 + http::response::sendfile_threshold });
+
+  auto task = sendResponse(channel, r);
+  task.start();
+  EXPECT_TRUE(task.result());
+  EXPECT_EQ(socket._sendfiles, 1ull);
+  EXPECT_EQ(socket._bytes, r.serialize_header().size() +
+            http::response::sendfile_threshold + 1);
+}
+
+TEST(http, benchmark_request_allocations) {
+  std::string s = "GET /game.wasm HTTP/1.1\r\n"
+    "Host: localhost:8080\r\n"
+    "Accept: */*\r\n"
+    "Accept-Language: en-gb\r\n"
+    "Connection: keep-alive\r\n"
+    "Accept-Encoding: gzip, deflate, br\r\n"
+    "If-None-Match: \"def\", \"abc\"\r\n"
+    "Referer: http://localhost:8080/\r\n"
+    "User-Agent: Mozilla/5.0 (Macintosh; Intel Mac OS X 10_15_4) AppleWebKit/605.1.15 (KHTML, like Gecko) Version/13.1 Safari/605.1.15\r\n"
+    "\r\n";
+  validated_content c;
+  constexpr std::size_t count = 100000;
+  std::size_t notModified = 0;
+  auto before = allocations::count();
+  auto start = std::chrono::steady_clock::now();
+  for (std::size_t i = 0; i < count; ++i) {
+    http::request r;
+    http::request::parse(s, r);
+    if (r.get_header(http::request::header::HOST) &&
+        http::accepts_encoding(r, "gzip") &&
+        http::not_modified(r, c)) {
+      notModified++;
+    }
+  }
+  std::chrono::duration<double> seconds = std::chrono::steady_clock::now() - start;
+  auto allocated = allocations::count() - before;
+  std::cout << "http: " << count << " requests, "
+            << count / seconds.count() / 1000 << "k requests/s, "
+            << (double)allocated / count << " allocations per request"
+            << std::endl;
+  EXPECT_EQ(notModified, count);
+  EXPECT_EQ(allocated, 0ull);
+}
+
+////////////////////////////////////////////////////////////////////////////////
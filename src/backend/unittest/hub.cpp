@@ -0,0 +1,483 @@
+////////////////////////////////////////////////////////////////////////////////
+
+#include "../hub.hpp"
+#include "fdsocket.hpp"
+#include <gtest/gtest.h>
+#include <chrono>
+#include <memory>
+#include <string>
+#include <thread>
+#include <vector>
+#include <sys/socket.h>
+#include <unistd.h>
+
+////////////////////////////////////////////////////////////////////////////////
+
+namespace {
+struct MemoryCtx {};
+
+// Takes everything written at once
+struct MemorySocket {
+  coro::task<std::size_t>
+  async_write(MemoryCtx&, char const* buffer, std::size_t count) {
+    _written.insert(_written.end(), buffer, buffer + count);
+    co_return _closed ? 0 : count;
+  }
+  coro::task<std::size_t>
+  async_writev(MemoryCtx&, iovec const* buffers, int count) {
+    _writes++;
+    std::size_t bytes = 0;
+    for (int i = 0; i < count; ++i) {
+      auto data = static_cast<char const*>(buffers[i].iov_base);
+      _written.insert(_written.end(), data, data + buffers[i].iov_len);
+      bytes += buffers[i].iov_len;
+    }
+    co_return _closed ? 0 : bytes;
+  }
+  std::vector<char> _written;
+  std::size_t _writes = 0;
+  bool _closed = false;
+};
+
+using MemoryChannel = com::channel<MemoryCtx, MemorySocket>;
+using BlockingChannel = com::channel<FdCtx, FdGatherSocket>;
+
+websocket::shared_frame
+textFrame(std::string const& text) {
+  return websocket::encode(websocket::opcode::TEXT_FRAME,
+                           text.data(), text.size());
+}
+
+coro::sync_task<void>
+closeSender(websocket::sender& s) {
+  co_await s.close();
+}
+
+// Sends count messages, then waits until they are written
+coro::sync_task<bool>
+sendTick(websocket::sender& s, int count, std::size_t size) {
+  std::string payload(size, 'x');
+  for (int i = 0; i < count; ++i) {
+    if (!co_await s.async_send(websocket::opcode::TEXT_FRAME, payload)) {
+      co_return false;
+    }
+  }
+  co_return co_await s.flush();
+}
+
+// Writes count messages one by one
+template<typename channel_type>
+coro::sync_task<bool>
+writeTick(channel_type& channel, int count, std::size_t size) {
+  websocket::frame f;
+  f.fin = true;
+  f.code = websocket::opcode::TEXT_FRAME;
+  f.data.assign(size, 'x');
+  for (int i = 0; i < count; ++i) {
+    if (!co_await websocket::async_write(channel, f)) {
+      co_return false;
+    }
+  }
+  co_return true;
+}
+
+// Reads whatever the test says it did
+struct CountingReader {
+  std::size_t reads() const {
+    return _reads;
+  }
+  std::size_t _reads = 0;
+};
+
+void runUntilDone(event::scheduler& s, coro::sync_task<bool>& task) {
+  for (int i = 0; i < 100 && !task.done(); ++i) {
+    s.run_once();
+  }
+}
+}
+
+TEST(hub, encode) {
+  auto f = textFrame("Hey");
+  std::vector<char> expected{ (char)0x81, 0x03, 'H', 'e', 'y' };
+  EXPECT_EQ(*f, expected);
+  EXPECT_FALSE(websocket::is_control(f));
+  std::string large(300, 'x');
+  auto l = websocket::encode(websocket::opcode::BINARY_FRAME,
+                             large.data(), large.size());
+  ASSERT_EQ(l->size(), 304ull);
+  EXPECT_EQ((*l)[1], (char)126);
+  EXPECT_TRUE(websocket::is_control(
+    websocket::encode(websocket::opcode::PONG, nullptr, 0)));
+}
+
+TEST(hub, publish_shares_frame) {
+  event::scheduler s(event::scheduler::secondary);
+  websocket::hub h(s);
+  auto a = std::make_unique<websocket::subscriber>(h);
+  websocket::subscriber b(h);
+  websocket::subscriber c(h);
+  EXPECT_EQ(h.size(), 3ull);
+  auto f = textFrame("update");
+  h.publish(f, &b);
+  EXPECT_EQ(a->queued(), 1ull);
+  EXPECT_EQ(b.queued(), 0ull);
+  EXPECT_EQ(c.queued(), 1ull);
+  // Referenced, not copied
+  EXPECT_EQ(f.use_count(), 3);
+  a.reset();
+  EXPECT_EQ(h.size(), 2ull);
+  EXPECT_EQ(f.use_count(), 2);
+}
+
+TEST(hub, slow_subscriber_drops_oldest_data) {
+  event::scheduler s(event::scheduler::secondary);
+  websocket::hub h(s);
+  MemoryCtx ctx;
+  MemorySocket socket;
+  MemoryChannel channel(ctx, socket);
+  websocket::subscriber slow(h, 4);
+  auto pong = websocket::encode(websocket::opcode::PONG, nullptr, 0);
+  EXPECT_TRUE(slow.push(pong));
+  for (int i = 0; i < 5; ++i) {
+    h.publish(textFrame(std::to_string(i)));
+  }
+  EXPECT_EQ(slow.queued(), 4ull);
+  EXPECT_EQ(slow.dropped(), 2ull);
+
+  slow.start(channel);
+  // Everything queued goes out with one write
+  EXPECT_EQ(socket._writes, 1ull);
+  std::vector<char> expected{
+    (char)0x8A, 0x00,
+    (char)0x81, 0x01, '2',
+    (char)0x81, 0x01, '3',
+    (char)0x81, 0x01, '4'
+  };
+  EXPECT_EQ(socket._written, expected);
+}
+
+TEST(hub, writers_resumed_from_loop) {
+  event::scheduler s(event::scheduler::secondary);
+  websocket::hub h(s);
+  MemoryCtx ctx;
+  MemorySocket socket0;
+  MemorySocket socket1;
+  MemoryChannel channel0(ctx, socket0);
+  MemoryChannel channel1(ctx, socket1);
+  websocket::subscriber s0(h);
+  websocket::subscriber s1(h);
+  s0.start(channel0);
+  s1.start(channel1);
+
+  h.publish(textFrame("a"));
+  h.publish(textFrame("b"));
+  // Not from within publish()
+  EXPECT_TRUE(socket0._written.empty());
+  s.run_once();
+  std::vector<char> expected{ (char)0x81, 0x01, 'a', (char)0x81, 0x01, 'b' };
+  EXPECT_EQ(socket0._written, expected);
+  EXPECT_EQ(socket1._written, expected);
+  EXPECT_EQ(socket0._writes, 1ull);
+
+  // Waits for the queued frames, then the writer ends
+  h.publish(textFrame("c"));
+  auto closing = closeSender(s0);
+  closing.start();
+  EXPECT_FALSE(closing.done());
+  s.run_once();
+  EXPECT_TRUE(closing.done());
+  EXPECT_EQ(socket0._written.size(), 9ull);
+  EXPECT_FALSE(s0.push(textFrame("d")));
+}
+
+TEST(hub, writer_failure_ends_close) {
+  event::scheduler s(event::scheduler::secondary);
+  websocket::hub h(s);
+  MemoryCtx ctx;
+  MemorySocket socket;
+  MemoryChannel channel(ctx, socket);
+  websocket::subscriber sub(h);
+  sub.start(channel);
+  auto closing = closeSender(sub);
+  {
+    websocket::subscriber other(h);
+    socket._closed = true;
+    h.publish(textFrame("lost"), &other);
+    s.run_once();
+  }
+  closing.start();
+  EXPECT_TRUE(closing.done());
+}
+
+TEST(hub, sender_coalesces_writes) {
+  event::scheduler s(event::scheduler::secondary);
+  websocket::hub h(s);
+  MemoryCtx ctx;
+  MemorySocket socket;
+  MemoryChannel channel(ctx, socket);
+  websocket::sender sender(h);
+  sender.start(channel);
+  auto tick = sendTick(sender, 100, 1);
+  tick.start();
+  // Queued beyond the capacity, nothing written from within async_send()
+  EXPECT_FALSE(tick.done());
+  EXPECT_EQ(sender.queued(), 100ull);
+  EXPECT_EQ(sender.dropped(), 0ull);
+  EXPECT_TRUE(socket._written.empty());
+  s.run_once();
+  ASSERT_TRUE(tick.done());
+  EXPECT_TRUE(tick.result());
+  EXPECT_EQ(socket._written.size(), 300ull);
+  // max_frames_per_write frames per write
+  EXPECT_EQ(socket._writes, 2ull);
+  EXPECT_EQ(sender.queued_bytes(), 0ull);
+}
+
+TEST(hub, sender_waits_above_high_water) {
+  event::scheduler s(event::scheduler::secondary);
+  websocket::hub h(s);
+  MemoryCtx ctx;
+  MemorySocket socket;
+  MemoryChannel channel(ctx, socket);
+  websocket::sender sender(h, 4, 500);
+  // 102 byte frames, the fifth exceeds the high water mark. Frames queued
+  // before start() wait for the writer.
+  auto tick = sendTick(sender, 10, 100);
+  tick.start();
+  EXPECT_FALSE(tick.done());
+  EXPECT_EQ(sender.queued(), 5ull);
+  EXPECT_EQ(sender.queued_bytes(), 510ull);
+  // Resumed from the loop once the writer got below half of it
+  sender.start(channel);
+  EXPECT_EQ(socket._writes, 1ull);
+  EXPECT_FALSE(tick.done());
+  runUntilDone(s, tick);
+  ASSERT_TRUE(tick.done());
+  EXPECT_TRUE(tick.result());
+  EXPECT_EQ(socket._written.size(), 1020ull);
+  EXPECT_EQ(sender.dropped(), 0ull);
+}
+
+TEST(hub, sender_failure_ends_send) {
+  event::scheduler s(event::scheduler::secondary);
+  websocket::hub h(s);
+  MemoryCtx ctx;
+  MemorySocket socket;
+  MemoryChannel channel(ctx, socket);
+  websocket::sender sender(h);
+  socket._closed = true;
+  sender.start(channel);
+  auto tick = sendTick(sender, 1, 1);
+  tick.start();
+  EXPECT_FALSE(tick.done());
+  s.run_once();
+  ASSERT_TRUE(tick.done());
+  EXPECT_FALSE(tick.result());
+  auto late = sendTick(sender, 1, 1);
+  late.start();
+  ASSERT_TRUE(late.done());
+  EXPECT_FALSE(late.result());
+  EXPECT_EQ(sender.queued(), 0ull);
+}
+
+TEST(hub, closed_sender_refuses_send) {
+  event::scheduler s(event::scheduler::secondary);
+  websocket::hub h(s);
+  websocket::sender sender(h);
+  auto closing = closeSender(sender);
+  closing.start();
+  EXPECT_TRUE(closing.done());
+  auto late = sendTick(sender, 1, 1);
+  late.start();
+  ASSERT_TRUE(late.done());
+  EXPECT_FALSE(late.result());
+  EXPECT_EQ(sender.queued(), 0ull);
+}
+
+TEST(hub, sender_refuses_second_producer) {
+  event::scheduler s(event::scheduler::secondary);
+  websocket::hub h(s);
+  MemoryCtx ctx;
+  MemorySocket socket;
+  MemoryChannel channel(ctx, socket);
+  websocket::sender sender(h, 4, 500);
+  auto first = sendTick(sender, 10, 100);
+  first.start();
+  EXPECT_FALSE(first.done());
+  EXPECT_EQ(sender.queued(), 5ull);
+  // Neither queued nor left waiting
+  auto second = sendTick(sender, 1, 1);
+  second.start();
+  ASSERT_TRUE(second.done());
+  EXPECT_FALSE(second.result());
+  EXPECT_EQ(sender.queued(), 5ull);
+  auto flushing = sendTick(sender, 0, 0);
+  flushing.start();
+  ASSERT_TRUE(flushing.done());
+  EXPECT_FALSE(flushing.result());
+  // The first one still finishes
+  sender.start(channel);
+  runUntilDone(s, first);
+  ASSERT_TRUE(first.done());
+  EXPECT_TRUE(first.result());
+  EXPECT_EQ(socket._written.size(), 1020ull);
+}
+
+TEST(hub, post_from_other_thread) {
+  event::scheduler s(event::scheduler::secondary);
+  websocket::hub h(s);
+  // Nobody to take it
+  h.post(textFrame("lost"));
+  websocket::subscriber sub(h);
+  std::thread producer([&h]() {
+    h.post(textFrame("posted"));
+  });
+  producer.join();
+  EXPECT_EQ(sub.queued(), 0ull);
+  for (int i = 0; i < 100 && sub.queued() == 0; ++i) {
+    s.run_once();
+  }
+  EXPECT_EQ(sub.queued(), 1ull);
+}
+
+TEST(hub, keepalive_pings_then_gives_up) {
+  event::scheduler s(event::scheduler::secondary);
+  websocket::hub h(s);
+  MemoryCtx ctx;
+  MemorySocket socket;
+  MemoryChannel channel(ctx, socket);
+  websocket::sender sender(h);
+  sender.start(channel);
+  int fds[2];
+  ASSERT_EQ(::socketpair(AF_UNIX, SOCK_STREAM, 0, fds), 0);
+  CountingReader reader;
+  websocket::keepalive keepalive(s.timeouts(0.01), reader, sender, fds[0]);
+  std::vector<char> ping{ (char)0x89, 0x00 };
+  auto runUntil = [&](auto condition) {
+    for (int i = 0; i < 100 && !condition(); ++i) {
+      s.run_once();
+    }
+  };
+
+  // Silent, so pinged
+  runUntil([&]() { return !socket._written.empty(); });
+  EXPECT_EQ(socket._written, ping);
+  // Answered, so not given up
+  reader._reads++;
+  runUntil([&]() { return socket._written.size() > 2; });
+  EXPECT_FALSE(keepalive.expired());
+  EXPECT_EQ(socket._written.size(), 4ull);
+  // Not answered
+  runUntil([&]() { return keepalive.expired(); });
+  EXPECT_TRUE(keepalive.expired());
+  char c;
+  EXPECT_EQ(::read(fds[1], &c, 1), 0);
+  ::close(fds[0]);
+  ::close(fds[1]);
+}
+
+TEST(hub, benchmark_fan_out) {
+  // Encoding a message once for all subscribers against a copy per subscriber
+  constexpr std::size_t subscribers = 10000;
+  constexpr int messages = 20;
+  event::scheduler s(event::scheduler::secondary);
+  websocket::hub h(s);
+  std::vector<std::unique_ptr<websocket::subscriber>> all;
+  for (std::size_t i = 0; i < subscribers; ++i) {
+    all.push_back(std::make_unique<websocket::subscriber>(h, messages));
+  }
+  std::cout << "hub: " << messages << " messages to " << subscribers
+            << " subscribers" << std::endl;
+  for (std::size_t size : { 64, 1024, 16384 }) {
+    std::string payload(size, 'x');
+    auto measure = [&](auto publish) {
+      auto begin = std::chrono::steady_clock::now();
+      for (int m = 0; m < messages; ++m) {
+        publish();
+      }
+      auto seconds = std::chrono::duration<double>(
+        std::chrono::steady_clock::now() - begin).count();
+      for (auto& sub : all) {
+        EXPECT_EQ(sub->queued(), (std::size_t)messages);
+      }
+      // Empties the queues
+      all.clear();
+      for (std::size_t i = 0; i < subscribers; ++i) {
+        all.push_back(std::make_unique<websocket::subscriber>(h, messages));
+      }
+      return seconds * 1e9 / (messages * subscribers);
+    };
+    auto shared = measure([&]() {
+      h.publish(websocket::encode(websocket::opcode::TEXT_FRAME,
+                                  payload.data(), payload.size()));
+    });
+    auto copied = measure([&]() {
+      for (auto& sub : all) {
+        sub->push(websocket::encode(websocket::opcode::TEXT_FRAME,
+                                    payload.data(), payload.size()));
+      }
+    });
+    std::cout << "  " << size << " byte payload: " << shared
+              << " ns/recipient shared, " << copied
+              << " ns/recipient copied" << std::endl;
+  }
+  all.clear();
+}
+
+TEST(hub, benchmark_ticks) {
+  // A tick of small messages to one connection, queued and flushed at once
+  // against a write per message
+  constexpr int ticks = 2000;
+  constexpr int messages = 100;
+  constexpr std::size_t size = 32;
+  std::cout << "hub: " << ticks << " ticks of " << messages << " "
+            << size << " byte messages" << std::endl;
+  auto measure = [&](char const* name, auto tick) {
+    int fds[2];
+    ASSERT_EQ(::socketpair(AF_UNIX, SOCK_STREAM, 0, fds), 0);
+    std::size_t received = 0;
+    std::thread drain([&]() {
+      char buffer[64 * 1024];
+      ssize_t bytes;
+      while ((bytes = ::read(fds[1], buffer, sizeof(buffer))) > 0) {
+        received += bytes;
+      }
+    });
+    event::scheduler s(event::scheduler::secondary);
+    websocket::hub h(s);
+    FdCtx ctx;
+    FdGatherSocket socket;
+    socket._fd = fds[0];
+    BlockingChannel channel(ctx, socket);
+    double seconds;
+    {
+      websocket::sender sender(h);
+      sender.start(channel);
+      auto begin = std::chrono::steady_clock::now();
+      for (int t = 0; t < ticks; ++t) {
+        auto task = tick(s, sender, channel);
+        task.start();
+        runUntilDone(s, task);
+        ASSERT_TRUE(task.done() && task.result());
+      }
+      seconds = std::chrono::duration<double>(
+        std::chrono::steady_clock::now() - begin).count();
+    }
+    ::shutdown(fds[0], SHUT_WR);
+    drain.join();
+    ::close(fds[0]);
+    ::close(fds[1]);
+    EXPECT_EQ(received, ticks * messages * (size + 2));
+    std::cout << "  " << name << ": "
+              << double(socket._syscalls) / ticks << " writes/tick, "
+              << ticks * messages / seconds / 1e6 << " M messages/s" << std::endl;
+  };
+  measure("sender", [&](auto&, websocket::sender& sender, auto&) {
+    return sendTick(sender, messages, size);
+  });
+  measure("per message", [&](auto&, websocket::sender&, auto& channel) {
+    return writeTick(channel, messages, size);
+  });
+}
+
+////////////////////////////////////////////////////////////////////////////////
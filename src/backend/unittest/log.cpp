@@ -0,0 +1,262 @@
+////////////////////////////////////////////////////////////////////////////////
+
+#include "../log.hpp"
+#include <gtest/gtest.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+#include <sstream>
+#include <iomanip>
+#include <chrono>
+#include <thread>
+#include <atomic>
+#include <vector>
+
+////////////////////////////////////////////////////////////////////////////////
+
+namespace {
+net::address
+ipv4(char const* host, int port) {
+  net::address a;
+  auto in = reinterpret_cast<sockaddr_in*>(&a.storage);
+  in->sin_family = AF_INET;
+  in->sin_port = htons(port);
+  inet_pton(AF_INET, host, &in->sin_addr);
+  a.length = sizeof(sockaddr_in);
+  return a;
+}
+
+std::string
+date(std::time_t time) {
+  std::tm local;
+  localtime_r(&time, &local);
+  std::stringstream ss;
+  ss << std::put_time(&local, "%Y-%m-%d %X");
+  return ss.str();
+}
+
+logging::record
+connectionRecord(char const* event, std::string detail = std::string()) {
+  logging::record r;
+  r.time = std::time(nullptr);
+  r.context = "https";
+  r.event = event;
+  r.detail = std::move(detail);
+  r.about.local = ipv4("127.0.0.1", 443);
+  r.about.remote = ipv4("10.0.0.2", 51234);
+  return r;
+}
+
+// Swallows everything, like a log nobody reads
+class null_buffer final : public std::streambuf {
+protected:
+  int overflow(int c) override { return c; }
+  std::streamsize xsputn(char const*, std::streamsize count) override {
+    return count;
+  }
+};
+
+// Holds the writer in its first write until it is opened
+class gate_buffer final : public std::streambuf {
+public:
+  std::atomic<bool> entered{false};
+  std::atomic<bool> open{false};
+protected:
+  int overflow(int c) override {
+    wait();
+    return c;
+  }
+  std::streamsize xsputn(char const*, std::streamsize count) override {
+    wait();
+    return count;
+  }
+private:
+  void wait() {
+    entered = true;
+    while (!open) {
+      std::this_thread::sleep_for(std::chrono::milliseconds(1));
+    }
+  }
+};
+}
+
+TEST(log, parse_level) {
+  logging::level l = logging::level::INFO;
+  EXPECT_TRUE(logging::parse_level("debug", l));
+  EXPECT_EQ(l, logging::level::DEBUG);
+  EXPECT_TRUE(logging::parse_level("error", l));
+  EXPECT_EQ(l, logging::level::ERROR);
+  EXPECT_FALSE(logging::parse_level("verbose", l));
+  EXPECT_EQ(l, logging::level::ERROR);
+}
+
+TEST(log, ring_full_and_empty) {
+  logging::ring<int> r(3);
+  EXPECT_EQ(r.capacity(), 4ull);
+  for (int i = 0; i < 4; ++i) {
+    EXPECT_TRUE(r.try_push(int(i)));
+  }
+  EXPECT_FALSE(r.try_push(4));
+  int value = -1;
+  EXPECT_TRUE(r.try_pop(value));
+  EXPECT_EQ(value, 0);
+  EXPECT_TRUE(r.try_push(4));
+  for (int i = 1; i < 5; ++i) {
+    EXPECT_TRUE(r.try_pop(value));
+    EXPECT_EQ(value, i);
+  }
+  EXPECT_FALSE(r.try_pop(value));
+  EXPECT_EQ(r.pushed(), 5ull);
+}
+
+TEST(log, ring_many_producers) {
+  constexpr int producers = 4;
+  constexpr int count = 20000;
+  logging::ring<int> r(64);
+  std::vector<std::thread> threads;
+  for (int p = 0; p < producers; ++p) {
+    threads.emplace_back([&r, p]() {
+      for (int i = 0; i < count; ++i) {
+        while (!r.try_push(p * count + i)) {
+          std::this_thread::yield();
+        }
+      }
+    });
+  }
+  // Every value arrives once, and each producer's values in order
+  std::vector<int> last(producers, -1);
+  long long sum = 0;
+  int received = 0;
+  while (received < producers * count) {
+    int value;
+    if (!r.try_pop(value)) {
+      continue;
+    }
+    EXPECT_GT(value % count, last[value / count]);
+    last[value / count] = value % count;
+    sum += value;
+    received++;
+  }
+  for (auto& thread : threads) {
+    thread.join();
+  }
+  long long n = producers * count;
+  EXPECT_EQ(sum, n * (n - 1) / 2);
+}
+
+TEST(log, formatter) {
+  logging::formatter f;
+  std::string out;
+  auto r = connectionRecord("note", ": timeout");
+  f.format(r, out);
+  EXPECT_EQ(out, date(r.time) + " - 127.0.0.1:443 <-> 10.0.0.2:51234"
+                 " - note(https): timeout\n");
+  out.clear();
+  r.about = logging::subject();
+  r.event = "begin";
+  r.context = "listener";
+  r.detail.clear();
+  f.format(r, out);
+  EXPECT_EQ(out, date(r.time) + " - <void> <-> <void> - begin(listener)\n");
+}
+
+TEST(log, sink) {
+  std::stringstream out;
+  {
+    logging::sink s(out, 16, logging::level::INFO);
+    EXPECT_FALSE(s.enabled(logging::level::DEBUG));
+    EXPECT_TRUE(s.enabled(logging::level::ERROR));
+    s.write(connectionRecord("begin"));
+    s.write(connectionRecord("fatal", "\nerror: Failed on purpose"));
+    s.write(connectionRecord("end"));
+    s.flush();
+    auto text = out.str();
+    EXPECT_NE(text.find("begin(https)\n"), std::string::npos);
+    EXPECT_NE(text.find("fatal(https)\nerror: Failed on purpose\n"),
+              std::string::npos);
+    EXPECT_EQ(text.find("end(https)\n") + 11, text.size());
+    s.set_level(logging::level::WARNING);
+    EXPECT_FALSE(s.enabled(logging::level::INFO));
+    // Written before the sink is gone
+    s.write(connectionRecord("last"));
+  }
+  EXPECT_NE(out.str().find("last(https)\n"), std::string::npos);
+}
+
+TEST(log, sink_counts_dropped_records) {
+  gate_buffer gate;
+  std::ostream out(&gate);
+  auto before = metrics::collect()[metrics::counter::LOG_RECORDS_DROPPED];
+  {
+    logging::sink s(out, 2);
+    // The writer is asleep by now, the record wakes it up
+    std::this_thread::sleep_for(std::chrono::milliseconds(10));
+    s.write(connectionRecord("taken"));
+    while (!gate.entered) {
+      std::this_thread::sleep_for(std::chrono::milliseconds(1));
+    }
+    s.write(connectionRecord("queued"));
+    s.write(connectionRecord("queued"));
+    s.write(connectionRecord("dropped"));
+    EXPECT_EQ(s.dropped(), 1ull);
+    EXPECT_EQ(metrics::collect()[metrics::counter::LOG_RECORDS_DROPPED],
+              before + 1);
+    gate.open = true;
+  }
+}
+
+TEST(log, benchmark_connection_logging) {
+  constexpr std::size_t count = 100000;
+  null_buffer nothing;
+  std::ostream out(&nothing);
+  auto subject = connectionRecord("").about;
+  // What every connection used to cost: a formatted date and addresses per
+  // line, and a flushing write for begin and end
+  auto begin = std::chrono::steady_clock::now();
+  for (std::size_t i = 0; i < count; ++i) {
+    for (char const* event : { "begin", "end" }) {
+      auto now = std::chrono::system_clock::now();
+      auto time = std::chrono::system_clock::to_time_t(now);
+      std::tm local;
+      localtime_r(&time, &local);
+      std::stringstream date;
+      date << std::put_time(&local, "%Y-%m-%d %X");
+      std::stringstream name;
+      name << subject.local << subject.arrow << subject.remote;
+      out << date.str() << " - " << name.str() << " - "
+          << event << "(https)" << std::endl;
+    }
+  }
+  auto synchronous = std::chrono::steady_clock::now() - begin;
+  // Bursts the writer keeps up with, as between two passes of the writer
+  constexpr std::size_t burst = 1000;
+  std::chrono::steady_clock::duration queued{};
+  std::size_t dropped;
+  {
+    logging::sink s(out, 4 * burst);
+    for (std::size_t i = 0; i < count; i += burst) {
+      begin = std::chrono::steady_clock::now();
+      for (std::size_t j = 0; j < burst; ++j) {
+        for (char const* event : { "begin", "end" }) {
+          s.write(logging::record{
+            std::time(nullptr), logging::level::INFO, "https", event, {},
+            subject
+          });
+        }
+      }
+      queued += std::chrono::steady_clock::now() - begin;
+      s.flush();
+    }
+    dropped = s.dropped();
+  }
+  auto perConnection = [](auto duration) {
+    return std::chrono::duration<double>(duration).count() * 1e9 / count;
+  };
+  std::cout << "log: " << count << " connections, begin and end" << std::endl;
+  std::cout << "  synchronous: " << perConnection(synchronous)
+            << " ns/connection" << std::endl;
+  std::cout << "  sink:        " << perConnection(queued)
+            << " ns/connection on the loop, " << dropped << " dropped"
+            << std::endl;
+}
+
+////////////////////////////////////////////////////////////////////////////////
@@ -0,0 +1,150 @@
+////////////////////////////////////////////////////////////////////////////////
+
+#include "../metrics.hpp"
+#include <gtest/gtest.h>
+#include <chrono>
+#include <thread>
+#include <vector>
+
+////////////////////////////////////////////////////////////////////////////////
+
+TEST(metrics, buckets) {
+  for (std::uint64_t v = 0; v < 100000; v += 1 + v / 50) {
+    auto i = metrics::buckets::index(v);
+    EXPECT_LE(metrics::buckets::lower(i), v);
+    EXPECT_GE(metrics::buckets::upper(i), v);
+    // Known within an eighth of the value
+    EXPECT_LE(metrics::buckets::upper(i) - metrics::buckets::lower(i), v / 8);
+  }
+  for (std::size_t i = 0; i + 1 < metrics::buckets::count; ++i) {
+    EXPECT_EQ(metrics::buckets::upper(i) + 1, metrics::buckets::lower(i + 1));
+  }
+  EXPECT_EQ(metrics::buckets::index(UINT64_MAX), metrics::buckets::count - 1);
+}
+
+TEST(metrics, counters_of_all_threads) {
+  auto before = metrics::collect();
+  std::vector<std::thread> threads;
+  for (int t = 0; t < 4; ++t) {
+    threads.emplace_back([]() {
+      for (int i = 0; i < 1000; ++i) {
+        metrics::add(metrics::counter::BYTES_IN, 10);
+        metrics::count_response(200);
+      }
+      metrics::count_response(404);
+      metrics::count_response(1000);
+    });
+  }
+  for (auto& thread : threads) {
+    thread.join();
+  }
+  {
+    metrics::scoped_gauge active(metrics::counter::ACTIVE);
+    auto during = metrics::collect();
+    EXPECT_EQ(during[metrics::counter::ACTIVE],
+              before[metrics::counter::ACTIVE] + 1);
+  }
+  auto after = metrics::collect();
+  EXPECT_EQ(after[metrics::counter::BYTES_IN] - before[metrics::counter::BYTES_IN],
+            40000);
+  EXPECT_EQ(after.responses[200] - before.responses[200], 4000ull);
+  EXPECT_EQ(after.responses[404] - before.responses[404], 4ull);
+  EXPECT_EQ(after.responses[599] - before.responses[599], 4ull);
+  EXPECT_EQ(after[metrics::counter::ACTIVE], before[metrics::counter::ACTIVE]);
+}
+
+TEST(metrics, quantiles) {
+  metrics::snapshot::distribution d;
+  EXPECT_EQ(d.quantile(0.5), 0ull);
+  // One to thousand microseconds
+  for (std::uint64_t us = 1; us <= 1000; ++us) {
+    d.counts[metrics::buckets::index(us * 1000)]++;
+    d.count++;
+  }
+  auto near = [](std::uint64_t value, std::uint64_t expected) {
+    return value >= expected && value <= expected + expected / 8;
+  };
+  EXPECT_TRUE(near(d.quantile(0.5), 500000)) << d.quantile(0.5);
+  EXPECT_TRUE(near(d.quantile(0.99), 990000)) << d.quantile(0.99);
+  EXPECT_TRUE(near(d.quantile(1.), 1000000)) << d.quantile(1.);
+  EXPECT_TRUE(near(d.quantile(0.), 1000)) << d.quantile(0.);
+}
+
+TEST(metrics, prometheus) {
+  metrics::snapshot s;
+  s.counters[(std::size_t)metrics::counter::ACCEPTED] = 3;
+  s.responses[200] = 2;
+  auto& requests = s.histograms[(std::size_t)metrics::histogram::REQUEST];
+  // 3 us, 3 us and 5 ms
+  for (std::uint64_t ns : { 3000, 3000, 5000000 }) {
+    requests.counts[metrics::buckets::index(ns)]++;
+    requests.count++;
+    requests.sum += ns;
+  }
+  auto text = metrics::prometheus(s);
+  EXPECT_NE(text.find("# TYPE ld48_connections_accepted_total counter\n"
+                      "ld48_connections_accepted_total 3\n"), std::string::npos);
+  EXPECT_NE(text.find("ld48_responses_total{code=\"200\"} 2\n"), std::string::npos);
+  EXPECT_EQ(text.find("code=\"404\""), std::string::npos);
+  EXPECT_NE(text.find("ld48_request_duration_seconds_bucket{le=\"2.048e-06\"} 0\n"),
+            std::string::npos);
+  EXPECT_NE(text.find("ld48_request_duration_seconds_bucket{le=\"4.096e-06\"} 2\n"),
+            std::string::npos);
+  EXPECT_NE(text.find("ld48_request_duration_seconds_bucket{le=\"0.004194304\"} 2\n"),
+            std::string::npos);
+  EXPECT_NE(text.find("ld48_request_duration_seconds_bucket{le=\"0.008388608\"} 3\n"),
+            std::string::npos);
+  EXPECT_NE(text.find("ld48_request_duration_seconds_bucket{le=\"+Inf\"} 3\n"
+                      "ld48_request_duration_seconds_sum 0.005006\n"
+                      "ld48_request_duration_seconds_count 3\n"),
+            std::string::npos);
+
+  auto json = metrics::json(s);
+  EXPECT_EQ(json.front(), '{');
+  EXPECT_NE(json.find("\"connections_accepted_total\":3,"), std::string::npos);
+  EXPECT_NE(json.find("\"responses_total\":{\"200\":2}"), std::string::npos);
+  EXPECT_NE(json.find("\"request_duration_seconds\":{\"count\":3,"),
+            std::string::npos);
+}
+
+TEST(metrics, benchmark_request_accounting) {
+  // What a request costs the metrics: its status, its latency and its bytes.
+  // Compared to one shared atomic counter per metric.
+  constexpr int count = 1000000;
+  auto perRequest = [](auto f, int threads) {
+    std::vector<std::thread> workers;
+    auto begin = std::chrono::steady_clock::now();
+    for (int t = 0; t < threads; ++t) {
+      workers.emplace_back(f);
+    }
+    for (auto& worker : workers) {
+      worker.join();
+    }
+    auto duration = std::chrono::steady_clock::now() - begin;
+    return std::chrono::duration<double>(duration).count() * 1e9 / count;
+  };
+  static std::atomic<std::uint64_t> shared[4];
+  std::cout << "metrics: " << count << " requests per thread" << std::endl;
+  for (int threads : { 1, 4 }) {
+    auto sharded = perRequest([]() {
+      for (int i = 0; i < count; ++i) {
+        metrics::count_response(200);
+        metrics::record(metrics::histogram::REQUEST, 20000 + i % 1000);
+        metrics::add(metrics::counter::BYTES_IN, 400);
+        metrics::add(metrics::counter::BYTES_OUT, 2000);
+      }
+    }, threads);
+    auto contended = perRequest([]() {
+      for (int i = 0; i < count; ++i) {
+        for (auto& c : shared) {
+          c.fetch_add(1, std::memory_order_relaxed);
+        }
+      }
+    }, threads);
+    std::cout << "  " << threads << " threads: " << sharded
+              << " ns/request sharded, " << contended
+              << " ns/request with shared atomics" << std::endl;
+  }
+}
+
+////////////////////////////////////////////////////////////////////////////////
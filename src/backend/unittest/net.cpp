@@ -0,0 +1,184 @@
+////////////////////////////////////////////////////////////////////////////////
+
+#include "../net.hpp"
+#include <gtest/gtest.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <errno.h>
+#include <vector>
+#include <chrono>
+#include <thread>
+
+////////////////////////////////////////////////////////////////////////////////
+
+namespace {
+net::socket
+listenOnLoopback(int backlog) {
+  // The kernel picks a free port
+  net::address_options options(net::IPv4, net::TCP, "127.0.0.1", "0");
+  return net::socket(*options.begin(), backlog);
+}
+
+// Non-blocking clients that connect without waiting for the handshake, like
+// a burst of browsers would
+struct Clients {
+  explicit Clients(net::socket const& listener) {
+    socklen_t length = sizeof(address);
+    EXPECT_EQ(::getsockname(listener.fd(), (sockaddr*)&address, &length), 0);
+  }
+  ~Clients() {
+    for (auto fd : fds) {
+      ::close(fd);
+    }
+  }
+  void connect(std::size_t count) {
+    for (std::size_t i = 0; i < count; ++i) {
+      int fd = ::socket(AF_INET, SOCK_STREAM, 0);
+      ASSERT_GE(fd, 0);
+      ::fcntl(fd, F_SETFL, ::fcntl(fd, F_GETFL) | O_NONBLOCK);
+      auto result = ::connect(fd, (sockaddr*)&address, sizeof(address));
+      EXPECT_TRUE(result == 0 || errno == EINPROGRESS);
+      fds.push_back(fd);
+    }
+  }
+  sockaddr_in address;
+  std::vector<int> fds;
+};
+
+// Same as the server's acceptor, but keeps the clients instead of serving them
+coro::sync_task<void>
+acceptBatches(event::scheduler& s, net::socket& listener, std::size_t batch,
+              std::vector<net::socket>& accepted, std::size_t& batches) {
+  while (true) {
+    auto client = co_await listener.async_accept(s);
+    batches++;
+    std::size_t count = 0;
+    while (client) {
+      accepted.push_back(std::move(client));
+      if (++count == batch) {
+        break;
+      }
+      client = listener.accept();
+    }
+    if (count == batch) {
+      co_await event::timer(s, 0.);
+    }
+  }
+}
+
+coro::sync_task<void>
+sleep(event::scheduler& s, ev_tstamp seconds) {
+  co_await event::timer(s, seconds);
+}
+
+struct Burst {
+  std::size_t accepted;
+  std::size_t batches;
+  double seconds;
+};
+
+Burst
+acceptBurst(int backlog, std::size_t count, std::size_t batch) {
+  event::scheduler s(event::scheduler::secondary);
+  auto listener = listenOnLoopback(backlog);
+  Clients clients(listener);
+  std::vector<net::socket> accepted;
+  std::size_t batches = 0;
+  auto begin = std::chrono::steady_clock::now();
+  clients.connect(count);
+  auto task = acceptBatches(s, listener, batch, accepted, batches);
+  task.start();
+  // Clients the backlog had no room for retry their SYN after a second
+  auto deadline = begin + std::chrono::seconds(2);
+  while (accepted.size() < count && std::chrono::steady_clock::now() < deadline) {
+    auto tick = sleep(s, 0.01);
+    tick.start();
+    s.run_once();
+  }
+  auto end = std::chrono::steady_clock::now();
+  return Burst {
+    accepted.size(), batches,
+    std::chrono::duration<double>(end - begin).count()
+  };
+}
+}
+
+TEST(net, accept_without_pending) {
+  auto listener = listenOnLoopback(16);
+  EXPECT_FALSE(listener.accept());
+}
+
+TEST(net, accept_nonblocking) {
+  auto listener = listenOnLoopback(16);
+  Clients clients(listener);
+  clients.connect(1);
+  auto client = listener.accept();
+  for (int i = 0; i < 100 && !client; ++i) {
+    std::this_thread::sleep_for(std::chrono::milliseconds(1));
+    client = listener.accept();
+  }
+  ASSERT_TRUE(client);
+  EXPECT_TRUE(::fcntl(client.fd(), F_GETFL) & O_NONBLOCK);
+  EXPECT_TRUE(::fcntl(client.fd(), F_GETFD) & FD_CLOEXEC);
+  EXPECT_FALSE(listener.accept());
+}
+
+TEST(net, accepted_local_address) {
+  net::address_options options(net::IPv4, net::TCP, "0.0.0.0", "0");
+  net::socket listener(*options.begin(), 16);
+  Clients clients(listener);
+  clients.address.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+  clients.connect(1);
+  auto client = listener.accept();
+  for (int i = 0; i < 100 && !client; ++i) {
+    std::this_thread::sleep_for(std::chrono::milliseconds(1));
+    client = listener.accept();
+  }
+  ASSERT_TRUE(client);
+  // Where the client connected to, not the wildcard of the listener
+  auto& local = client.local_address();
+  ASSERT_EQ(local.storage.ss_family, AF_INET);
+  auto in = reinterpret_cast<sockaddr_in const*>(&local.storage);
+  EXPECT_EQ(in->sin_addr.s_addr, htonl(INADDR_LOOPBACK));
+  EXPECT_EQ(in->sin_port, clients.address.sin_port);
+}
+
+TEST(net, accept_batches) {
+  event::scheduler s(event::scheduler::secondary);
+  auto listener = listenOnLoopback(16);
+  Clients clients(listener);
+  clients.connect(10);
+  // Loopback handshakes complete right away
+  std::this_thread::sleep_for(std::chrono::milliseconds(50));
+  std::vector<net::socket> accepted;
+  std::size_t batches = 0;
+  auto task = acceptBatches(s, listener, 4, accepted, batches);
+  task.start();
+  EXPECT_EQ(accepted.size(), 4ull);
+  s.run_once();
+  EXPECT_EQ(accepted.size(), 8ull);
+  s.run_once();
+  EXPECT_EQ(accepted.size(), 10ull);
+  EXPECT_EQ(batches, 3ull);
+  EXPECT_FALSE(task.done());
+}
+
+TEST(net, benchmark_accept_burst) {
+  constexpr std::size_t count = 500;
+  std::cout << "accept: burst of " << count << " connections" << std::endl;
+  struct { int backlog; std::size_t batch; } setups[] = {
+    { 10, 64 }, { SOMAXCONN, 1 }, { SOMAXCONN, 64 }
+  };
+  for (auto& setup : setups) {
+    auto burst = acceptBurst(setup.backlog, count, setup.batch);
+    std::cout << "  backlog " << setup.backlog << ", batch " << setup.batch
+              << ": " << burst.accepted << " accepted in " << burst.batches
+              << " batches, " << burst.accepted / burst.seconds
+              << " connections/s" << std::endl;
+    EXPECT_GT(burst.accepted, 0ull);
+  }
+}
+
+////////////////////////////////////////////////////////////////////////////////
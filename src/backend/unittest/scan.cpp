@@ -0,0 +1,202 @@
+////////////////////////////////////////////////////////////////////////////////
+
+#include "../scan.hpp"
+#include "../http.hpp"
+#include <gtest/gtest.h>
+#include <chrono>
+#include <random>
+#include <string>
+
+////////////////////////////////////////////////////////////////////////////////
+
+namespace {
+// Bytes that end or break a run somewhere, and some that do not
+constexpr char interesting[] = {
+  0x00, 0x08, 0x09, 0x0a, 0x0d, 0x1f, ' ', '!', '"', '(', ')', ',', '/', '0',
+  ':', ';', '@', 'A', '[', '\\', ']', '^', '`', 'z', '{', '|', '}', '~',
+  0x7f, (char)0x80, (char)0xff
+};
+}
+
+TEST(scan, prefix_matches_scalar) {
+  std::string tokens = "Accept-Encoding!#$%&'*+-.^_`|~0123456789";
+  std::string content = "text/html, \t*/*;q=0.8 (KHTML, like Gecko) \"etag\"";
+  while (tokens.size() < 100) {
+    tokens += tokens;
+  }
+  while (content.size() < 100) {
+    content += content;
+  }
+  for (std::size_t size = 0; size <= 100; ++size) {
+    for (std::size_t position = 0; position < size; ++position) {
+      for (auto c : interesting) {
+        auto t = tokens.substr(0, size);
+        t[position] = c;
+        EXPECT_EQ(scan::tcharPrefix(t), scan::scalar::tcharPrefix(t));
+        auto v = content.substr(0, size);
+        v[position] = c;
+        EXPECT_EQ(scan::vcharPrefix(v), scan::scalar::vcharPrefix(v));
+      }
+    }
+    EXPECT_EQ(scan::tcharPrefix(tokens.substr(0, size)), size);
+    EXPECT_EQ(scan::vcharPrefix(content.substr(0, size)), size);
+  }
+}
+
+TEST(scan, prefix_all_bytes) {
+  for (int c = 0; c < 256; ++c) {
+    std::string block(64, (char)c);
+    std::size_t expectedT = scan::isTCHAR((char)c) ? block.size() : 0;
+    std::size_t expectedV = scan::isVCHAR((char)c) ? block.size() : 0;
+    EXPECT_EQ(scan::tcharPrefix(block), expectedT) << c;
+    EXPECT_EQ(scan::vcharPrefix(block), expectedV) << c;
+  }
+}
+
+TEST(scan, parse_mutated_requests) {
+  std::string s = "GET /index.html HTTP/1.1\r\n"
+    "Host: localhost:8080\r\n"
+    "Accept-Encoding: gzip, deflate, br\r\n"
+    "User-Agent: Mozilla/5.0 (Macintosh; Intel Mac OS X 10_15_4)\r\n"
+    "\r\n";
+  // Whatever the parser accepts, it accepts with the character classes of
+  // the scalar checks.
+  for (std::size_t position = 0; position < s.size(); ++position) {
+    for (auto c : interesting) {
+      auto m = s;
+      m[position] = c;
+      http::request r;
+      std::size_t size = 0;
+      try {
+        size = http::request::parse(m, r);
+      } catch (std::runtime_error&) {
+        continue;
+      }
+      if (size == 0) {
+        continue;
+      }
+      for (auto& h : r.get_headers()) {
+        EXPECT_EQ(scan::scalar::tcharPrefix(h.first), h.first.size()) << m;
+        EXPECT_EQ(scan::scalar::vcharPrefix(h.second), h.second.size()) << m;
+      }
+      EXPECT_EQ(scan::scalar::vcharPrefix(r.get_uri()), r.get_uri().size());
+    }
+  }
+}
+
+namespace {
+struct Parsed {
+  std::size_t size = 0;
+  std::string error;
+  http::request request;
+};
+
+Parsed
+parseWith(std::size_t (*parse)(std::string_view, http::request&),
+          std::string const& data) {
+  Parsed p;
+  try {
+    p.size = parse(data, p.request);
+  } catch (std::runtime_error& err) {
+    p.error = err.what();
+  }
+  return p;
+}
+}
+
+TEST(scan, parse_matches_scalar_parse) {
+  std::string const requests[] = {
+    "GET /index.html HTTP/1.1\r\n"
+    "Host: localhost:8080\r\n"
+    "Accept-Encoding: gzip, deflate, br\r\n"
+    "User-Agent: Mozilla/5.0 (Macintosh; Intel Mac OS X 10_15_4)\r\n"
+    "\r\n",
+    "HEAD /assets/sprites/player-walking-animation.png?version=1234 HTTP/1.1\r\n"
+    "If-None-Match: \"0123456789abcdef\"\r\n"
+    "X-Folded-Field-With-A-Long-Name: first part\r\n"
+    " \tsecond part\r\n"
+    "\r\n"
+  };
+  // Every byte replaced, so that each of them ends a block somewhere. Both
+  // accept and reject the same requests, and agree on what they parsed.
+  for (auto& s : requests) {
+    for (std::size_t position = 0; position < s.size(); ++position) {
+      for (auto c : interesting) {
+        auto m = s;
+        m[position] = c;
+        auto vector = parseWith(http::request::parse, m);
+        auto scalar = parseWith(http::request::parse_scalar, m);
+        ASSERT_EQ(vector.error, scalar.error) << m;
+        ASSERT_EQ(vector.size, scalar.size) << m;
+        if (vector.size == 0) {
+          continue;
+        }
+        EXPECT_EQ(vector.request.get_method(), scalar.request.get_method());
+        EXPECT_EQ(vector.request.get_uri(), scalar.request.get_uri());
+        auto vectorFields = vector.request.get_headers();
+        auto scalarFields = scalar.request.get_headers();
+        ASSERT_EQ(vectorFields.size(), scalarFields.size()) << m;
+        for (std::size_t i = 0; i < vectorFields.size(); ++i) {
+          EXPECT_EQ(vectorFields[i].first, scalarFields[i].first) << m;
+          EXPECT_EQ(vectorFields[i].second, scalarFields[i].second) << m;
+        }
+      }
+    }
+  }
+}
+
+TEST(scan, benchmark_parse) {
+  std::string s = "GET /game.wasm HTTP/1.1\r\n"
+    "Host: localhost:8080\r\n"
+    "Accept: */*\r\n"
+    "Accept-Language: en-gb\r\n"
+    "Connection: keep-alive\r\n"
+    "Accept-Encoding: gzip, deflate, br\r\n"
+    "Referer: http://localhost:8080/\r\n"
+    "User-Agent: Mozilla/5.0 (Macintosh; Intel Mac OS X 10_15_4) AppleWebKit/605.1.15 (KHTML, like Gecko) Version/13.1 Safari/605.1.15\r\n"
+    "\r\n";
+  constexpr std::size_t count = 100000;
+  // Starts at varying offsets, so the work cannot be hoisted out of the loop
+  auto measure = [](auto f) {
+    auto start = std::chrono::steady_clock::now();
+    for (std::size_t i = 0; i < count; ++i) {
+      f(i % 2);
+    }
+    std::chrono::duration<double> seconds = std::chrono::steady_clock::now() - start;
+    return seconds.count();
+  };
+  // Line by line, like the parser
+  std::size_t sink = 0;
+  auto lines = [&](auto prefix, std::size_t offset) {
+    std::string_view block(s);
+    for (auto pos = offset; pos < block.size(); ) {
+      pos += prefix(block.substr(pos)) + 2;
+      sink += pos;
+    }
+  };
+  auto scalar = measure([&](std::size_t offset) {
+    lines(scan::scalar::vcharPrefix, offset);
+  });
+  auto vector = measure([&](std::size_t offset) {
+    lines([](std::string_view str) { return scan::vcharPrefix(str); }, offset);
+  });
+  auto parse = measure([&](std::size_t) {
+    http::request r;
+    sink += http::request::parse(s, r);
+  });
+  auto scalarParse = measure([&](std::size_t) {
+    http::request r;
+    sink += http::request::parse_scalar(s, r);
+  });
+  auto megabytes = (double)count * s.size() / 1e6;
+  std::cout << "scan: " << count << " requests of " << s.size() << " bytes" << std::endl;
+  std::cout << "  scalar scan " << megabytes / scalar << " MB/s, "
+            << scan::implementation << " scan " << megabytes / vector << " MB/s"
+            << std::endl;
+  std::cout << "  request::parse " << megabytes / parse << " MB/s, "
+            << count / parse / 1000 << "k requests/s, with scalar scans "
+            << megabytes / scalarParse << " MB/s" << std::endl;
+  EXPECT_GT(sink, 0ull);
+}
+
+////////////////////////////////////////////////////////////////////////////////
@@ -0,0 +1,55 @@
+////////////////////////////////////////////////////////////////////////////////
+
+#include "../tls.hpp"
+#include <gtest/gtest.h>
+#include <thread>
+#include <vector>
+
+////////////////////////////////////////////////////////////////////////////////
+
+TEST(tls, random_bytes) {
+  std::vector<unsigned char> a(1000, 0);
+  std::vector<unsigned char> b(1000, 0);
+  crypto::random_bytes(a.data(), a.size());
+  crypto::random_bytes(b.data(), b.size());
+  EXPECT_NE(a, b);
+  // Also past the 256 bytes of the first call
+  EXPECT_NE(std::vector<unsigned char>(a.begin() + 744, a.end()),
+            std::vector<unsigned char>(256, 0));
+}
+
+TEST(tls, sessions_rotation) {
+  crypto::sessions sessions(7200);
+  EXPECT_EQ(sessions.rotation_interval(), 3600);
+  EXPECT_EQ(sessions.next_rotation(36000), 3600);
+  EXPECT_EQ(sessions.next_rotation(36001), 3599);
+  EXPECT_EQ(sessions.next_rotation(39599), 1);
+
+  auto first = sessions.key(36000);
+  EXPECT_EQ(first.first, 10u);
+  EXPECT_EQ(sessions.key(39599), first);
+  auto second = sessions.key(39600);
+  EXPECT_EQ(second.first, 11u);
+  EXPECT_NE(second.second, first.second);
+  // A late shard still gets the key of the previous period
+  EXPECT_EQ(sessions.key(36000), first);
+}
+
+TEST(tls, sessions_share_keys_between_threads) {
+  crypto::sessions sessions(60);
+  std::vector<crypto::ticket_key> keys(8);
+  std::vector<std::thread> threads;
+  for (std::size_t i = 0; i < keys.size(); ++i) {
+    threads.emplace_back([&sessions, &keys, i]() {
+      keys[i] = sessions.key(1000000).second;
+    });
+  }
+  for (auto& thread : threads) {
+    thread.join();
+  }
+  for (auto& key : keys) {
+    EXPECT_EQ(key, keys.front());
+  }
+}
+
+////////////////////////////////////////////////////////////////////////////////
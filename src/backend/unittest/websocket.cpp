@@ -1,8 +1,14 @@
 ////////////////////////////////////////////////////////////////////////////////
 
 #include "../websocket.hpp"
+#include "fdsocket.hpp"
 #include <gtest/gtest.h>
 #include <algorithm>
+#include <thread>
+#include <chrono>
+#include <cstring>
+#include <sys/socket.h>
+#include <unistd.h>
 
 ////////////////////////////////////////////////////////////////////////////////
 
@@ -484,3 +490,468 @@ TEST(websocket, sequence_close_handshake) {
   EXPECT_TRUE(task.result());
   ASSERT_EQ(frames.size(), 0ull);
 }
+
+namespace {
+template<typename socket_type>
+coro::sync_task<bool>
+pushFrames(com::channel<FdCtx, socket_type>& channel, std::size_t count,
+           std::size_t size) {
+  websocket::frame f;
+  f.code = websocket::opcode::BINARY_FRAME;
+  f.data.resize(size, 'x');
+  for (std::size_t i = 0; i < count; ++i) {
+    if (!co_await websocket::async_write(channel, f)) {
+      co_return false;
+    }
+  }
+  co_return true;
+}
+
+struct FrameThroughput {
+  std::size_t syscalls;
+  double seconds;
+};
+
+template<typename socket_type>
+FrameThroughput
+writeFrames(std::size_t count, std::size_t size) {
+  int fds[2];
+  EXPECT_EQ(::socketpair(AF_UNIX, SOCK_STREAM, 0, fds), 0);
+  std::size_t expected = count * (size + 2);
+  std::thread drain([fd = fds[1], expected]() {
+    char buffer[64 * 1024];
+    std::size_t received = 0;
+    while (received < expected) {
+      auto bytes = ::read(fd, buffer, sizeof(buffer));
+      if (bytes <= 0) {
+        break;
+      }
+      received += bytes;
+    }
+  });
+  FdCtx ctx;
+  socket_type socket;
+  socket._fd = fds[0];
+  com::channel<FdCtx, socket_type> channel(ctx, socket);
+  auto begin = std::chrono::steady_clock::now();
+  auto task = pushFrames(channel, count, size);
+  task.start();
+  EXPECT_TRUE(task.result());
+  drain.join();
+  auto end = std::chrono::steady_clock::now();
+  ::close(fds[0]);
+  ::close(fds[1]);
+  return FrameThroughput {
+    socket._syscalls, std::chrono::duration<double>(end - begin).count()
+  };
+}
+}
+
+TEST(websocket, frame_single_gather_write) {
+  FdCtx ctx;
+  FdGatherSocket socket;
+  int fds[2];
+  ASSERT_EQ(::socketpair(AF_UNIX, SOCK_STREAM, 0, fds), 0);
+  socket._fd = fds[0];
+  com::channel<FdCtx, FdGatherSocket> channel(ctx, socket);
+
+  auto task = pushFrames(channel, 1, 300);
+  task.start();
+  EXPECT_TRUE(task.result());
+  EXPECT_EQ(socket._syscalls, 1ull);
+  char buffer[512];
+  EXPECT_EQ(::read(fds[1], buffer, sizeof(buffer)), 304);
+  EXPECT_EQ(buffer[0], (char)0x82);
+  EXPECT_EQ(buffer[1], (char)126);
+  EXPECT_EQ(buffer[303], 'x');
+  ::close(fds[0]);
+  ::close(fds[1]);
+}
+
+TEST(websocket, benchmark_small_frames) {
+  constexpr std::size_t count = 100000;
+  std::cout << "websocket: " << count << " frames" << std::endl;
+  for (std::size_t size : { 16, 64, 125 }) {
+    auto separate = writeFrames<FdSocket>(count, size);
+    auto gathered = writeFrames<FdGatherSocket>(count, size);
+    std::cout << "  " << size << " byte payload: "
+              << "header + payload " << count / separate.seconds / 1000
+              << "k frames/s (" << separate.syscalls << " syscalls), "
+              << "gather write " << count / gathered.seconds / 1000
+              << "k frames/s (" << gathered.syscalls << " syscalls)"
+              << std::endl;
+    EXPECT_EQ(separate.syscalls, 2 * count);
+    EXPECT_EQ(gathered.syscalls, count);
+  }
+}
+
+TEST(websocket, unmask) {
+  char const key[4] = { 0x12, 0x34, 0x56, (char)0x9A };
+  std::vector<char> payload(200);
+  for (std::size_t i = 0; i < payload.size(); ++i) {
+    payload[i] = (char)(i * 7);
+  }
+  for (std::size_t offset = 0; offset < 4; ++offset) {
+    for (std::size_t count = 0; count <= 100; ++count) {
+      for (std::size_t start : { 0, 1, 5 }) {
+        auto data = payload;
+        websocket::unmask(data.data() + start, count, key, offset);
+        for (std::size_t i = 0; i < data.size(); ++i) {
+          char expected = payload[i];
+          if (i >= start && i < start + count) {
+            expected ^= key[(offset + i - start) % 4];
+          }
+          ASSERT_EQ(data[i], expected) << "offset " << offset << " count "
+                                       << count << " at " << i;
+        }
+      }
+    }
+  }
+}
+
+TEST(websocket, buffer_pool) {
+  websocket::buffer_pool pool(2, 1024);
+  auto a = pool.acquire(100);
+  auto b = pool.acquire(200);
+  EXPECT_EQ(a.size(), 100ull);
+  EXPECT_EQ(pool.allocations(), 2ull);
+  auto data = b.data();
+  pool.release(std::move(b));
+  EXPECT_TRUE(b.empty());
+  auto c = pool.acquire(150);
+  EXPECT_EQ(c.data(), data);
+  EXPECT_EQ(c.size(), 150ull);
+  EXPECT_EQ(pool.allocations(), 2ull);
+  // Too large to be kept
+  pool.release(pool.acquire(2000));
+  EXPECT_EQ(pool.allocations(), 3ull);
+  pool.release(pool.acquire(10));
+  EXPECT_EQ(pool.allocations(), 4ull);
+}
+
+namespace {
+// Serves reads from memory
+struct MemoryReadSocket {
+  coro::task<std::size_t>
+  async_read(FdCtx&, char* buffer, std::size_t count) {
+    auto bytes = std::min(count, _data.size() - _offset);
+    std::memcpy(buffer, _data.data() + _offset, bytes);
+    _offset += bytes;
+    co_return bytes;
+  }
+  std::vector<char> _data;
+  std::size_t _offset = 0;
+};
+
+using MemoryReadChannel = com::channel<FdCtx, MemoryReadSocket>;
+
+// Appends a masked frame, as clients send them
+void
+appendMaskedFrame(std::vector<char>& out, websocket::opcode code,
+                  std::vector<char> const& payload, bool fin = true) {
+  char header[websocket::max_header_size];
+  auto headerSize = websocket::encode_header(header, fin, code, payload.size());
+  header[1] |= (char)0x80;
+  out.insert(out.end(), header, header + headerSize);
+  char const key[4] = { 0x0F, 0x1E, 0x2D, 0x3C };
+  out.insert(out.end(), key, key + 4);
+  auto begin = out.size();
+  out.insert(out.end(), payload.begin(), payload.end());
+  websocket::unmask(out.data() + begin, payload.size(), key);
+}
+
+// Reads frames until the end of the data, each into a frame of its own like
+// stream() does
+coro::sync_task<std::size_t>
+readAll(MemoryReadChannel& channel, websocket::buffer_pool* pool,
+        std::size_t& bytes) {
+  std::size_t count = 0;
+  while (true) {
+    websocket::frame f;
+    if (!co_await websocket::async_read(channel, f, pool)) {
+      break;
+    }
+    bytes += f.data.size();
+    count++;
+    if (pool != nullptr) {
+      pool->release(std::move(f.data));
+    }
+  }
+  co_return count;
+}
+
+coro::task<bool>
+ignoreReply(websocket::frame const&) {
+  co_return true;
+}
+
+coro::sync_task<void>
+pullPooledFrames(MemoryReadChannel& channel, websocket::buffer_pool& pool,
+                 std::vector<std::vector<char>>& received) {
+  for co_await (auto f : websocket::stream(channel, ignoreReply, &pool)) {
+    received.push_back(f.data);
+    pool.release(std::move(f.data));
+  }
+}
+}
+
+TEST(websocket, pooled_frames) {
+  FdCtx ctx;
+  MemoryReadSocket socket;
+  std::vector<char> payload{ 'H', 'e', 'y' };
+  for (int i = 0; i < 10; ++i) {
+    appendMaskedFrame(socket._data, websocket::opcode::TEXT_FRAME, payload);
+  }
+  MemoryReadChannel channel(ctx, socket, com::default_buffer_size);
+  websocket::buffer_pool pool;
+  std::vector<std::vector<char>> received;
+  auto task = pullPooledFrames(channel, pool, received);
+  task.start();
+  EXPECT_TRUE(task.done());
+  ASSERT_EQ(received.size(), 10ull);
+  EXPECT_EQ(received[9], payload);
+  EXPECT_EQ(pool.allocations(), 1ull);
+}
+
+TEST(websocket, benchmark_codec) {
+  constexpr std::size_t bytes = 256 * 1024 * 1024;
+  std::cout << "websocket: decoding " << (bytes >> 20) << " MiB" << std::endl;
+  for (std::size_t size : { 64, 1024, 64 * 1024 }) {
+    std::vector<char> payload(size, 'x');
+    auto count = bytes / size;
+    // Unmasking alone
+    char const key[4] = { 1, 2, 3, 4 };
+    auto gbps = [&](auto f) {
+      auto begin = std::chrono::steady_clock::now();
+      for (std::size_t i = 0; i < count; ++i) {
+        f();
+      }
+      auto seconds = std::chrono::duration<double>(
+        std::chrono::steady_clock::now() - begin).count();
+      return bytes / seconds * 1e-9;
+    };
+    auto bytewise = gbps([&]() {
+      auto data = payload.data();
+      for (std::size_t i = 0; i < size; ++i) {
+        data[i] ^= key[i % 4];
+      }
+      asm volatile("" : : "r"(data) : "memory");
+    });
+    auto vectorized = gbps([&]() {
+      websocket::unmask(payload.data(), size, key);
+      asm volatile("" : : "r"(payload.data()) : "memory");
+    });
+    // Whole frames from a receive buffer, into fresh and into pooled buffers
+    FdCtx ctx;
+    MemoryReadSocket socket;
+    auto frames = std::min<std::size_t>(count, 64 * 1024 * 1024 / (size + 14));
+    for (std::size_t i = 0; i < frames; ++i) {
+      appendMaskedFrame(socket._data, websocket::opcode::BINARY_FRAME, payload);
+    }
+    auto decode = [&](websocket::buffer_pool* pool) {
+      socket._offset = 0;
+      MemoryReadChannel channel(ctx, socket, com::default_buffer_size);
+      std::size_t decoded = 0;
+      auto begin = std::chrono::steady_clock::now();
+      auto task = readAll(channel, pool, decoded);
+      task.start();
+      auto seconds = std::chrono::duration<double>(
+        std::chrono::steady_clock::now() - begin).count();
+      EXPECT_EQ(task.result(), frames);
+      return decoded / seconds * 1e-9;
+    };
+    auto allocated = decode(nullptr);
+    websocket::buffer_pool pool;
+    auto pooled = decode(&pool);
+    std::cout << "  " << size << " byte payload: unmask bytewise "
+              << bytewise << " GB/s, vectorized " << vectorized
+              << " GB/s; decode into new buffers " << allocated
+              << " GB/s, into pooled buffers " << pooled << " GB/s ("
+              << pool.allocations() << " allocations for " << frames
+              << " frames)" << std::endl;
+  }
+}
+
+namespace {
+// Collects the replies to control frames
+struct Replies {
+  coro::task<bool>
+  operator () (websocket::frame const& f) {
+    websocket::frame copy;
+    copy.code = f.code;
+    copy.data = f.data;
+    _frames.push_back(std::move(copy));
+    co_return true;
+  }
+  std::vector<websocket::frame> _frames;
+};
+
+struct ReadChunk {
+  websocket::opcode code;
+  std::string data;
+  bool first;
+  bool last;
+};
+
+using MemoryReader = websocket::reader<FdCtx, MemoryReadSocket>;
+
+coro::sync_task<void>
+readChunks(MemoryReader& reader, Replies& replies,
+           std::vector<ReadChunk>& chunks) {
+  websocket::chunk c;
+  while (co_await reader.async_read_chunk(c, replies)) {
+    chunks.push_back({ c.code, std::string(c.data, c.size), c.first, c.last });
+  }
+}
+
+coro::sync_task<void>
+readMessages(MemoryReader& reader, Replies& replies,
+             websocket::buffer_pool& pool, std::vector<std::string>& messages) {
+  for co_await (auto m : websocket::messages(reader, std::ref(replies), &pool)) {
+    messages.emplace_back(m.data.begin(), m.data.end());
+    pool.release(std::move(m.data));
+  }
+}
+
+std::vector<char>
+bytes(std::size_t count, char first) {
+  std::vector<char> result(count);
+  for (std::size_t i = 0; i < count; ++i) {
+    result[i] = (char)(first + i);
+  }
+  return result;
+}
+
+std::vector<char>
+closeStatus(websocket::close_status status) {
+  return { (char)((int)status >> 8), (char)((int)status & 0xFF) };
+}
+}
+
+TEST(websocket, reader_chunks) {
+  FdCtx ctx;
+  MemoryReadSocket socket;
+  auto head = bytes(1500, 'a');
+  auto tail = bytes(1000, 'b');
+  appendMaskedFrame(socket._data, websocket::opcode::TEXT_FRAME, head, false);
+  appendMaskedFrame(socket._data, websocket::opcode::PING, { 'p' });
+  appendMaskedFrame(socket._data, websocket::opcode::CONTINUATION_FRAME, tail);
+  appendMaskedFrame(socket._data, websocket::opcode::BINARY_FRAME, {});
+  MemoryReadChannel channel(ctx, socket, com::default_buffer_size);
+  MemoryReader reader(channel, websocket::limits{ 4096, 4096, 1000 });
+  Replies replies;
+  std::vector<ReadChunk> chunks;
+  auto task = readChunks(reader, replies, chunks);
+  task.start();
+  ASSERT_TRUE(task.done());
+  ASSERT_EQ(chunks.size(), 4ull);
+  EXPECT_EQ(chunks[0].data, std::string(head.begin(), head.begin() + 1000));
+  EXPECT_EQ(chunks[1].data, std::string(head.begin() + 1000, head.end()));
+  EXPECT_EQ(chunks[2].data, std::string(tail.begin(), tail.end()));
+  EXPECT_EQ(chunks[2].code, websocket::opcode::TEXT_FRAME);
+  EXPECT_TRUE(chunks[0].first);
+  EXPECT_FALSE(chunks[1].first || chunks[1].last);
+  EXPECT_TRUE(chunks[2].last);
+  // Empty messages come as one empty chunk
+  EXPECT_EQ(chunks[3].code, websocket::opcode::BINARY_FRAME);
+  EXPECT_TRUE(chunks[3].first && chunks[3].last && chunks[3].data.empty());
+  ASSERT_EQ(replies._frames.size(), 1ull);
+  EXPECT_EQ(replies._frames[0].code, websocket::opcode::PONG);
+  EXPECT_EQ(replies._frames[0].data, std::vector<char>{ 'p' });
+  // Connection lost, not closed
+  EXPECT_EQ(reader.status(), 0);
+}
+
+TEST(websocket, reader_refuses_huge_frame) {
+  FdCtx ctx;
+  MemoryReadSocket socket;
+  // A terabyte, announced in 14 bytes
+  socket._data = { (char)0x82, (char)0xFF, 0, 0, 1, 0, 0, 0, 0, 0, 1, 2, 3, 4 };
+  MemoryReadChannel channel(ctx, socket, com::default_buffer_size);
+  MemoryReader reader(channel);
+  Replies replies;
+  std::vector<ReadChunk> chunks;
+  auto task = readChunks(reader, replies, chunks);
+  task.start();
+  ASSERT_TRUE(task.done());
+  EXPECT_TRUE(chunks.empty());
+  EXPECT_EQ(reader.status(), 1009);
+  ASSERT_EQ(replies._frames.size(), 1ull);
+  EXPECT_EQ(replies._frames[0].code, websocket::opcode::CLOSE);
+  EXPECT_EQ(replies._frames[0].data,
+            closeStatus(websocket::close_status::MESSAGE_TOO_BIG));
+
+  // Frame by frame as well
+  socket._offset = 0;
+  MemoryReadChannel frames(ctx, socket);
+  websocket::frame f;
+  auto read = [&]() -> coro::sync_task<bool> {
+    co_return co_await websocket::async_read(frames, f);
+  };
+  auto result = read();
+  result.start();
+  EXPECT_FALSE(result.result());
+}
+
+TEST(websocket, reader_refuses_huge_message) {
+  FdCtx ctx;
+  MemoryReadSocket socket;
+  appendMaskedFrame(socket._data, websocket::opcode::TEXT_FRAME, bytes(60, 'a'), false);
+  appendMaskedFrame(socket._data, websocket::opcode::CONTINUATION_FRAME, bytes(60, 'b'));
+  MemoryReadChannel channel(ctx, socket, com::default_buffer_size);
+  MemoryReader reader(channel, websocket::limits{ 100, 100, 100 });
+  Replies replies;
+  std::vector<ReadChunk> chunks;
+  auto task = readChunks(reader, replies, chunks);
+  task.start();
+  ASSERT_TRUE(task.done());
+  EXPECT_EQ(chunks.size(), 1ull);
+  EXPECT_EQ(reader.status(), 1009);
+}
+
+TEST(websocket, reader_protocol_error) {
+  FdCtx ctx;
+  MemoryReadSocket socket;
+  appendMaskedFrame(socket._data, websocket::opcode::CONTINUATION_FRAME, bytes(10, 'a'));
+  MemoryReadChannel channel(ctx, socket, com::default_buffer_size);
+  MemoryReader reader(channel);
+  Replies replies;
+  std::vector<ReadChunk> chunks;
+  auto task = readChunks(reader, replies, chunks);
+  task.start();
+  ASSERT_TRUE(task.done());
+  EXPECT_TRUE(chunks.empty());
+  EXPECT_EQ(reader.status(), 1002);
+  ASSERT_EQ(replies._frames.size(), 1ull);
+  EXPECT_EQ(replies._frames[0].data,
+            closeStatus(websocket::close_status::PROTOCOL_ERROR));
+}
+
+TEST(websocket, messages_reassembled) {
+  FdCtx ctx;
+  MemoryReadSocket socket;
+  std::string expected;
+  for (int i = 0; i < 3; ++i) {
+    auto part = bytes(3000, (char)('a' + i));
+    expected.append(part.begin(), part.end());
+    appendMaskedFrame(socket._data, i == 0 ? websocket::opcode::TEXT_FRAME
+                                           : websocket::opcode::CONTINUATION_FRAME,
+                      part, i == 2);
+  }
+  appendMaskedFrame(socket._data, websocket::opcode::TEXT_FRAME, { 'H', 'e', 'y' });
+  appendMaskedFrame(socket._data, websocket::opcode::CLOSE, {});
+  MemoryReadChannel channel(ctx, socket, com::default_buffer_size);
+  MemoryReader reader(channel, websocket::limits{ 4096, 9000, 1024 });
+  Replies replies;
+  websocket::buffer_pool pool;
+  std::vector<std::string> messages;
+  auto task = readMessages(reader, replies, pool, messages);
+  task.start();
+  ASSERT_TRUE(task.done());
+  ASSERT_EQ(messages.size(), 2ull);
+  EXPECT_EQ(messages[0], expected);
+  EXPECT_EQ(messages[1], "Hey");
+  EXPECT_EQ(reader.status(), 1000);
+  ASSERT_EQ(replies._frames.size(), 1ull);
+  EXPECT_EQ(replies._frames[0].code, websocket::opcode::CLOSE);
+}
@@ -78,7 +78,7 @@ struct SHA1 {
   char data[20];
 };
 
-SHA1
+inline SHA1
 sha1(std::string const& str) {
   std::uint32_t h0 = 0x67452301;
   std::uint32_t h1 = 0xEFCDAB89;
@@ -7,7 +7,16 @@
 
 #include "utils.hpp"
 #include "com.hpp"
+#include "metrics.hpp"
 #include <vector>
+#include <memory>
+#include <cstring>
+#include <string_view>
+#if defined(__SSE2__) || defined(__AVX2__)
+#include <immintrin.h>
+#elif defined(__ARM_NEON)
+#include <arm_neon.h>
+#endif
 #include <iostream> // to be removed
 
 ////////////////////////////////////////////////////////////////////////////////
@@ -73,9 +82,109 @@ struct frame final {
   std::vector<char> data;
 }; // struct fram
 
+// XORs count bytes of data with the masking key, as if data started at byte
+// offset of a payload. Takes 32 or 16 bytes at a time where the target has
+// vector registers, 8 bytes at a time otherwise.
+static inline void
+unmask(char* data, std::size_t count, char const* key, std::size_t offset = 0) {
+  char rotated[4];
+  for (std::size_t i = 0; i < 4; ++i) {
+    rotated[i] = key[(offset + i) % 4];
+  }
+  std::uint32_t key32;
+  std::memcpy(&key32, rotated, 4);
+  std::size_t i = 0;
+#if defined(__AVX2__)
+  auto key256 = _mm256_set1_epi32((int)key32);
+  for (; i + 32 <= count; i += 32) {
+    auto p = reinterpret_cast<__m256i*>(data + i);
+    _mm256_storeu_si256(p, _mm256_xor_si256(_mm256_loadu_si256(p), key256));
+  }
+#endif
+#if defined(__SSE2__)
+  auto key128 = _mm_set1_epi32((int)key32);
+  for (; i + 16 <= count; i += 16) {
+    auto p = reinterpret_cast<__m128i*>(data + i);
+    _mm_storeu_si128(p, _mm_xor_si128(_mm_loadu_si128(p), key128));
+  }
+#elif defined(__ARM_NEON)
+  auto key128 = vreinterpretq_u8_u32(vdupq_n_u32(key32));
+  for (; i + 16 <= count; i += 16) {
+    auto p = reinterpret_cast<std::uint8_t*>(data + i);
+    vst1q_u8(p, veorq_u8(vld1q_u8(p), key128));
+  }
+#endif
+  std::uint64_t key64 = ((std::uint64_t)key32 << 32) | key32;
+  for (; i + 8 <= count; i += 8) {
+    std::uint64_t v;
+    std::memcpy(&v, data + i, 8);
+    v ^= key64;
+    std::memcpy(data + i, &v, 8);
+  }
+  for (; i < count; ++i) {
+    data[i] ^= rotated[i % 4];
+  }
+}
+
+// Payload buffers of one connection. Frames are decoded into the buffers of
+// earlier frames that were given back, so a connection that keeps reading
+// frames of similar sizes stops allocating. Large buffers are not kept.
+class buffer_pool final {
+public:
+  explicit buffer_pool(std::size_t maxBuffers = 4,
+                       std::size_t maxCapacity = 64 * 1024)
+    : mMaxBuffers(maxBuffers), mMaxCapacity(maxCapacity) {}
+  buffer_pool(buffer_pool const&) = delete;
+  buffer_pool& operator = (buffer_pool const&) = delete;
+
+  // A buffer of size bytes, of undefined content
+  std::vector<char> acquire(std::size_t size) {
+    std::vector<char> buffer;
+    if (!mBuffers.empty()) {
+      buffer = std::move(mBuffers.back());
+      mBuffers.pop_back();
+    }
+    if (buffer.capacity() < size) {
+      mAllocations++;
+    }
+    buffer.resize(size);
+    return buffer;
+  }
+  void release(std::vector<char>&& buffer) {
+    if (buffer.capacity() > 0 && buffer.capacity() <= mMaxCapacity &&
+        mBuffers.size() < mMaxBuffers) {
+      mBuffers.push_back(std::move(buffer));
+    }
+    buffer = std::vector<char>();
+  }
+  // Buffers acquired that needed an allocation
+  std::size_t allocations() const {
+    return mAllocations;
+  }
+
+private:
+  std::size_t mMaxBuffers;
+  std::size_t mMaxCapacity;
+  std::size_t mAllocations = 0;
+  std::vector<std::vector<char>> mBuffers;
+};
+
+// Largest payload a frame may have unless told otherwise. Frames are only
+// allocated for once their length is known to be within the limit.
+constexpr std::size_t default_max_frame_size = 1024 * 1024;
+
+struct frame_header {
+  bool fin = true;
+  opcode code = opcode::CONTINUATION_FRAME;
+  std::uint64_t length = 0;
+  char key[4] = {};
+};
+
+// Reads and checks the header of a frame sent by a client
 template<typename async_ctx, typename async_io_if>
 static coro::task<bool>
-async_read(com::channel<async_ctx, async_io_if>& channel, frame& out) {
+async_read_header(com::channel<async_ctx, async_io_if>& channel,
+                  frame_header& out) {
   char buffer[8];
   if (!co_await channel.async_read(buffer, 2)) {
     // unexpected eof
@@ -111,67 +220,129 @@ async_read(com::channel<async_ctx, async_io_if>& channel, frame& out) {
     std::cout << "error: mask required!" << std::endl;
     co_return false;
   }
-  if (!co_await channel.async_read(buffer, 4)) {
+  if (!co_await channel.async_read(out.key, 4)) {
     // unexpected eof
     std::cout << "error: unexpected eof!" << std::endl;
     co_return false;
   }
-
-  std::vector<char> data(length);
-  if (!co_await channel.async_read(data.data(), length)) {
-    // unexpected eof
-    co_return false;
-  }
-  for (std::size_t i = 0; i < length; ++i) {
-    data[i] ^= buffer[i % 4];
-  }
   out.fin = fin;
   out.code = code;
-  out.data = std::move(data);
+  out.length = length;
   co_return true;
 }
 
+// Reads the next frame into out. The payload goes into a buffer of pool, the
+// buffer out held before goes back to it. Without a pool the payload reuses
+// the buffer of out. Frames larger than maxSize are refused.
 template<typename async_ctx, typename async_io_if>
 static coro::task<bool>
-async_write(com::channel<async_ctx, async_io_if>& channel, frame const& in) {
-  char buffer[10];
-  buffer[0] = (char)(in.fin ? 0x80 : 0x00) | (char)in.code;
-  auto count = in.data.size();
-  std::size_t headerSize = 0;
+async_read(com::channel<async_ctx, async_io_if>& channel, frame& out,
+           buffer_pool* pool = nullptr,
+           std::size_t maxSize = default_max_frame_size) {
+  frame_header header;
+  if (!co_await async_read_header(channel, header)) {
+    co_return false;
+  }
+  if (header.length > maxSize) {
+    // too large
+    co_return false;
+  }
+  auto length = (std::size_t)header.length;
+  if (pool != nullptr) {
+    pool->release(std::move(out.data));
+    out.data = pool->acquire(length);
+  } else {
+    out.data.resize(length);
+  }
+  if (!co_await channel.async_read(out.data.data(), length)) {
+    // unexpected eof
+    co_return false;
+  }
+  unmask(out.data.data(), length, header.key);
+  out.fin = header.fin;
+  out.code = header.code;
+  metrics::add(metrics::counter::WEBSOCKET_FRAMES_IN);
+  co_return true;
+}
+
+// Writes the header of an unmasked frame with count bytes of payload into
+// buffer, which must hold at least max_header_size bytes. Returns the size of
+// the header.
+static constexpr std::size_t max_header_size = 10;
+
+static inline std::size_t
+encode_header(char* buffer, bool fin, opcode code, std::uint64_t count) {
+  buffer[0] = (char)(fin ? 0x80 : 0x00) | (char)code;
   if (count > 65535) {
     buffer[1] = 127;
     utils::write_be(buffer + 2, (std::uint64_t)count);
-    headerSize = 10;
+    return 10;
   } else if (count > 125) {
     buffer[1] = 126;
     utils::write_be(buffer + 2, (std::uint16_t)count);
-    headerSize = 4;
+    return 4;
   } else {
     buffer[1] = (char)count;
-    headerSize = 2;
+    return 2;
   }
-  if (!co_await channel.async_write(buffer, headerSize)) {
-    // unexpected eof
-    co_return false;
-  }
-  if (!co_await channel.async_write(in.data.data(), in.data.size())) {
+}
+
+template<typename async_ctx, typename async_io_if>
+static coro::task<bool>
+async_write(com::channel<async_ctx, async_io_if>& channel, frame const& in) {
+  char buffer[max_header_size];
+  auto headerSize = encode_header(buffer, in.fin, in.code, in.data.size());
+  iovec parts[2] = {
+    { buffer, headerSize },
+    { const_cast<char*>(in.data.data()), in.data.size() }
+  };
+  if (!co_await channel.async_writev(parts, 2)) {
     // unexpected eof
     co_return false;
   }
+  metrics::add(metrics::counter::WEBSOCKET_FRAMES_OUT);
   co_return true;
 }
 
+// A frame as it goes over the wire, header and payload in one buffer. It is
+// encoded once and then shared by everybody it is sent to.
+using shared_frame = std::shared_ptr<std::vector<char> const>;
+
+static inline shared_frame
+encode(opcode code, char const* data, std::size_t count, bool fin = true) {
+  auto wire = std::make_shared<std::vector<char>>(max_header_size + count);
+  auto headerSize = encode_header(wire->data(), fin, code, count);
+  std::copy(data, data + count, wire->data() + headerSize);
+  wire->resize(headerSize + count);
+  return wire;
+}
+
+static inline shared_frame
+encode(frame const& in) {
+  return encode(in.code, in.data.data(), in.data.size(), in.fin);
+}
+
+static inline bool
+is_control(shared_frame const& f) {
+  return is_control((opcode)((*f)[0] & 0x0F));
+}
+
+// Writes text as a single frame, without copying it
 template<typename async_ctx, typename async_io_if>
 static coro::task<bool>
 async_send_text(com::channel<async_ctx, async_io_if>& channel,
-                std::string const& text) {
-  frame f;
-  f.fin = true;
-  f.code = opcode::BINARY_FRAME;
-  f.data = std::vector<char>(text.begin(), text.end());
-  if (!co_await async_write(channel, f)) {
+                std::string_view text) {
+  char buffer[max_header_size];
+  auto headerSize = encode_header(buffer, true, opcode::TEXT_FRAME, text.size());
+  iovec parts[2] = {
+    { buffer, headerSize },
+    { const_cast<char*>(text.data()), text.size() }
+  };
+  if (!co_await channel.async_writev(parts, 2)) {
+    // unexpected eof
     co_return false;
   }
+  metrics::add(metrics::counter::WEBSOCKET_FRAMES_OUT);
   co_return true;
 }
 
@@ -187,14 +358,19 @@ async_send_close(com::channel<async_ctx, async_io_if>& channel) {
   co_return true;
 }
 
-template<typename async_ctx, typename async_io_if>
+// Yields the data frames read from channel. Pings and closes are answered by
+// reply(frame const&), which returns an awaitable bool that is false if the
+// connection is gone. Payloads are read into buffers of pool, if there is one,
+// which the consumer may give back once it is done with a frame.
+template<typename async_ctx, typename async_io_if, typename reply_type>
 static coro::async_generator<frame>
-stream(com::channel<async_ctx, async_io_if>& channel) {
+stream(com::channel<async_ctx, async_io_if>& channel, reply_type reply,
+       buffer_pool* pool = nullptr) {
   bool continuation_fin = true;
   opcode continuation_code = opcode::CONTINUATION_FRAME;
   while (true) {
     frame f;
-    if (!co_await async_read(channel, f)) {
+    if (!co_await async_read(channel, f, pool)) {
       co_return;
     }
     if (f.code == opcode::CONTINUATION_FRAME) {
@@ -210,13 +386,13 @@ stream(com::channel<async_ctx, async_io_if>& channel) {
       continuation_code = f.code;
     }
     if (f.code == opcode::CLOSE) {
-      if (!co_await async_write(channel, f)) {
+      if (!co_await reply(f)) {
         co_return;
       }
       break;
     } else if (f.code == opcode::PING) {
       f.code = opcode::PONG;
-      if (!co_await async_write(channel, f)) {
+      if (!co_await reply(f)) {
         co_return;
       }
     } else if (f.code == opcode::PONG) {
@@ -227,6 +403,199 @@ stream(com::channel<async_ctx, async_io_if>& channel) {
   }
 }
 
+// Answers pings and closes by writing to the channel
+template<typename async_ctx, typename async_io_if>
+static coro::async_generator<frame>
+stream(com::channel<async_ctx, async_io_if>& channel) {
+  return stream(channel, [&channel](frame const& f) {
+    return async_write(channel, f);
+  });
+}
+
+// Status codes of close frames
+enum class close_status : std::uint16_t {
+  NORMAL = 1000,
+  PROTOCOL_ERROR = 1002,
+  MESSAGE_TOO_BIG = 1009
+};
+
+// What a client may send on one connection
+struct limits {
+  // Payload of a single frame
+  std::size_t max_frame_size = default_max_frame_size;
+  // Payload of a message, summed up over its frames
+  std::size_t max_message_size = default_max_frame_size;
+  // Largest piece of payload handed out at once
+  std::size_t chunk_size = 16 * 1024;
+};
+
+// Piece of the payload of a data message, valid until the next read
+struct chunk {
+  opcode code = opcode::CONTINUATION_FRAME; // of the message
+  char const* data = nullptr;
+  std::size_t size = 0;
+  bool first = false; // the message begins with it
+  bool last = false;  // the message ends with it
+};
+
+// Reads the data messages of a connection in chunks, as the bytes arrive,
+// with a buffer of a single chunk. Control frames are answered on the way. A
+// client that breaks the protocol or the limits is sent a close frame with
+// the reason, before anything is allocated for what it announced.
+template<typename async_ctx, typename async_io_if>
+class reader final {
+public:
+  explicit reader(com::channel<async_ctx, async_io_if>& channel,
+                  limits const& l = limits())
+    : mChannel(channel), mLimits(l)
+    , mBuffer(new char[std::max<std::size_t>(l.chunk_size, 1)]) {}
+  reader(reader const&) = delete;
+  reader& operator = (reader const&) = delete;
+
+  // Reads the next chunk. Pings and closes are answered by reply, as with
+  // stream(). False once reading ended, status() tells why.
+  template<typename reply_type>
+  coro::task<bool> async_read_chunk(chunk& out, reply_type& reply) {
+    while (!mInFrame) {
+      frame_header header;
+      if (!co_await async_read_header(mChannel, header)) {
+        co_return false;
+      }
+      mReads++;
+      metrics::add(metrics::counter::WEBSOCKET_FRAMES_IN);
+      if (is_control(header.code)) {
+        frame f;
+        f.code = header.code;
+        f.data.resize(header.length);
+        if (!co_await mChannel.async_read(f.data.data(), f.data.size())) {
+          // unexpected eof
+          co_return false;
+        }
+        unmask(f.data.data(), f.data.size(), header.key);
+        if (f.code == opcode::CLOSE) {
+          mStatus = (std::uint16_t)close_status::NORMAL;
+          co_await reply(f);
+          co_return false;
+        } else if (f.code == opcode::PING) {
+          f.code = opcode::PONG;
+          if (!co_await reply(f)) {
+            co_return false;
+          }
+        }
+        continue;
+      }
+      if ((header.code == opcode::CONTINUATION_FRAME) != mInMessage) {
+        // spurious continuation, or a message within a message
+        co_return co_await fail(close_status::PROTOCOL_ERROR, reply);
+      }
+      if (!mInMessage) {
+        mMessageSize = 0;
+      }
+      if (header.length > mLimits.max_frame_size ||
+          header.length > mLimits.max_message_size - mMessageSize) {
+        co_return co_await fail(close_status::MESSAGE_TOO_BIG, reply);
+      }
+      if (!mInMessage) {
+        mInMessage = true;
+        mFirst = true;
+        mCode = header.code;
+      }
+      mInFrame = true;
+      mFin = header.fin;
+      mLeft = header.length;
+      mOffset = 0;
+      std::memcpy(mKey, header.key, 4);
+      mMessageSize += header.length;
+    }
+    auto count = (std::size_t)std::min<std::uint64_t>(mLeft, mLimits.chunk_size);
+    if (!co_await mChannel.async_read(mBuffer.get(), count)) {
+      // unexpected eof
+      co_return false;
+    }
+    mReads++;
+    unmask(mBuffer.get(), count, mKey, mOffset);
+    mOffset += count;
+    mLeft -= count;
+    out.code = mCode;
+    out.data = mBuffer.get();
+    out.size = count;
+    out.first = std::exchange(mFirst, false);
+    out.last = mLeft == 0 && mFin;
+    if (mLeft == 0) {
+      mInFrame = false;
+      mInMessage = !mFin;
+    }
+    co_return true;
+  }
+
+  // The status of the close frame that ended reading, zero if the connection
+  // was lost
+  std::uint16_t status() const {
+    return mStatus;
+  }
+  // Frame headers and chunks read so far, grows while the client sends
+  // anything at all, pongs included
+  std::size_t reads() const {
+    return mReads;
+  }
+
+private:
+  template<typename reply_type>
+  coro::task<bool> fail(close_status status, reply_type& reply) {
+    mStatus = (std::uint16_t)status;
+    frame f;
+    f.code = opcode::CLOSE;
+    f.data.resize(2);
+    utils::write_be(f.data.data(), (std::uint16_t)status);
+    co_await reply(f);
+    co_return false;
+  }
+
+  com::channel<async_ctx, async_io_if>& mChannel;
+  limits mLimits;
+  std::unique_ptr<char[]> mBuffer;
+  std::uint16_t mStatus = 0;
+  std::size_t mReads = 0;
+  // The message being read
+  bool mInMessage = false;
+  bool mFirst = false;
+  opcode mCode = opcode::CONTINUATION_FRAME;
+  std::size_t mMessageSize = 0;
+  // The frame being read
+  bool mInFrame = false;
+  bool mFin = true;
+  std::uint64_t mLeft = 0;
+  std::size_t mOffset = 0;
+  char mKey[4] = {};
+};
+
+// Yields whole data messages read by r, reassembled from their frames. No
+// message takes more than the limit on message size of r. Payloads are read
+// into buffers of pool, if there is one.
+template<typename async_ctx, typename async_io_if, typename reply_type>
+static coro::async_generator<frame>
+messages(reader<async_ctx, async_io_if>& r, reply_type reply,
+         buffer_pool* pool = nullptr) {
+  frame message;
+  chunk c;
+  while (co_await r.async_read_chunk(c, reply)) {
+    if (c.first) {
+      if (pool != nullptr) {
+        pool->release(std::move(message.data));
+        message.data = pool->acquire(0);
+      } else {
+        message.data.clear();
+      }
+      message.code = c.code;
+    }
+    message.data.insert(message.data.end(), c.data, c.data + c.size);
+    if (c.last) {
+      co_yield std::move(message);
+      message = frame();
+    }
+  }
+}
+
 } // namespace websocket
 
 ////////////////////////////////////////////////////////////////////////////////
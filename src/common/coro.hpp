@@ -7,6 +7,10 @@
 
 #include <experimental/coroutine>
 #include <optional>
+#include <utility>
+#include <algorithm>
+#include <new>
+#include <cstddef>
 #include <cassert>
 
 ////////////////////////////////////////////////////////////////////////////////
@@ -22,14 +26,233 @@ struct final_awaitable final {
   template<typename promise_type>
   constexpr std::experimental::coroutine_handle<>
   await_suspend(std::experimental::coroutine_handle<promise_type> handle) const noexcept {
+    if constexpr (requires { handle.promise().notify_done(); }) {
+      if (handle.promise().notify_done()) {
+        // The coroutine may be destroyed by now
+        return std::experimental::noop_coroutine();
+      }
+    }
     auto c = handle.promise().continuation();
     return c ? c : std::experimental::noop_coroutine();
   }
   constexpr void await_resume() const noexcept {}
 };
 
+// Allocates coroutine frames of tasks and async generators. Frames remember
+// their allocator, so they can be freed no matter which one is current.
+class frame_allocator {
+public:
+  virtual void* allocate(std::size_t size) = 0;
+  virtual void deallocate(void* block, std::size_t size) noexcept = 0;
+protected:
+  ~frame_allocator() = default;
+};
+
+namespace detail {
+
+// Frames are rounded up to multiples of the step and recycled per size class.
+// Larger ones come from the heap every time.
+constexpr std::size_t frame_size_step = 64;
+constexpr std::size_t frame_size_classes = 32;
+
+inline constexpr std::size_t
+size_class(std::size_t size) {
+  return (size + frame_size_step - 1) / frame_size_step - 1;
+}
+
+struct free_block {
+  free_block* next;
+};
+
+// Freed blocks, by size class
+class free_lists final {
+public:
+  void* pop(std::size_t size_class) noexcept {
+    auto block = _free[size_class];
+    if (block != nullptr) {
+      _free[size_class] = block->next;
+    }
+    return block;
+  }
+  void push(void* block, std::size_t size_class) noexcept {
+    auto b = static_cast<free_block*>(block);
+    b->next = _free[size_class];
+    _free[size_class] = b;
+  }
+  template<typename function_type>
+  void clear(function_type release) noexcept {
+    for (auto& list : _free) {
+      while (list != nullptr) {
+        auto next = list->next;
+        release(list);
+        list = next;
+      }
+    }
+  }
+private:
+  free_block* _free[frame_size_classes] = {};
+};
+
+inline bool& frame_pool_alive() {
+  thread_local bool alive = false;
+  return alive;
+}
+
+inline frame_allocator*& current_allocator() {
+  thread_local frame_allocator* current = nullptr;
+  return current;
+}
+
+} // namespace detail
+
+// The default: Keeps freed frames of the calling thread for reuse. Frames
+// freed on another thread go back to the heap.
+class frame_pool final : public frame_allocator {
+public:
+  frame_pool() {
+    detail::frame_pool_alive() = true;
+  }
+  ~frame_pool() {
+    detail::frame_pool_alive() = false;
+    _free.clear([](void* block) { ::operator delete(block); });
+  }
+  frame_pool(frame_pool const&) = delete;
+  frame_pool& operator = (frame_pool const&) = delete;
+
+  static frame_pool& local() {
+    thread_local frame_pool pool;
+    return pool;
+  }
+
+  void* allocate(std::size_t size) override {
+    auto c = detail::size_class(size);
+    if (c >= detail::frame_size_classes) {
+      return ::operator new(size);
+    }
+    if (auto block = _free.pop(c)) {
+      return block;
+    }
+    return ::operator new((c + 1) * detail::frame_size_step);
+  }
+  void deallocate(void* block, std::size_t size) noexcept override {
+    auto c = detail::size_class(size);
+    if (c >= detail::frame_size_classes || !detail::frame_pool_alive() ||
+        this != &local()) {
+      ::operator delete(block);
+      return;
+    }
+    _free.push(block, c);
+  }
+private:
+  detail::free_lists _free;
+};
+
+// Frames of one connection or job. Carves them from large chunks, reuses
+// freed ones and returns everything to the heap at once when destroyed. All
+// frames have to be gone by then, and all of them on the same thread.
+class frame_arena final : public frame_allocator {
+public:
+  explicit frame_arena(std::size_t chunk_size = 16 * 1024)
+    : _chunk_size(chunk_size) {}
+  ~frame_arena() {
+    assert(_live == 0 && "frames outlive their arena");
+    while (_chunks != nullptr) {
+      auto next = _chunks->next;
+      ::operator delete(_chunks);
+      _chunks = next;
+    }
+  }
+  frame_arena(frame_arena const&) = delete;
+  frame_arena& operator = (frame_arena const&) = delete;
+
+  void* allocate(std::size_t size) override {
+    _live++;
+    auto c = detail::size_class(size);
+    if (c >= detail::frame_size_classes) {
+      return ::operator new(size);
+    }
+    if (auto block = _free.pop(c)) {
+      return block;
+    }
+    auto rounded = (c + 1) * detail::frame_size_step;
+    if (_cursor + rounded > _end) {
+      // The rest of the current chunk is left unused
+      auto chunk_size = std::max(_chunk_size, rounded + chunk_header);
+      auto chunk = static_cast<detail::free_block*>(::operator new(chunk_size));
+      chunk->next = _chunks;
+      _chunks = chunk;
+      _cursor = reinterpret_cast<char*>(chunk) + chunk_header;
+      _end = reinterpret_cast<char*>(chunk) + chunk_size;
+    }
+    auto block = _cursor;
+    _cursor += rounded;
+    return block;
+  }
+  void deallocate(void* block, std::size_t size) noexcept override {
+    _live--;
+    auto c = detail::size_class(size);
+    if (c >= detail::frame_size_classes) {
+      ::operator delete(block);
+      return;
+    }
+    _free.push(block, c);
+  }
+private:
+  static constexpr std::size_t chunk_header = alignof(std::max_align_t);
+  std::size_t _chunk_size;
+  detail::free_block* _chunks = nullptr;
+  char* _cursor = nullptr;
+  char* _end = nullptr;
+  std::size_t _live = 0;
+  detail::free_lists _free;
+};
+
+// Where frames created on this thread come from
+inline frame_allocator* current_frame_allocator() {
+  auto current = detail::current_allocator();
+  return current != nullptr ? current : &frame_pool::local();
+}
+
+// Makes an allocator current for its lifetime. Anything that resumes a
+// coroutine from outside, like sync_task::start or an event loop callback,
+// restores the previous allocator once the coroutine suspends.
+class frame_allocator_scope final {
+public:
+  explicit frame_allocator_scope(frame_allocator* allocator) noexcept
+    : _previous(std::exchange(detail::current_allocator(), allocator)) {}
+  explicit frame_allocator_scope(frame_allocator& allocator) noexcept
+    : frame_allocator_scope(&allocator) {}
+  ~frame_allocator_scope() {
+    detail::current_allocator() = _previous;
+  }
+  frame_allocator_scope(frame_allocator_scope const&) = delete;
+  frame_allocator_scope& operator = (frame_allocator_scope const&) = delete;
+private:
+  frame_allocator* _previous;
+};
+
+// Base of promise types, takes their frames from the current allocator
+struct allocated_frame {
+  static void* operator new(std::size_t size) {
+    auto allocator = current_frame_allocator();
+    auto block = static_cast<char*>(allocator->allocate(size + header_size));
+    *reinterpret_cast<frame_allocator**>(block) = allocator;
+    return block + header_size;
+  }
+  static void operator delete(void* frame, std::size_t size) noexcept {
+    auto block = static_cast<char*>(frame) - header_size;
+    auto allocator = *reinterpret_cast<frame_allocator**>(block);
+    allocator->deallocate(block, size + header_size);
+  }
+private:
+  // Keeps frames aligned
+  static constexpr std::size_t header_size = alignof(std::max_align_t);
+};
+
+////////////////////////////////////////////////////////////////////////////////
+
 template<typename task_type, typename return_type>
-class task_promise final {
+class task_promise final : public allocated_frame {
   enum class state { running, done, exception };
 public:
   task_promise() {}
@@ -83,8 +306,23 @@ public:
   std::experimental::coroutine_handle<> continuation() const {
     return _continuation;
   }
+  // Called when the coroutine finished, instead of resuming a continuation.
+  // The callback may destroy the coroutine.
+  void set_done(void (*done)(void*), void* context) noexcept {
+    _done = done;
+    _done_context = context;
+  }
+  bool notify_done() const noexcept {
+    if (_done == nullptr) {
+      return false;
+    }
+    _done(_done_context);
+    return true;
+  }
 private:
   std::experimental::coroutine_handle<> _continuation = nullptr;
+  void (*_done)(void*) = nullptr;
+  void* _done_context = nullptr;
   state _state = state::running;
   union {
     return_type _return_value;
@@ -93,7 +331,7 @@ private:
 };
 
 template<typename task_type>
-class task_promise<task_type, void> final {
+class task_promise<task_type, void> final : public allocated_frame {
 public:
   task_promise() {}
   task_promise(task_promise const&) = delete;
@@ -125,8 +363,23 @@ public:
   std::experimental::coroutine_handle<> continuation() const {
     return _continuation;
   }
+  // Called when the coroutine finished, instead of resuming a continuation.
+  // The callback may destroy the coroutine.
+  void set_done(void (*done)(void*), void* context) noexcept {
+    _done = done;
+    _done_context = context;
+  }
+  bool notify_done() const noexcept {
+    if (_done == nullptr) {
+      return false;
+    }
+    _done(_done_context);
+    return true;
+  }
 private:
   std::experimental::coroutine_handle<> _continuation = nullptr;
+  void (*_done)(void*) = nullptr;
+  void* _done_context = nullptr;
   std::exception_ptr _exception = nullptr;
 };
 
@@ -156,6 +409,7 @@ public:
   sync_task& operator = (sync_task const&) = delete;
   sync_task& start() noexcept {
     if (_handle && !_handle.done()) {
+      frame_allocator_scope restore(current_frame_allocator());
       _handle.resume();
     }
     return *this;
@@ -167,6 +421,14 @@ public:
     }
     return task;
   }
+  // Calls done(context) when a started task finishes, e.g. to destroy it.
+  // Replaces then().
+  sync_task& on_done(void (*done)(void*), void* context) noexcept {
+    if (_handle && !_handle.done()) {
+      _handle.promise().set_done(done, context);
+    }
+    return *this;
+  }
   constexpr bool done() const noexcept {
     return _handle && _handle.done();
   }
@@ -341,7 +603,7 @@ struct generator {
 
 template<typename T>
 struct async_generator {
-  struct promise_type {
+  struct promise_type : allocated_frame {
     auto initial_suspend() {
       return std::experimental::suspend_always{};
     }
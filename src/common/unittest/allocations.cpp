@@ -0,0 +1,33 @@
+////////////////////////////////////////////////////////////////////////////////
+
+#include "allocations.hpp"
+#include <atomic>
+#include <cstdlib>
+#include <new>
+
+////////////////////////////////////////////////////////////////////////////////
+
+// Tests of other threads allocate as well
+static std::atomic<std::size_t> allocated{0};
+
+std::size_t allocations::count() {
+  return allocated.load(std::memory_order_relaxed);
+}
+
+// In a file of their own, so they are not inlined next to the allocations
+// they free
+void* operator new(std::size_t size) {
+  allocated.fetch_add(1, std::memory_order_relaxed);
+  if (auto p = std::malloc(size > 0 ? size : 1)) {
+    return p;
+  }
+  throw std::bad_alloc();
+}
+void operator delete(void* p) noexcept {
+  std::free(p);
+}
+void operator delete(void* p, std::size_t) noexcept {
+  std::free(p);
+}
+
+////////////////////////////////////////////////////////////////////////////////
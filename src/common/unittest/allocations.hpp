@@ -0,0 +1,25 @@
+////////////////////////////////////////////////////////////////////////////////
+
+#ifndef COMMON_UNITTEST_ALLOCATIONS_HPP
+#define COMMON_UNITTEST_ALLOCATIONS_HPP
+
+////////////////////////////////////////////////////////////////////////////////
+
+#include <cstddef>
+
+////////////////////////////////////////////////////////////////////////////////
+
+// Heap allocations of a checker. Counted by the global operator new of
+// allocations.cpp, which checkers that include this have to link.
+namespace allocations {
+
+// Allocations on all threads so far
+std::size_t count();
+
+} // namespace allocations
+
+////////////////////////////////////////////////////////////////////////////////
+
+#endif // COMMON_UNITTEST_ALLOCATIONS_HPP
+
+////////////////////////////////////////////////////////////////////////////////
@@ -1,7 +1,9 @@
 ////////////////////////////////////////////////////////////////////////////////
 
 #include "../coro.hpp"
+#include "allocations.hpp"
 #include <gtest/gtest.h>
+#include <chrono>
 
 ////////////////////////////////////////////////////////////////////////////////
 
@@ -151,6 +153,27 @@ TEST(coro, task_then) {
 
 ////////////////////////////////////////////////////////////////////////////////
 
+TEST(coro, task_on_done) {
+  Awaitable a;
+  std::optional<coro::sync_task<int>> t = awaitInt(a, 42);
+  struct result {
+    std::optional<coro::sync_task<int>>* task;
+    int value = 0;
+  } r{ &t };
+  t->start().on_done([](void* context) {
+    // Takes the result and destroys the task before it returns
+    auto r = static_cast<result*>(context);
+    r->value = (*r->task)->result();
+    r->task->reset();
+  }, &r);
+  EXPECT_EQ(r.value, 0);
+  a.resume();
+  EXPECT_EQ(r.value, 42);
+  EXPECT_FALSE(t);
+}
+
+////////////////////////////////////////////////////////////////////////////////
+
 namespace {
 struct Scope {
   Scope(bool& alive) : _alive(alive) { _alive = true; }
@@ -365,4 +388,115 @@ TEST(coro, mixed_generator) {
   }
 }
 
+namespace {
+// Every frame straight from the heap, like without a pool
+struct HeapFrames final : coro::frame_allocator {
+  void* allocate(std::size_t size) override {
+    _allocated++;
+    return ::operator new(size);
+  }
+  void deallocate(void* block, std::size_t) noexcept override {
+    _deallocated++;
+    ::operator delete(block);
+  }
+  std::size_t _allocated = 0;
+  std::size_t _deallocated = 0;
+};
+}
+
+coro::task<int> leaf(int i) { co_return i; }
+coro::task<int> twoLeaves(int i) { co_return co_await leaf(i) + co_await leaf(i); }
+coro::sync_task<long> manyLeaves(int count) {
+  long sum = 0;
+  for (int i = 0; i < count; ++i) {
+    sum += co_await twoLeaves(i);
+  }
+  co_return sum;
+}
+
+TEST(coro, frame_pool_reuses_frames) {
+  manyLeaves(10).start().result(); // warm up
+  auto before = allocations::count();
+  auto t = manyLeaves(1000);
+  t.start();
+  EXPECT_EQ(t.result(), 999l * 1000);
+  EXPECT_EQ(allocations::count(), before);
+}
+
+TEST(coro, frame_allocator_scope) {
+  HeapFrames heap;
+  {
+    coro::frame_allocator_scope scope(heap);
+    EXPECT_EQ(coro::current_frame_allocator(), &heap);
+    auto t = manyLeaves(10);
+    t.start();
+    EXPECT_EQ(heap._allocated, 1u + 10 * 3);
+    EXPECT_EQ(heap._deallocated, 10u * 3);
+  }
+  // Freed by the allocator it came from, not the current one
+  EXPECT_EQ(heap._deallocated, 1u + 10 * 3);
+  EXPECT_EQ(coro::current_frame_allocator(), &coro::frame_pool::local());
+}
+
+coro::sync_task<void> switchAllocator(coro::frame_allocator& allocator,
+                                      Awaitable& a) {
+  coro::frame_allocator_scope scope(allocator);
+  co_await a;
+  co_await leaf(0);
+}
+
+TEST(coro, frame_allocator_restored_on_suspend) {
+  HeapFrames heap;
+  Awaitable a;
+  auto t = switchAllocator(heap, a);
+  t.start();
+  EXPECT_FALSE(t.done());
+  EXPECT_EQ(coro::current_frame_allocator(), &coro::frame_pool::local());
+  EXPECT_EQ(heap._allocated, 0u);
+}
+
+TEST(coro, frame_arena) {
+  auto before = allocations::count();
+  {
+    coro::frame_arena arena;
+    coro::frame_allocator_scope scope(arena);
+    for (int i = 0; i < 100; ++i) {
+      manyLeaves(10).start().result();
+    }
+    Awaitable a;
+    auto t = asyncSum(a, {1, 2, 3});
+    t.start();
+    a.resume();
+    a.resume();
+    EXPECT_TRUE(t.done());
+    EXPECT_EQ(t.result(), 6);
+  }
+  // One chunk, besides the two copies of the vector
+  EXPECT_EQ(allocations::count() - before, 3u);
+}
+
+TEST(coro, benchmark_frame_allocations) {
+  constexpr int count = 1000000;
+  std::cout << "coro: " << count << " x 3 frames" << std::endl;
+  auto measure = [](char const* name, coro::frame_allocator* allocator) {
+    coro::frame_allocator_scope scope(allocator);
+    auto before = allocations::count();
+    auto start = std::chrono::steady_clock::now();
+    auto t = manyLeaves(count);
+    t.start();
+    std::chrono::duration<double> seconds = std::chrono::steady_clock::now() - start;
+    auto allocated = allocations::count() - before;
+    std::cout << "  " << name << ": " << count * 3 / seconds.count() / 1e6
+              << "M frames/s, " << allocated << " heap allocations"
+              << std::endl;
+    EXPECT_EQ(t.result(), (long)count * (count - 1));
+    return allocated;
+  };
+  HeapFrames heap;
+  coro::frame_arena arena;
+  EXPECT_EQ(measure("heap", &heap), 1u + count * 3);
+  EXPECT_LE(measure("pool", nullptr), 2u);
+  EXPECT_LE(measure("arena", &arena), 2u);
+}
+
 ////////////////////////////////////////////////////////////////////////////////